@@ -0,0 +1,205 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "database.hh"
+#include "record.hh"
+
+/** Seconds after which a triplet expires; half of the records are made
+ ** older than that.
+ ** ** **/
+const int64_t lifetime = 90 * 86400;
+
+double now() {
+  struct timespec ts;
+  ::clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Removes the records not seen since the cutoff, as tgreyclean does.
+ ** ** **/
+class expire_visitor : public tgrey::db_view_visitor {
+  public:
+    expire_visitor(int64_t c) : cutoff(c) {
+      /* empty */
+    }
+
+    virtual action visit(const tgrey::strview& key,
+                         const tgrey::strview& val) {
+      tgrey::record rec;
+      tgrey::decode_record(val.data, val.size, rec);
+
+      if(rec.lastseen >= cutoff)
+        return keep;
+
+      return remove;
+    }
+
+    const int64_t cutoff;
+};
+
+struct part {
+  part(tgrey::database& d, int64_t cutoff, size_t i, size_t n)
+    : db(d), vi(cutoff), idx(i), parts(n), removed(0) {
+    /* empty */
+  }
+
+  tgrey::database& db;
+  expire_visitor vi;
+  const size_t idx;
+  const size_t parts;
+  size_t removed;
+  pthread_t thread;
+};
+
+void* run_part(void* arg) {
+  part& p = *static_cast<part*>(arg);
+  p.removed = p.db.traverse_part(p.vi, p.idx, p.parts);
+  return 0;
+}
+
+/** Fill a new database with records, half of them expired.
+ ** ** **/
+void fill(tgrey::database& db, size_t records) {
+  const int64_t t = ::time(0);
+
+  for(size_t i = 0; i < records; ++i) {
+    std::ostringstream key;
+    key << "198.51." << i / 256 % 256 << '.' << i % 256
+        << "\x1fsender" << i << "@example.org\x1fuser@example.com";
+
+    tgrey::record rec;
+    rec.lastseen = rec.firstseen = i % 2 ? t : t - 2 * lifetime;
+    db.store(key.str(), tgrey::encode_record(rec));
+  }
+
+  db.commit();
+}
+
+/** Clean up with the given number of threads; returns the seconds taken
+ ** and the number of records removed.
+ ** ** **/
+double cleanup(tgrey::database& db, size_t threads, size_t& removed) {
+  const int64_t cutoff = ::time(0) - lifetime;
+  std::vector<part*> parts;
+
+  for(size_t i = 0; i < threads; ++i)
+    parts.push_back(new part(db, cutoff, i, threads));
+
+  double start = now();
+
+  for(size_t i = 0; i < threads; ++i)
+    if(::pthread_create(&parts[i]->thread, 0, &run_part, parts[i]))
+      throw std::runtime_error("error starting thread");
+
+  removed = 0;
+
+  for(size_t i = 0; i < threads; ++i) {
+    ::pthread_join(parts[i]->thread, 0);
+    removed += parts[i]->removed;
+    delete parts[i];
+  }
+
+  db.commit();
+  return now() - start;
+}
+
+void report(size_t threads, double secs, size_t records, double base) {
+  std::cout << "  " << std::setw(3) << threads << " threads"
+            << std::setw(10) << std::fixed << std::setprecision(3) << secs
+            << " s" << std::setw(9) << std::setprecision(1)
+            << secs / records * 1e9 << " ns/record" << std::setw(8)
+            << std::setprecision(2) << base / secs << "x" << std::endl;
+}
+
+/** Remove the databases created in dir, then dir itself.
+ ** ** **/
+void remove_dir(const std::string& dir) {
+  if(DIR* d = ::opendir(dir.c_str())) {
+    while(struct dirent* ent = ::readdir(d))
+      if(ent->d_name[0] != '.')
+        ::unlink((dir + "/" + ent->d_name).c_str());
+
+    ::closedir(d);
+  }
+
+  ::rmdir(dir.c_str());
+}
+
+int main(int argc, const char* argv[]) {
+  const size_t records = argc > 1 ? std::atol(argv[1]) : 200000;
+  const size_t max_threads = argc > 2 ? std::atol(argv[2]) : 8;
+  std::string engine = argc > 3 ? argv[3] : "mmap";
+
+  if(engine.compare(0, 4, "mmap") == 0 &&
+     engine.find("slots=") == std::string::npos) {
+    std::ostringstream slots;
+    slots << ",slots=" << records * 2;
+    engine += slots.str();
+  }
+
+  char tmpl[] = "/tmp/tgrey-bench-XXXXXX";
+
+  if(!::mkdtemp(tmpl)) {
+    std::cerr << "error creating temporary directory" << std::endl;
+    return 1;
+  }
+
+  const std::string dir(tmpl);
+  const size_t comma = engine.find(',');
+  double base = 0;
+
+  std::cout << "cleanup of " << records << " records, half of them "
+            << "expired, engine " << engine << std::endl << std::endl;
+
+  try {
+    for(size_t threads = 1; threads <= max_threads; ++threads) {
+      std::ostringstream spec;
+      spec << engine.substr(0, comma) << ':' << dir << "/cleanup-" << threads
+           << (comma != std::string::npos ? engine.substr(comma) : "");
+
+      tgrey::database db(spec.str());
+      db.open();
+      fill(db, records);
+
+      size_t removed;
+      double secs = cleanup(db, threads, removed);
+
+      if(threads == 1)
+        base = secs;
+
+      if(removed != records / 2)
+        throw std::runtime_error("cleanup removed the wrong records");
+
+      report(threads, secs, records, base);
+    }
+  }
+  catch(const std::exception& err) {
+    std::cerr << err.what() << std::endl;
+    remove_dir(dir);
+    return 1;
+  }
+
+  remove_dir(dir);
+  return 0;
+}
@@ -0,0 +1,234 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#include <time.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "kernels.hh"
+
+/** A request as sent by Postfix for a RCPT TO check, with all the
+ ** attributes tgreylist ignores.
+ ** ** **/
+const char* const sample_request =
+  "request=smtpd_access_policy\n"
+  "protocol_state=RCPT\n"
+  "protocol_name=ESMTP\n"
+  "client_address=198.51.100.23\n"
+  "client_name=mail-out.relay.example.net\n"
+  "client_port=48213\n"
+  "reverse_client_name=mail-out.relay.example.net\n"
+  "server_address=192.0.2.10\n"
+  "server_port=25\n"
+  "helo_name=mail-out.relay.example.net\n"
+  "sender=Bounces+SRS=Ab12Cd=Ef@Lists.Example.ORG\n"
+  "recipient=Some.User@Example.COM\n"
+  "recipient_count=0\n"
+  "queue_id=\n"
+  "instance=2d4f.5e1a7c3b.9d2e0.0\n"
+  "size=48213\n"
+  "etrn_domain=\n"
+  "stress=\n"
+  "sasl_method=\n"
+  "sasl_username=\n"
+  "sasl_sender=\n"
+  "ccert_subject=\n"
+  "ccert_issuer=\n"
+  "ccert_fingerprint=\n"
+  "ccert_pubkey_fingerprint=\n"
+  "encryption_protocol=TLSv1.3\n"
+  "encryption_cipher=TLS_AES_256_GCM_SHA384\n"
+  "encryption_keysize=256\n"
+  "policy_context=\n"
+  "server_name=mx1.example.com\n"
+  "compatibility_level=3.6\n"
+  "mail_version=3.7.11\n"
+  "\n";
+
+inline double now() {
+  struct timespec ts;
+  ::clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** The way requests were split into lines and key/value pairs before the
+ ** kernels were introduced.
+ ** ** **/
+size_t scan_stream(const std::string& req) {
+  std::istringstream iss(req);
+  size_t sum = 0;
+
+  for(std::string line; std::getline(iss, line) && !line.empty(); ) {
+    size_t pos = line.find('=');
+    if(pos != std::string::npos)
+      sum += pos;
+  }
+
+  return sum;
+}
+
+size_t scan_with(const std::string& req,
+                 const char* (*find_line)(const char*, const char*,
+                                          const char**)) {
+  const char* pos = req.data();
+  const char* end = pos + req.length();
+  size_t sum = 0;
+
+  while(true) {
+    const char* eq = 0;
+    const char* eol = find_line(pos, end, &eq);
+
+    if(eol == end || eol == pos)
+      break;
+
+    if(eq)
+      sum += eq - pos;
+
+    pos = eol + 1;
+  }
+
+  return sum;
+}
+
+size_t lower_transform(std::string& str) {
+  std::transform(str.begin(), str.end(), str.begin(), tolower);
+  return str[0];
+}
+
+size_t lower_with(std::string& str, void (*lowercase)(char*, size_t)) {
+  lowercase(&str[0], str.length());
+  return str[0];
+}
+
+void report(const std::string& name, double secs, size_t rounds,
+            double base) {
+  std::cout << "  " << std::left << std::setw(28) << name
+            << std::right << std::setw(9) << std::fixed
+            << std::setprecision(1) << secs / rounds * 1e9 << " ns"
+            << std::setw(8) << std::setprecision(2) << base / secs << "x"
+            << std::endl;
+}
+
+/** Compare the kernels with their scalar versions on random input before
+ ** measuring anything; a benchmark of wrong code is of no use.
+ ** ** **/
+bool verify() {
+  std::srand(42);
+
+  for(int round = 0; round < 20000; ++round) {
+    std::string buf(std::rand() % 200, 'x');
+
+    for(size_t i = 0; i < buf.length(); ++i) {
+      const char alphabet[] = "\n=aAzZ@[`{ \xc4\xe4";
+      buf[i] = alphabet[std::rand() % (sizeof(alphabet) - 1)];
+    }
+
+    const char* begin = buf.data();
+    const char* end = begin + buf.length();
+    const char* eq1 = 0;
+    const char* eq2 = 0;
+
+    if(   tgrey::kernels::find_line(begin, end, &eq1)
+            != tgrey::kernels::scalar::find_line(begin, end, &eq2)
+       || eq1 != eq2
+       || tgrey::kernels::find_pair(begin, end, '\n')
+            != tgrey::kernels::scalar::find_pair(begin, end, '\n'))
+      return false;
+
+    std::string a(buf), b(buf);
+    tgrey::kernels::lowercase(&a[0], a.length());
+    tgrey::kernels::scalar::lowercase(&b[0], b.length());
+    std::transform(buf.begin(), buf.end(), buf.begin(), tolower);
+
+    if(a != b || a != buf)
+      return false;
+  }
+
+  return true;
+}
+
+int main(int argc, const char* argv[]) {
+  const size_t rounds = argc > 1 ? std::atol(argv[1]) : 200000;
+  const std::string req(sample_request);
+  volatile size_t sink = 0;
+
+  if(!verify()) {
+    std::cerr << "kernels disagree with scalar implementation" << std::endl;
+    return 1;
+  }
+
+  std::cout << "kernels: " << tgrey::kernels::isa() << ", request of "
+            << req.length() << " bytes, " << rounds << " rounds"
+            << std::endl << std::endl << "request scanning" << std::endl;
+
+  double start = now();
+  for(size_t i = 0; i < rounds; ++i)
+    sink += scan_stream(req);
+  double base = now() - start;
+  report("getline/find", base, rounds, base);
+
+  start = now();
+  for(size_t i = 0; i < rounds; ++i)
+    sink += scan_with(req, tgrey::kernels::scalar::find_line);
+  report("scalar find_line", now() - start, rounds, base);
+
+  start = now();
+  for(size_t i = 0; i < rounds; ++i)
+    sink += scan_with(req, tgrey::kernels::find_line);
+  report("find_line", now() - start, rounds, base);
+
+  std::cout << std::endl << "end of request" << std::endl;
+
+  start = now();
+  for(size_t i = 0; i < rounds; ++i)
+    sink += req.find("\n\n");
+  base = now() - start;
+  report("std::string::find", base, rounds, base);
+
+  start = now();
+  for(size_t i = 0; i < rounds; ++i)
+    sink += tgrey::kernels::find_pair(req.data(), req.data() + req.length(),
+                                      '\n') - req.data();
+  report("find_pair", now() - start, rounds, base);
+
+  std::cout << std::endl << "case folding" << std::endl;
+
+  std::string field("Bounces+SRS=Ab12Cd=Ef@Lists.Example.ORG");
+  std::string copy;
+
+  start = now();
+  for(size_t i = 0; i < rounds; ++i) {
+    copy = field;
+    sink += lower_transform(copy);
+  }
+  base = now() - start;
+  report("std::transform(tolower)", base, rounds, base);
+
+  start = now();
+  for(size_t i = 0; i < rounds; ++i) {
+    copy = field;
+    sink += lower_with(copy, tgrey::kernels::scalar::lowercase);
+  }
+  report("scalar lowercase", now() - start, rounds, base);
+
+  start = now();
+  for(size_t i = 0; i < rounds; ++i) {
+    copy = field;
+    sink += lower_with(copy, tgrey::kernels::lowercase);
+  }
+  report("lowercase", now() - start, rounds, base);
+
+  return 0;
+}
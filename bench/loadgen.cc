@@ -0,0 +1,612 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "ext/propa.hh"
+
+#include "misc.hh"
+
+/** Generates policy requests as Postfix sends them and measures how
+ ** fast tgreylist answers them, either over a socket it listens on or
+ ** through pipes to instances spawned for every connection, as the
+ ** Postfix spawn service does. Every connection has a single request
+ ** outstanding at a time, as with Postfix.
+ **
+ ** Triplets are numbered. The first pool of them is cleared and the
+ ** second one waiting once the warm-up is done; triplets beyond are
+ ** new. Clearing needs tgreylist to be run with a --delay of at most
+ ** the --delay given here, which is waited for during the warm-up. The
+ ** waiting triplets stay so for as long as that delay, so runs should
+ ** not take longer.
+ ** ** **/
+struct options {
+  std::string listen;
+  std::string exec;
+  std::string replay;
+  size_t connections;
+  size_t requests;
+  size_t pool;
+  unsigned int delay;
+  unsigned int seed;
+  unsigned int mix[3];
+  unsigned int clients[3];
+};
+
+enum { mix_new, mix_wait, mix_cleared };
+enum { client_v4, client_v6, client_name };
+
+inline double now() {
+  struct timespec ts;
+  ::clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Parse three percentages separated by colons, adding up to 100.
+ ** ** **/
+void parse_shares(const std::string& value, unsigned int* shares,
+                  const char* what) {
+  char sep1 = 0, sep2 = 0;
+  std::istringstream iss(value);
+  iss >> shares[0] >> sep1 >> shares[1] >> sep2 >> shares[2];
+
+  if(   !iss || !iss.eof() || sep1 != ':' || sep2 != ':'
+     || shares[0] + shares[1] + shares[2] != 100)
+    throw std::runtime_error(std::string("invalid ") + what + ": " + value);
+}
+
+/** The xorshift64 generator; fast and reproducible for a given seed.
+ ** ** **/
+inline uint64_t next_random(uint64_t& state) {
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return state;
+}
+
+/** Pick one of three kinds by their shares.
+ ** ** **/
+inline unsigned int pick(const unsigned int* shares, uint64_t r) {
+  unsigned int p = r % 100;
+  return p < shares[0] ? 0 : p < shares[0] + shares[1] ? 1 : 2;
+}
+
+/** The request for a numbered triplet. Whether its client is known by
+ ** name or only by an IPv4 or IPv6 address depends on the number and
+ ** the seed alone, so that the triplet stays the same whenever it is
+ ** sent; other seeds give other triplets.
+ ** ** **/
+std::string make_request(const options& opts, uint64_t num) {
+  const uint64_t id = num + (uint64_t(opts.seed) << 40);
+  uint64_t r = id * 0x9e3779b97f4a7c15ull;
+  std::ostringstream req;
+
+  req << "request=smtpd_access_policy\n"
+      << "protocol_state=RCPT\n"
+      << "protocol_name=ESMTP\n";
+
+  switch(pick(opts.clients, r >> 32)) {
+    case client_v4:
+      req << "client_address=198.51." << id / 256 % 256 << '.' << id % 256
+          << "\nclient_name=unknown\n";
+      break;
+
+    case client_v6:
+      req << "client_address=2001:db8:" << std::hex << id / 65536 % 65536
+          << ':' << id % 65536 << std::dec << "::25\n"
+          << "client_name=unknown\n";
+      break;
+
+    default:
+      req << "client_address=203.0.113." << id % 256 << '\n'
+          << "client_name=mx" << id << ".relay.example.net\n";
+  }
+
+  req << "helo_name=relay.example.net\n"
+      << "sender=bounce-" << id << "@lists.example.org\n"
+      << "recipient=user" << id % 5000 << "@example.com\n"
+      << "queue_id=\n"
+      << "instance=" << std::hex << id << std::dec << ".0.0.0\n"
+      << "size=" << r % 100000 << "\n"
+      << "\n";
+
+  return req.str();
+}
+
+/** Read a dump of requests as sent by Postfix, one after the other,
+ ** each ended by an empty line.
+ ** ** **/
+void load_dump(const std::string& path, std::vector<std::string>& reqs) {
+  std::ifstream inp(path.c_str());
+
+  if(!inp)
+    throw std::runtime_error("cannot open request dump " + path);
+
+  std::string line, req;
+
+  while(std::getline(inp, line)) {
+    req += line + '\n';
+
+    if(line.empty()) {
+      if(req.length() > 1)
+        reqs.push_back(req);
+
+      req.clear();
+    }
+  }
+
+  if(reqs.empty())
+    throw std::runtime_error("no complete requests in dump " + path);
+}
+
+/** A connection to tgreylist, over a socket or over the pipes to and
+ ** from a process of its own.
+ ** ** **/
+class connection {
+  public:
+    connection(const options& opts) : rfd(-1), wfd(-1), pid(-1) {
+      if(!opts.exec.empty())
+        spawn(opts.exec);
+      else
+        dial(opts.listen);
+    }
+
+    ~connection() {
+      if(wfd != rfd)
+        ::close(wfd);
+
+      ::close(rfd);
+
+      if(pid > 0)
+        ::waitpid(pid, 0, 0);
+    }
+
+    /** Send a request and wait for the response.
+     ** ** **/
+    std::string ask(const std::string& req) {
+      for(size_t done = 0; done < req.length(); ) {
+        ssize_t num = ::write(wfd, req.data() + done, req.length() - done);
+
+        if(num < 0 && errno != EINTR)
+          throw tgrey::sys_error("error sending request");
+
+        done += num > 0 ? num : 0;
+      }
+
+      size_t end;
+
+      while((end = buf.find("\n\n")) == std::string::npos) {
+        char tmp[4096];
+        ssize_t num = ::read(rfd, tmp, sizeof(tmp));
+
+        if(num < 0 && errno == EINTR)
+          continue;
+
+        if(num <= 0)
+          throw std::runtime_error("connection closed by tgreylist");
+
+        buf.append(tmp, num);
+      }
+
+      std::string res = buf.substr(0, end + 2);
+      buf.erase(0, end + 2);
+      return res;
+    }
+
+  protected:
+    int rfd;
+    int wfd;
+    pid_t pid;
+    std::string buf;
+
+    void spawn(const std::string& cmd);
+    void dial(const std::string& addr);
+
+  private:
+    connection(const connection&);
+    connection& operator= (const connection&);
+};
+
+void connection::spawn(const std::string& cmd) {
+  int in[2], out[2];
+
+  // other children must not hold on to the ends kept here
+  if(::pipe2(in, O_CLOEXEC))
+    throw tgrey::sys_error("error creating pipe");
+
+  if(::pipe2(out, O_CLOEXEC)) {
+    ::close(in[0]);
+    ::close(in[1]);
+    throw tgrey::sys_error("error creating pipe");
+  }
+
+  pid = ::fork();
+
+  if(pid < 0) {
+    int errnum = errno;
+    ::close(in[0]);
+    ::close(in[1]);
+    ::close(out[0]);
+    ::close(out[1]);
+    errno = errnum;
+    throw tgrey::sys_error("error starting " + cmd);
+  }
+
+  if(!pid) {
+    ::dup2(in[0], STDIN_FILENO);
+    ::dup2(out[1], STDOUT_FILENO);
+    ::close(in[0]);
+    ::close(in[1]);
+    ::close(out[0]);
+    ::close(out[1]);
+    ::execl("/bin/sh", "sh", "-c", cmd.c_str(), (char*) 0);
+    ::_exit(127);
+  }
+
+  ::close(in[0]);
+  ::close(out[1]);
+  wfd = in[1];
+  rfd = out[0];
+}
+
+/** Connect to the address tgreylist --listen was given, in the same
+ ** notation.
+ ** ** **/
+void connection::dial(const std::string& address) {
+  std::string addr = address;
+  bool is_unix = addr.find('/') != std::string::npos;
+
+  if(addr.compare(0, 5, "unix:") == 0) {
+    addr = addr.substr(5);
+    is_unix = true;
+  }
+  else if(addr.compare(0, 5, "inet:") == 0) {
+    addr = addr.substr(5);
+    is_unix = false;
+  }
+
+  if(is_unix) {
+    struct sockaddr_un sun;
+
+    if(addr.length() >= sizeof(sun.sun_path))
+      throw std::runtime_error("socket path too long: " + addr);
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strncpy(sun.sun_path, addr.c_str(), sizeof(sun.sun_path) - 1);
+
+    rfd = wfd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if(rfd < 0)
+      throw tgrey::sys_error("error creating socket");
+
+    if(::connect(rfd, (struct sockaddr*) &sun, sizeof(sun)))
+      throw tgrey::sys_error("error connecting to " + addr);
+
+    return;
+  }
+
+  size_t pos = addr.rfind(':');
+
+  if(pos == std::string::npos)
+    throw std::runtime_error("address lacks a port: " + addr);
+
+  std::string host = addr.substr(0, pos);
+
+  if(host.length() >= 2 && host[0] == '[' && host[host.length() - 1] == ']')
+    host = host.substr(1, host.length() - 2);
+
+  struct addrinfo hints;
+  struct addrinfo* result = 0;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  int err = ::getaddrinfo(host.c_str(), addr.c_str() + pos + 1, &hints,
+                          &result);
+
+  if(err || !result)
+    throw std::runtime_error("cannot resolve address " + addr + ": " +
+                             std::string(::gai_strerror(err)));
+
+  rfd = wfd = ::socket(result->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+  if(rfd < 0) {
+    ::freeaddrinfo(result);
+    throw tgrey::sys_error("error creating socket");
+  }
+
+  err = ::connect(rfd, result->ai_addr, result->ai_addrlen);
+  ::freeaddrinfo(result);
+
+  if(err)
+    throw tgrey::sys_error("error connecting to " + addr);
+}
+
+/** State of one of the connections sending requests in parallel.
+ ** ** **/
+struct worker {
+  const options* opts;
+  const std::vector<std::string>* dump;
+  size_t idx;
+  size_t requests;
+  pthread_t thread;
+
+  std::vector<double> latencies;
+  size_t dunno;
+  size_t defer;
+  size_t other;
+  std::string error;
+};
+
+/** Number of the next new triplet, shared by all workers.
+ ** ** **/
+uint64_t next_new;
+
+void* worker_main(void* arg) {
+  worker& w = *static_cast<worker*>(arg);
+  const options& opts = *w.opts;
+  uint64_t state = (uint64_t(opts.seed) << 32) + w.idx + 1;
+
+  try {
+    connection conn(opts);
+    w.latencies.reserve(w.requests);
+
+    for(size_t i = 0; i < w.requests; ++i) {
+      std::string req;
+
+      if(w.dump)
+        req = (*w.dump)[(w.idx + i * opts.connections) % w.dump->size()];
+      else {
+        uint64_t r = next_random(state);
+        uint64_t id;
+
+        switch(pick(opts.mix, r)) {
+          case mix_new:
+            id = __sync_fetch_and_add(&next_new, 1);
+            break;
+
+          case mix_wait:
+            id = opts.pool + (r >> 8) % opts.pool;
+            break;
+
+          default:
+            id = (r >> 8) % opts.pool;
+        }
+
+        req = make_request(opts, id);
+      }
+
+      double start = now();
+      std::string res = conn.ask(req);
+      w.latencies.push_back(now() - start);
+
+      if(res.compare(0, 13, "action=dunno\n") == 0)
+        w.dunno++;
+      else if(res.compare(0, 23, "action=defer_if_permit ") == 0)
+        w.defer++;
+      else
+        w.other++;
+    }
+  }
+  catch(const std::exception& err) {
+    w.error = err.what();
+  }
+
+  return 0;
+}
+
+/** Make the first pool of triplets cleared and the second one waiting.
+ ** ** **/
+void warm_up(const options& opts) {
+  if(!opts.pool || (!opts.mix[mix_wait] && !opts.mix[mix_cleared]))
+    return;
+
+  connection conn(opts);
+
+  std::cout << "warming up " << opts.pool << " cleared and " << opts.pool
+            << " waiting triplets" << std::endl;
+
+  for(size_t id = 0; id < opts.pool; ++id)
+    conn.ask(make_request(opts, id));
+
+  // delays are checked with second granularity
+  ::sleep(opts.delay + 1);
+
+  for(size_t id = 0; id < opts.pool; ++id)
+    conn.ask(make_request(opts, id));
+
+  for(size_t id = opts.pool; id < 2 * opts.pool; ++id)
+    conn.ask(make_request(opts, id));
+}
+
+inline double quantile(const std::vector<double>& sorted, double q) {
+  return sorted[std::min(sorted.size() - 1, size_t(q * sorted.size()))];
+}
+
+void report(std::vector<worker>& workers, double secs) {
+  std::vector<double> all;
+  size_t dunno = 0, defer = 0, other = 0;
+
+  for(size_t i = 0; i < workers.size(); ++i) {
+    all.insert(all.end(), workers[i].latencies.begin(),
+               workers[i].latencies.end());
+    dunno += workers[i].dunno;
+    defer += workers[i].defer;
+    other += workers[i].other;
+  }
+
+  if(all.empty())
+    return;
+
+  std::sort(all.begin(), all.end());
+
+  std::cout << std::fixed << std::setprecision(0)
+            << all.size() << " requests over " << workers.size()
+            << " connections in " << std::setprecision(3) << secs << " s, "
+            << std::setprecision(0) << all.size() / secs << " requests/s"
+            << std::endl << "responses: " << dunno << " dunno, " << defer
+            << " defer, " << other << " other" << std::endl
+            << std::setprecision(1) << "latency (us): p50 "
+            << quantile(all, 0.5) * 1e6 << ", p90 "
+            << quantile(all, 0.9) * 1e6 << ", p99 "
+            << quantile(all, 0.99) * 1e6 << ", p99.9 "
+            << quantile(all, 0.999) * 1e6 << ", max "
+            << all.back() * 1e6 << std::endl;
+}
+
+int main(int argc, const char* argv[]) {
+  options opts;
+  opts.connections = 1;
+  opts.requests = 10000;
+  opts.pool = 1000;
+  opts.delay = 0;
+  opts.seed = 1;
+
+  std::string mix = "20:20:60";
+  std::string clients = "70:20:10";
+  bool help = false;
+
+  propa::spec spec;
+  spec.opt("listen", 'L', opts.listen)
+    .help("Address tgreylist --listen is listening on.");
+  spec.opt("exec", 'x', opts.exec)
+    .help("Instead, run this shell command for every connection and "
+          "talk to it over pipes, like the Postfix spawn service.");
+  spec.opt("connections", 'c', opts.connections)
+    .help("Number of connections sending requests in parallel.");
+  spec.opt("requests", 'n', opts.requests)
+    .help("Number of requests to send over all connections.");
+  spec.opt("mix", mix)
+    .help("Shares of new, waiting and cleared triplets in percent.");
+  spec.opt("clients", clients)
+    .help("Shares of clients known by IPv4 address, IPv6 address and "
+          "name in percent.");
+  spec.opt("pool", opts.pool)
+    .help("Number of cleared and of waiting triplets to pick from.");
+  spec.opt("delay", opts.delay)
+    .converter(&tgrey::convert_timespan)
+    .help("The --delay tgreylist is run with, waited for while warming "
+          "up; the run should take less than it.");
+  spec.opt("seed", opts.seed)
+    .help("Seed for picking triplets; runs with the same seed send the "
+          "same requests, at least with a single connection. Triplets "
+          "new in one run are not in the next, so use another seed or a "
+          "fresh database for every run.");
+  spec.opt("replay", opts.replay)
+    .help("Instead of generating requests, send those in this file, "
+          "one after the other and each ended by an empty line, "
+          "starting over when done.");
+  spec.flag("help", 'h', help)
+    .help("Display this text and exit.");
+
+  try {
+    spec.parse(argc, argv);
+
+    if(help) {
+      spec.usage(std::cout, argv);
+      std::cout << std::endl;
+      spec.options(std::cout);
+      return 0;
+    }
+
+    if(opts.listen.empty() == opts.exec.empty())
+      throw std::runtime_error("give either --listen or --exec");
+
+    if(!opts.connections || !opts.requests)
+      throw std::runtime_error("need at least one connection and request");
+
+    parse_shares(mix, opts.mix, "mix");
+    parse_shares(clients, opts.clients, "clients");
+
+    if(!opts.pool && (opts.mix[mix_wait] || opts.mix[mix_cleared]))
+      throw std::runtime_error("waiting and cleared triplets need a pool");
+  }
+  catch(const std::exception& err) {
+    std::cerr << err.what() << std::endl;
+    return 1;
+  }
+
+  // a spawned tgreylist exiting early must not kill us
+  ::signal(SIGPIPE, SIG_IGN);
+
+  std::vector<std::string> dump;
+  std::vector<worker> workers(opts.connections);
+  double secs;
+
+  try {
+    if(!opts.replay.empty())
+      load_dump(opts.replay, dump);
+    else
+      warm_up(opts);
+
+    next_new = 2 * opts.pool;
+
+    for(size_t i = 0; i < workers.size(); ++i) {
+      worker& w = workers[i];
+      w.opts = &opts;
+      w.dump = dump.empty() ? 0 : &dump;
+      w.idx = i;
+      w.requests = opts.requests / workers.size() +
+                   (i < opts.requests % workers.size());
+      w.dunno = w.defer = w.other = 0;
+    }
+
+    double start = now();
+    size_t started = 0;
+
+    for(; started < workers.size(); ++started)
+      if(::pthread_create(&workers[started].thread, 0, &worker_main,
+                          &workers[started]))
+        break;
+
+    for(size_t i = 0; i < started; ++i)
+      ::pthread_join(workers[i].thread, 0);
+
+    secs = now() - start;
+
+    if(started < workers.size())
+      throw std::runtime_error("error starting thread");
+
+    for(size_t i = 0; i < workers.size(); ++i)
+      if(!workers[i].error.empty())
+        throw std::runtime_error(workers[i].error);
+  }
+  catch(const std::exception& err) {
+    std::cerr << err.what() << std::endl;
+    return 1;
+  }
+
+  report(workers, secs);
+  return 0;
+}
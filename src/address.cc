@@ -0,0 +1,176 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#include <string.h>
+#include <stdexcept>
+#include <string>
+
+#include "address.hh"
+
+inline int hex_value(char c) {
+  if(c >= '0' && c <= '9')
+    return c - '0';
+
+  if(c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+
+  if(c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+
+  return -1;
+}
+
+/** Parse a dotted quad of decimal octets without leading zeros, as
+ ** required by inet_pton. Returns false if the string is not one.
+ ** ** **/
+inline bool parse_v4(const char* pos, const char* end, unsigned char* out) {
+  for(int octet = 0; octet < 4; ++octet) {
+    if(octet && (pos == end || *pos++ != '.'))
+      return false;
+
+    const char* digits = pos;
+    unsigned int val = 0;
+
+    for(; pos < end && *pos >= '0' && *pos <= '9'; ++pos) {
+      val = val * 10 + (*pos - '0');
+
+      if(val > 255)
+        return false;
+    }
+
+    if(pos == digits || (pos - digits > 1 && *digits == '0'))
+      return false;
+
+    out[octet] = val;
+  }
+
+  return pos == end;
+}
+
+/** Parse groups of up to four hex digits separated by colons, with at
+ ** most one "::" standing for a run of zero groups and optionally a
+ ** dotted quad in place of the last two groups.
+ ** ** **/
+inline bool parse_v6(const char* pos, const char* end, unsigned char* out) {
+  unsigned char* dst = out;
+  unsigned char* gap = 0;
+  unsigned char* limit = out + 16;
+
+  if(pos < end && *pos == ':') {
+    if(end - pos < 2 || pos[1] != ':')
+      return false;
+
+    gap = dst;
+    pos += 2;
+  }
+
+  while(pos < end) {
+    const char* group = pos;
+    unsigned int val = 0;
+    int digit;
+
+    for(; pos < end && pos - group < 5 && (digit = hex_value(*pos)) >= 0;
+        ++pos)
+      val = (val << 4) | digit;
+
+    // an embedded IPv4 address ends the string
+    if(pos < end && *pos == '.') {
+      if(limit - dst < 4 || !parse_v4(group, end, dst))
+        return false;
+
+      dst += 4;
+      pos = end;
+      break;
+    }
+
+    if(pos == group || pos - group > 4 || limit - dst < 2)
+      return false;
+
+    *dst++ = val >> 8;
+    *dst++ = val & 0xff;
+
+    if(pos == end)
+      break;
+
+    if(*pos++ != ':' || pos == end)
+      return false;
+
+    if(*pos == ':') {
+      if(gap)
+        return false;
+
+      gap = dst;
+
+      if(++pos == end)
+        break;
+    }
+  }
+
+  if(gap) {
+    size_t tail = dst - gap;
+
+    if(dst == limit)
+      return false;
+
+    memmove(limit - tail, gap, tail);
+    memset(gap, 0, limit - tail - gap);
+    dst = limit;
+  }
+
+  return dst == limit;
+}
+
+/** Parse an IPv4 or IPv6 address into its network byte representation.
+ ** The output buffer needs room for max_addr_bytes. Returns the number
+ ** of bytes of the address (4 or 16) or 0 if it is not valid.
+ ** ** **/
+size_t tgrey::parse_addr(const char* ip, size_t len, unsigned char* out) {
+  const char* end = ip + len;
+
+  // the family follows from whether a colon appears at all
+  if(!memchr(ip, ':', len))
+    return parse_v4(ip, end, out) ? 4 : 0;
+
+  return parse_v6(ip, end, out) ? 16 : 0;
+}
+
+/** Mask bits of an IPv4 or IPv6 address and write the remaining bytes
+ ** as lowercase hex digits to out, which needs room for
+ ** max_masked_addr_length characters. Masks longer than the address
+ ** keep it whole. As keys have always been built, only whole bytes of
+ ** the address are kept: a byte the mask ends within is zeroed as well.
+ ** Returns the number of characters written.
+ ** ** **/
+size_t tgrey::mask_addr(const char* ip, size_t len,
+                        unsigned int v4mask, unsigned int v6mask, char* out) {
+  static const char digits[] = "0123456789abcdef";
+  unsigned char addr[max_addr_bytes];
+  size_t bytes = parse_addr(ip, len, addr);
+
+  if(!bytes)
+    throw std::runtime_error("not a valid IP address: " +
+                             std::string(ip, len));
+
+  // depending on address type use correct mask
+  unsigned int mask = bytes == 4 ? v4mask : v6mask;
+
+  if(mask > 8 * bytes)
+    mask = 8 * bytes;
+
+  // set the (mask/8)th byte and all after that to zero
+  memset(addr + mask / 8, 0, bytes - mask / 8);
+
+  for(size_t i = 0; i < bytes; ++i) {
+    *out++ = digits[addr[i] >> 4];
+    *out++ = digits[addr[i] & 0xf];
+  }
+
+  return 2 * bytes;
+}
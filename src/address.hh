@@ -0,0 +1,29 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#ifndef TGREY_ADDRESS_HH
+#define TGREY_ADDRESS_HH
+
+#include <stddef.h>
+
+namespace tgrey
+{
+  /** Parsing and masking of the textual IPv4 and IPv6 addresses found in
+   ** policy requests. Accepts exactly what inet_pton accepts for AF_INET
+   ** and AF_INET6 and never allocates.
+   ** ** **/
+  const size_t max_addr_bytes = 16;
+  const size_t max_masked_addr_length = 2 * max_addr_bytes;
+
+  size_t parse_addr(const char*, size_t, unsigned char*);
+  size_t mask_addr(const char*, size_t, unsigned int, unsigned int, char*);
+}
+
+#endif /* TGREY_ADDRESS_HH */
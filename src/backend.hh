@@ -0,0 +1,135 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#ifndef TGREY_BACKEND_HH
+#define TGREY_BACKEND_HH
+
+#include <stddef.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "database.hh"
+#include "record.hh"
+
+namespace tgrey
+{
+  /** Interface implemented by the storage engines behind a database.
+   ** All methods may be called from several threads at the same time;
+   ** only open() is called before any of the others. Errors are thrown
+   ** as exceptions.
+   ** ** **/
+  class backend {
+    public:
+      virtual ~backend() { /* empty */ }
+
+      virtual void open() = 0;
+      virtual bool fetch(const std::string&, std::string&) = 0;
+      virtual void store(const std::string&, const std::string&) = 0;
+      virtual bool insert(const std::string&, const std::string&) = 0;
+      virtual void remove(const std::string&) = 0;
+      virtual void traverse(database&, db_visitor&) = 0;
+
+      virtual bool scan(database&, db_visitor&, std::string&, size_t) = 0;
+
+      /** Look up the record of a triplet. Engines that can decode it
+       ** right where they keep it save copying the value first.
+       ** ** **/
+      virtual bool fetch_record(const std::string& key, record& rec) {
+        std::string val;
+
+        if(!fetch(key, val))
+          return false;
+
+        decode_record(val, rec);
+        return true;
+      }
+
+      virtual void append(const std::string&, const std::string&) {
+        throw std::runtime_error("database engine does not support "
+                                 "appending to records");
+      }
+
+      virtual bool can_append() {
+        return false;
+      }
+
+      /** Apply all writes of a batch; without transactions one after
+       ** the other. Returns the number of records removed, which leaves
+       ** out conditional deletes that have been skipped.
+       ** ** **/
+      virtual size_t apply(const write_batch& batch) {
+        size_t removed = 0;
+
+        for(std::vector<write_batch::op>::const_iterator it =
+              batch.ops().begin(); it != batch.ops().end(); ++it) {
+          std::string val;
+
+          if(it->conditional && (!fetch(it->key, val) || val != it->val))
+            continue;
+
+          if(it->remove) {
+            remove(it->key);
+            removed++;
+          }
+          else if(it->append)
+            append(it->key, it->val);
+          else
+            store(it->key, it->val);
+        }
+
+        return removed;
+      }
+
+      /** Number of parts that may be traversed on their own, and the
+       ** traversal of one of them.
+       ** ** **/
+      virtual size_t num_shards() {
+        return 1;
+      }
+
+      virtual void traverse_shard(database& db, db_visitor& vi,
+                                  size_t shard) {
+        if(shard)
+          throw std::runtime_error("no such database shard");
+
+        traverse(db, vi);
+      }
+
+      /** Traversal of one of parts disjoint sets of records, so that
+       ** they may be visited by parallel threads. Engines that cannot
+       ** be split visit all records as the first part.
+       ** ** **/
+      virtual void traverse_part(database& db, db_visitor& vi, size_t part,
+                                 size_t parts) {
+        if(!part)
+          traverse(db, vi);
+      }
+
+      /** Traversal of a part passing views of the records, carrying out
+       ** the actions returned by the visitor. Returns the number of
+       ** records removed. By default on top of traverse_part, copying
+       ** the records.
+       ** ** **/
+      virtual size_t traverse_view(database&, db_view_visitor&, size_t part,
+                                   size_t parts);
+
+      virtual void group_commit(durability, size_t, unsigned int) = 0;
+      virtual long commit_due() = 0;
+      virtual void commit() = 0;
+  };
+
+  backend* tdb_backend(const std::string&);
+  backend* mmap_backend(const std::string&, size_t);
+  backend* ram_backend(const std::string&);
+  backend* shard_backend(const std::vector<backend*>&);
+}
+
+#endif /* TGREY_BACKEND_HH */
@@ -0,0 +1,183 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#include <time.h>
+#include <string>
+#include <vector>
+
+#include "cache.hh"
+#include "misc.hh"
+#include "thread.hh"
+
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#endif
+
+/** The table is split into groups of 16 slots. Every slot has a control
+ ** byte that is either empty (high bit set) or holds 7 bits of the hash
+ ** of the key stored in the slot, so a whole group can be checked for
+ ** candidates with a single vector compare before any key is touched.
+ ** A key is looked for in its home group and the groups following it,
+ ** up to max_probes; slots only ever go from empty to full, so the
+ ** first group with an empty slot ends the search.
+ ** ** **/
+const size_t group_size = 16;
+const size_t max_probes = 8;
+const signed char empty_slot = -128;
+
+struct cache_entry {
+    std::string key;
+    tgrey::record rec;
+    int64_t expires;
+
+    cache_entry() : expires(0) {
+      /* empty */
+    }
+};
+
+struct tgrey::cache_data {
+    tgrey::mutex lock;
+    const unsigned int ttl;
+    size_t groups;
+    std::vector<signed char> ctrl;
+    std::vector<cache_entry> slots;
+    uint64_t hits;
+    uint64_t misses;
+
+    cache_data(size_t capacity, unsigned int t)
+      : ttl(t), groups(1), hits(0), misses(0) {
+      while(groups * group_size < capacity)
+        groups *= 2;
+
+      ctrl.assign(groups * group_size, empty_slot);
+      slots.resize(groups * group_size);
+    }
+};
+
+/** Bit mask of the slots in a group whose control byte equals c.
+ ** ** **/
+inline unsigned int match_group(const signed char* group, signed char c) {
+#if defined(__SSE2__)
+  __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+#else
+  unsigned int m = 0;
+  for(size_t i = 0; i < group_size; ++i)
+    if(group[i] == c)
+      m |= 1u << i;
+  return m;
+#endif
+}
+
+inline signed char hash_tag(uint64_t hash) {
+  return hash >> 57;
+}
+
+/** Find the slot holding key or, if it is not in the table, the slot it
+ ** should be put into. Sets found accordingly.
+ ** ** **/
+inline size_t find_slot(tgrey::cache_data& d, const std::string& key,
+                        uint64_t hash, bool& found) {
+  const signed char tag = hash_tag(hash);
+  const size_t mask = d.groups - 1;
+  const size_t probes = d.groups < max_probes ? d.groups : max_probes;
+
+  size_t group = hash & mask;
+  size_t victim = group * group_size;
+
+  for(size_t i = 0; i < probes; ++i, group = (group + 1) & mask) {
+    const size_t base = group * group_size;
+
+    for(unsigned int m = match_group(&d.ctrl[base], tag); m; m &= m - 1) {
+      size_t slot = base + __builtin_ctz(m);
+
+      if(d.slots[slot].key == key) {
+        found = true;
+        return slot;
+      }
+    }
+
+    unsigned int free = match_group(&d.ctrl[base], empty_slot);
+
+    if(free) {
+      found = false;
+      return base + __builtin_ctz(free);
+    }
+
+    // remember the entry closest to expiry in case nothing is free
+    for(size_t slot = base; slot < base + group_size; ++slot)
+      if(d.slots[slot].expires < d.slots[victim].expires)
+        victim = slot;
+  }
+
+  found = false;
+  return victim;
+}
+
+tgrey::record_cache::record_cache(size_t capacity, unsigned int ttl)
+  : data(new cache_data(capacity, ttl)) {
+  /* empty */
+}
+
+tgrey::record_cache::~record_cache() {
+  /* empty */
+}
+
+/** Copy the cached record for key to rec. Returns false if there is no
+ ** entry for key or it has expired.
+ ** ** **/
+bool tgrey::record_cache::lookup(const std::string& key, record& rec) {
+  const uint64_t hash = stable_hash(key);
+  scoped_lock l(data->lock);
+  bool found;
+  size_t slot = find_slot(*data, key, hash, found);
+
+  if(!found || data->slots[slot].expires <= ::time(0)) {
+    data->misses++;
+    return false;
+  }
+
+  data->hits++;
+  rec = data->slots[slot].rec;
+  return true;
+}
+
+/** Enter the record for key after it has been written to or read from
+ ** the database.
+ ** ** **/
+void tgrey::record_cache::update(const std::string& key, const record& rec) {
+  const uint64_t hash = stable_hash(key);
+  scoped_lock l(data->lock);
+  bool found;
+  size_t slot = find_slot(*data, key, hash, found);
+  cache_entry& entry = data->slots[slot];
+
+  if(!found) {
+    data->ctrl[slot] = hash_tag(hash);
+    entry.key = key;
+  }
+
+  entry.rec = rec;
+  entry.expires = ::time(0) + data->ttl;
+}
+
+size_t tgrey::record_cache::capacity() const {
+  return data->slots.size();
+}
+
+uint64_t tgrey::record_cache::hits() const {
+  scoped_lock l(data->lock);
+  return data->hits;
+}
+
+uint64_t tgrey::record_cache::misses() const {
+  scoped_lock l(data->lock);
+  return data->misses;
+}
@@ -0,0 +1,51 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#ifndef TGREY_CACHE_HH
+#define TGREY_CACHE_HH
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+
+#include "record.hh"
+
+namespace tgrey
+{
+  struct cache_data;
+
+  /** A bounded in-memory copy of recently used records, kept in front of
+   ** the database by a single process. Entries expire after ttl seconds,
+   ** which bounds how long changes made by other processes sharing the
+   ** database can go unnoticed. When full, the oldest entry among the
+   ** candidates for a key is replaced.
+   ** ** **/
+  class record_cache {
+    public:
+      record_cache(size_t capacity, unsigned int ttl);
+      ~record_cache();
+
+      bool lookup(const std::string&, record&);
+      void update(const std::string&, const record&);
+
+      size_t capacity() const;
+      uint64_t hits() const;
+      uint64_t misses() const;
+
+    protected:
+      std::auto_ptr<struct cache_data> data;
+
+    private:
+      record_cache(const record_cache&);
+      record_cache& operator= (const record_cache&);
+  };
+}
+
+#endif /* TGREY_CACHE_HH */
@@ -8,107 +8,312 @@
   included file COPYING.
  * * */
 
-#include <errno.h>
-#include <fcntl.h>
-#include <string.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <tdb.h>
+#include <stdlib.h>
 
+#include <sstream>
 #include <stdexcept>
+#include <string>
+#include <vector>
 
+#include "backend.hh"
 #include "database.hh"
 
-struct tgrey::db_data {
-    TDB_CONTEXT* ctx;
+/** Number of records a memory mapped database is created with unless
+ ** the specification says otherwise.
+ ** ** **/
+const size_t default_slots = 262144;
+
+tgrey::durability tgrey::convert_durability(const std::string& value) {
+  if(value == "none")
+    return durability_none;
+
+  if(value == "nosync")
+    return durability_nosync;
+
+  if(value == "fsync")
+    return durability_fsync;
+
+  throw std::runtime_error("unknown durability mode: " + value);
+}
+
+void tgrey::write_batch::store(const std::string& key,
+                               const std::string& val) {
+  op o = { key, val, false, false, false };
+  _ops.push_back(o);
+}
+
+void tgrey::write_batch::append(const std::string& key,
+                                const std::string& val) {
+  op o = { key, val, false, false, true };
+  _ops.push_back(o);
+}
+
+void tgrey::write_batch::remove(const std::string& key) {
+  op o = { key, std::string(), true, false, false };
+  _ops.push_back(o);
+}
+
+void tgrey::write_batch::remove_unchanged(const std::string& key,
+                                          const std::string& val) {
+  op o = { key, val, true, true, false };
+  _ops.push_back(o);
+}
+
+/** Passes copies of the records on to a view visitor for engines that
+ ** do not traverse by views themselves.
+ ** ** **/
+class view_adapter : public tgrey::db_visitor {
+  public:
+    view_adapter(tgrey::db_view_visitor& v) : removed(0), vi(v) {
+      /* empty */
+    }
+
+    virtual int visit(tgrey::database& db,
+                      const std::string& key, const std::string& val) {
+      switch(vi.visit(key, val)) {
+        case tgrey::db_view_visitor::remove:
+          db.remove(key);
+          removed++;
+          return 0;
+
+        case tgrey::db_view_visitor::stop:
+          return 1;
+
+        default:
+          return 0;
+      }
+    }
+
+    size_t removed;
+
+  protected:
+    tgrey::db_view_visitor& vi;
 };
 
-TDB_DATA from_string(const std::string& data) {
-  TDB_DATA ret = { 0, 0 };
+size_t tgrey::backend::traverse_view(database& db, db_view_visitor& vi,
+                                     size_t part, size_t parts) {
+  view_adapter va(vi);
+  traverse_part(db, va, part, parts);
+  return va.removed;
+}
+
+inline tgrey::backend* make_engine(const std::string& engine,
+                                   const std::string& path, size_t slots) {
+  if(engine == "tdb")
+    return tgrey::tdb_backend(path);
+
+  if(engine == "mmap")
+    return tgrey::mmap_backend(path, slots);
+
+  if(engine == "ram")
+    return tgrey::ram_backend(path);
+
+  throw std::runtime_error("unknown database engine: " + engine);
+}
+
+inline size_t parse_count(const std::string& opt, const char* what) {
+  char* end;
+  size_t val = ::strtoul(opt.c_str() + opt.find('=') + 1, &end, 10);
+
+  if(*end || !val)
+    throw std::runtime_error(std::string("invalid number of ") + what +
+                             ": " + opt);
+
+  return val;
+}
+
+/** Create the backend named by a database specification: an optional
+ ** engine prefix, the path and a list of comma separated options.
+ ** ** **/
+inline tgrey::backend* make_backend(const std::string& spec) {
+  std::string engine = "tdb";
+  std::string path = spec;
+  size_t slots = default_slots;
+  size_t shards = 0;
+
+  size_t colon = path.find(':');
+
+  if(colon != std::string::npos && path.find('/') > colon) {
+    engine = path.substr(0, colon);
+    path = path.substr(colon + 1);
+  }
+
+  size_t comma = path.find(',');
+  std::string options;
+
+  if(comma != std::string::npos) {
+    options = path.substr(comma + 1);
+    path = path.substr(0, comma);
+  }
+
+  while(!options.empty()) {
+    std::string opt = options.substr(0, options.find(','));
+    options.erase(0, opt.length() + 1);
+
+    if(opt.compare(0, 6, "slots=") == 0 && engine == "mmap")
+      slots = parse_count(opt, "slots");
+    else if(opt.compare(0, 7, "shards=") == 0)
+      shards = parse_count(opt, "shards");
+    else
+      throw std::runtime_error("unknown database option: " + opt);
+  }
+
+  if(path.empty())
+    throw std::runtime_error("database specification lacks a path: " + spec);
+
+  if(!shards)
+    return make_engine(engine, path, slots);
+
+  std::vector<tgrey::backend*> parts;
+
+  try {
+    for(size_t i = 0; i < shards; ++i) {
+      std::ostringstream name;
+      name << path << '.' << i;
+
+      // make room first, so that the engine cannot be leaked
+      parts.push_back(0);
+      parts.back() = make_engine(engine, name.str(), slots);
+    }
+  }
+  catch(...) {
+    for(size_t i = 0; i < parts.size(); ++i)
+      delete parts[i];
 
-  if(data.length()) {
-    ret.dptr = (unsigned char*) data.c_str();
-    ret.dsize = data.length();
+    throw;
   }
 
-  return ret;
+  return tgrey::shard_backend(parts);
 }
 
-tgrey::database::database(const std::string& f)
-  : filename(f), data(new db_data) {
-  data->ctx = 0;
+tgrey::database::database(const std::string& s)
+  : spec(s), engine(make_backend(s)) {
+  /* empty */
 }
 
 tgrey::database::~database() {
-  if(data->ctx)
-    ::tdb_close(data->ctx);
+  /* empty */
 }
 
 void tgrey::database::open() {
-  if(data->ctx)
-    return;
-
-  data->ctx = ::tdb_open(
-     filename.c_str(), 0, TDB_DEFAULT, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-
-  if(!data->ctx) {
-    int errnum = errno;
-    throw std::runtime_error(std::string("error opening TDB: ") +
-                             std::string(strerror(errnum)));
-  }
+  engine->open();
 }
 
 bool tgrey::database::fetch(const std::string& key, std::string& val) {
-  if(!data->ctx)
-    throw std::runtime_error("trying to fetch from unopened TDB database");
+  return engine->fetch(key, val);
+}
 
-  TDB_DATA value = ::tdb_fetch(data->ctx, from_string(key));
+/** Look up a triplet and decode its record, without allocating memory
+ ** where the engine allows for that.
+ ** ** **/
+bool tgrey::database::fetch(const std::string& key, record& rec) {
+  return engine->fetch_record(key, rec);
+}
 
-  if(!value.dptr)
-    return false;
+void tgrey::database::store(const std::string& key, const std::string& val) {
+  engine->store(key, val);
+}
 
-  val = std::string(value.dptr, value.dptr + value.dsize);
-  delete value.dptr;
-  return true;
+/** Store a value only if there is none for the key yet. Returns false if
+ ** there already is one.
+ ** ** **/
+bool tgrey::database::insert(const std::string& key, const std::string& val) {
+  return engine->insert(key, val);
 }
 
-void tgrey::database::store(const std::string& key, const std::string& val) {
-  if(!data->ctx)
-    throw std::runtime_error("trying to store to unopened TDB database");
+/** Append data to the value of a record, creating it if necessary, as a
+ ** single atomic change. Not supported by memory mapped databases.
+ ** ** **/
+void tgrey::database::append(const std::string& key,
+                             const std::string& data) {
+  engine->append(key, data);
+}
 
-  if(::tdb_store(data->ctx,
-                 from_string(key), from_string(val), TDB_REPLACE))
-    throw std::runtime_error(std::string("error storing to TDB: ") +
-                             std::string(::tdb_errorstr(data->ctx)));
+bool tgrey::database::can_append() {
+  return engine->can_append();
 }
 
 void tgrey::database::remove(const std::string& key) {
-  if(!data->ctx)
-    throw std::runtime_error("trying to delete from unopened TDB database");
+  engine->remove(key);
+}
 
-  if(::tdb_delete(data->ctx, from_string(key)))
-    throw std::runtime_error(std::string("error deleting from TDB: ") +
-                             std::string(::tdb_errorstr(data->ctx)));
+/** Apply a batch. Returns the number of records it has removed.
+ ** ** **/
+size_t tgrey::database::apply(const write_batch& batch) {
+  return batch.empty() ? 0 : engine->apply(batch);
 }
 
-struct traverse_callback {
-    tgrey::database& db;
-    tgrey::db_visitor& vi;
-};
+void tgrey::database::traverse(db_visitor& visitor) {
+  engine->traverse(*this, visitor);
+}
 
-inline int
-traverse_helper(TDB_CONTEXT* tdb, TDB_DATA key, TDB_DATA val, void* state) {
-  traverse_callback* cb = static_cast<traverse_callback*>(state);
-  return cb->vi.visit(cb->db,
-                      std::string(key.dptr, key.dptr + key.dsize),
-                      std::string(val.dptr, val.dptr + val.dsize));
-  return 0;
+/** Number of shards the database is split into; 1 if it is not.
+ ** ** **/
+size_t tgrey::database::shards() {
+  return engine->num_shards();
 }
 
-void tgrey::database::traverse(db_visitor& visitor) {
-  if(!data->ctx)
-    throw std::runtime_error("trying to traverse unopened TDB database");
+/** Visit the records of a single shard only.
+ ** ** **/
+void tgrey::database::traverse(db_visitor& visitor, size_t shard) {
+  engine->traverse_shard(*this, visitor, shard);
+}
+
+/** Visit the records of one of parts disjoint sets, which together hold
+ ** all records; the parts may be traversed by several threads at once.
+ ** Databases that cannot be split this way, neither sharded nor memory
+ ** mapped, have all records in part 0 and none in the others.
+ ** ** **/
+void tgrey::database::traverse_part(db_visitor& visitor, size_t part,
+                                    size_t parts) {
+  engine->traverse_part(*this, visitor, part, parts);
+}
+
+/** Traverse passing views instead of copies to the visitor, which saves
+ ** allocating memory for every record. Returns the number of records
+ ** removed, which may be fewer than the visitor asked to remove if they
+ ** have been changed in the meantime.
+ ** ** **/
+size_t tgrey::database::traverse(db_view_visitor& visitor) {
+  return engine->traverse_view(*this, visitor, 0, 1);
+}
+
+size_t tgrey::database::traverse_part(db_view_visitor& visitor, size_t part,
+                                      size_t parts) {
+  return engine->traverse_view(*this, visitor, part, parts);
+}
+
+/** Visit up to count records following the position kept in cursor,
+ ** which is empty to start with the first one, and advance it. Unlike
+ ** traverse() no locks are held between calls, at the price of records
+ ** changed in between being visited or not; the visitor must not change
+ ** the database. Returns false once all records have been visited.
+ ** ** **/
+bool tgrey::database::scan(db_visitor& visitor, std::string& cursor,
+                           size_t count) {
+  return engine->scan(*this, visitor, cursor, count);
+}
+
+/** Group writes into transactions with the given durability. A group is
+ ** committed once it holds max_writes writes; max_delay (milliseconds)
+ ** is the time after which commit_due reports it as due. Has to be set
+ ** before the database is opened.
+ ** ** **/
+void tgrey::database::group_commit(durability mode, size_t max_writes,
+                                   unsigned int max_delay) {
+  engine->group_commit(mode, max_writes, max_delay);
+}
+
+/** Milliseconds left until the writes not committed yet should be, 0 if
+ ** that is overdue, or -1 if there are none.
+ ** ** **/
+long tgrey::database::commit_due() {
+  return engine->commit_due();
+}
 
-  struct traverse_callback cb = { *this, visitor };
-  ::tdb_traverse(data->ctx, traverse_helper, &cb);
+/** Commit all writes not committed yet. Does nothing unless writes are
+ ** grouped.
+ ** ** **/
+void tgrey::database::commit() {
+  engine->commit();
 }
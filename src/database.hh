@@ -13,11 +13,30 @@
 
 #include <string>
 #include <memory>
+#include <vector>
+
+#include "misc.hh"
 
 namespace tgrey
 {
-  struct db_data;
+  class backend;
   class database;
+  struct record;
+
+  /** How writes are grouped into transactions. Without grouping every
+   ** write is applied on its own. Otherwise writes are collected into a
+   ** transaction that is committed by commit() or once it holds enough
+   ** writes; with nosync the commit does not wait for the data to reach
+   ** the disk, which keeps the file consistent if the process dies but
+   ** not if the system does.
+   ** ** **/
+  enum durability {
+    durability_none,
+    durability_nosync,
+    durability_fsync
+  };
+
+  durability convert_durability(const std::string&);
 
   class db_visitor {
     public:
@@ -25,6 +44,55 @@ namespace tgrey
       visit(database&, const std::string&, const std::string&) = 0;
   };
 
+  /** Visitor given views of the key and value of each record instead of
+   ** copies, valid during the call only. It must not change the database
+   ** itself but returns whether to keep or remove the record or to stop
+   ** the traversal.
+   ** ** **/
+  class db_view_visitor {
+    public:
+      enum action { keep, remove, stop };
+
+      virtual action visit(const strview&, const strview&) = 0;
+  };
+
+  /** A number of stores, appends and deletes to be applied together.
+   ** Backends supporting transactions apply them atomically. A
+   ** conditional delete is skipped if the value of the record is no
+   ** longer the given one.
+   ** ** **/
+  class write_batch {
+    public:
+      struct op {
+          std::string key;
+          std::string val;
+          bool remove;
+          bool conditional;
+          bool append;
+      };
+
+      void store(const std::string&, const std::string&);
+      void append(const std::string&, const std::string&);
+      void remove(const std::string&);
+      void remove_unchanged(const std::string&, const std::string&);
+
+      const std::vector<op>& ops() const { return _ops; }
+      bool empty() const { return _ops.empty(); }
+      void clear() { _ops.clear(); }
+
+    protected:
+      std::vector<op> _ops;
+  };
+
+  /** The database holding the triplets. Which storage backend is used
+   ** follows from the specification passed on construction: either
+   ** tdb:PATH (or just a PATH) for a TDB file, mmap:PATH for a shared
+   ** memory mapped hash file, optionally followed by ",slots=N" giving
+   ** the number of records such a file is created with, or ram:PATH for
+   ** records kept in memory by a single process and made durable by a
+   ** log and snapshots. Any of them may be split into shards PATH.0 to
+   ** PATH.N-1 by adding ",shards=N".
+   ** ** **/
   class database {
     public:
       database(const std::string&);
@@ -32,13 +100,32 @@ namespace tgrey
 
       void open();
       bool fetch (const std::string&, std::string&);
+      bool fetch(const std::string&, record&);
       void store(const std::string&, const std::string&);
+      bool insert(const std::string&, const std::string&);
+      void append(const std::string&, const std::string&);
+      bool can_append();
       void remove(const std::string&);
+      size_t apply(const write_batch&);
       void traverse(db_visitor&);
+      size_t shards();
+      void traverse(db_visitor&, size_t);
+      void traverse_part(db_visitor&, size_t, size_t);
+      size_t traverse(db_view_visitor&);
+      size_t traverse_part(db_view_visitor&, size_t, size_t);
+      bool scan(db_visitor&, std::string&, size_t);
+
+      void group_commit(durability, size_t, unsigned int);
+      long commit_due();
+      void commit();
 
     protected:
-      const std::string filename;
-      std::auto_ptr<struct db_data> data;
+      const std::string spec;
+      std::auto_ptr<backend> engine;
+
+    private:
+      database(const database&);
+      database& operator= (const database&);
   };
 }
 
@@ -0,0 +1,183 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#include <time.h>
+
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "expiry.hh"
+#include "keys.hh"
+#include "misc.hh"
+
+const std::string tgrey::expiry_next_key(
+    std::string(1, tgrey::meta_key_tag) + "expiry:next");
+
+/** Meta record holding where tgreylist --sweep is to continue.
+ ** ** **/
+const std::string tgrey::sweep_cursor_key(
+    std::string(1, tgrey::meta_key_tag) + "sweep:cursor");
+
+/** Time after which a triplet counts as expired: once it has not been
+ ** seen for lifetime or, if it has not been cleared yet, for timeout. A
+ ** timeout of 0 means the latter does not apply.
+ ** ** **/
+int64_t tgrey::expires_at(const record& rec, unsigned int lifetime,
+                          unsigned int timeout) {
+  if(rec.cleared || !timeout || timeout > lifetime)
+    return rec.lastseen + lifetime;
+
+  return rec.lastseen + timeout;
+}
+
+std::string tgrey::expiry_key(int64_t hour, unsigned int chunk) {
+  std::ostringstream key;
+  key << meta_key_tag << "expiry:" << hour << ':' << chunk;
+  return key.str();
+}
+
+/** Entry listing a key in a chunk of the index.
+ ** ** **/
+inline std::string expiry_entry(const std::string& key) {
+  std::string entry;
+
+  for(int i = 0; i < 4; ++i)
+    entry += char(uint32_t(key.length()) >> (8 * i));
+
+  return entry + key;
+}
+
+/** List a triplet in the hour it expires in.
+ ** ** **/
+void tgrey::index_expiry(database& db, const std::string& key,
+                         int64_t expires) {
+  db.append(expiry_key(expires / expiry_span,
+                       stable_hash(key) % expiry_chunks),
+            expiry_entry(key));
+}
+
+/** List a triplet in the hour it expires in as part of a batch.
+ ** ** **/
+void tgrey::index_expiry(write_batch& batch, const std::string& key,
+                         int64_t expires) {
+  batch.append(expiry_key(expires / expiry_span,
+                          stable_hash(key) % expiry_chunks),
+               expiry_entry(key));
+}
+
+/** Split a chunk of the index into the keys listed in it. A truncated
+ ** last entry is ignored.
+ ** ** **/
+void tgrey::decode_expiry_keys(const std::string& val,
+                               std::vector<std::string>& keys) {
+  size_t pos = 0;
+
+  while(pos + 4 <= val.length()) {
+    uint32_t len = 0;
+
+    for(int i = 3; i >= 0; --i)
+      len = (len << 8) | static_cast<unsigned char>(val[pos + i]);
+
+    if(len > val.length() - pos - 4)
+      break;
+
+    keys.push_back(val.substr(pos + 4, len));
+    pos += 4 + len;
+  }
+}
+
+/** Collects the triplets of a batch that have expired, together with
+ ** the records they were found with.
+ ** ** **/
+class expiry_visitor : public tgrey::db_visitor {
+  public:
+    typedef std::vector<std::pair<std::string, std::string> > records;
+
+    expiry_visitor(unsigned int l, unsigned int t)
+      : _lifetime(l), _timeout(t), _now(::time(0)) {
+      /* empty */
+    }
+
+    virtual int visit(tgrey::database& db,
+                      const std::string& key, const std::string& val) {
+      tgrey::record rec;
+
+      if(tgrey::is_meta_key(key))
+        return 0;
+
+      tgrey::decode_record(val, rec);
+
+      if(tgrey::expires_at(rec, _lifetime, _timeout) < _now)
+        _expired.push_back(std::make_pair(key, val));
+
+      return 0;
+    }
+
+    records& expired() {
+      return _expired;
+    }
+
+  protected:
+    const unsigned int _lifetime;
+    const unsigned int _timeout;
+    const int64_t _now;
+    records _expired;
+};
+
+tgrey::sweeper::sweeper(unsigned int l, unsigned int t,
+                        const std::string& c)
+  : _lifetime(l), _timeout(t), _cursor(c), _done(false) {
+  /* empty */
+}
+
+/** Go over the next count records and remove the expired triplets among
+ ** them. Returns the number of triplets removed; the changes are left to
+ ** be committed by the caller.
+ ** ** **/
+unsigned int tgrey::sweeper::sweep(database& db, size_t count) {
+  if(_done) {
+    _cursor.clear();
+    _done = false;
+  }
+
+  expiry_visitor ev(_lifetime, _timeout);
+  write_batch batch;
+  bool more = db.scan(ev, _cursor, count);
+
+  if(!_held.first.empty()) {
+    batch.remove_unchanged(_held.first, _held.second);
+    _held.first.clear();
+  }
+
+  for(expiry_visitor::records::const_iterator it = ev.expired().begin();
+      it != ev.expired().end(); ++it) {
+    // the record the cursor is at may be needed to find the next one,
+    // so it is only removed with the next batch
+    if(more && it->first == _cursor)
+      _held = *it;
+    else
+      batch.remove_unchanged(it->first, it->second);
+  }
+
+  _done = !more;
+  return db.apply(batch);
+}
+
+/** Continue at the given position, as saved from the cursor of another
+ ** sweeper. The record a batch ended with is then not removed until
+ ** the next time around.
+ ** ** **/
+void tgrey::sweeper::resume(const std::string& cursor) {
+  _cursor = cursor;
+  _held.first.clear();
+  _done = false;
+}
@@ -0,0 +1,81 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#ifndef TGREY_EXPIRY_HH
+#define TGREY_EXPIRY_HH
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "database.hh"
+#include "record.hh"
+
+namespace tgrey
+{
+  /** The expiry index lists the keys of triplets by the hour in which
+   ** they may expire at the earliest. Each hour is split into a number of
+   ** chunks by the hash of the key, stored as meta records holding the
+   ** keys one after the other, each preceded by its length as a 32 bit
+   ** little endian integer. A further meta record holds the first hour
+   ** that has not been gone over yet.
+   **
+   ** tgreylist only adds triplets when creating them. Cleaning up goes
+   ** over the hours that have passed and checks every triplet listed:
+   ** those that have expired are removed, those that have been refreshed
+   ** in the meantime are listed again in the hour they now expire in.
+   ** ** **/
+  const int64_t expiry_span = 3600;
+  const unsigned int expiry_chunks = 64;
+
+  extern const std::string expiry_next_key;
+  extern const std::string sweep_cursor_key;
+
+  int64_t expires_at(const record&, unsigned int lifetime,
+                     unsigned int timeout);
+  std::string expiry_key(int64_t hour, unsigned int chunk);
+  void index_expiry(database&, const std::string&, int64_t);
+  void index_expiry(write_batch&, const std::string&, int64_t);
+  void decode_expiry_keys(const std::string&, std::vector<std::string>&);
+
+  /** Goes over the database a batch of records at a time, without
+   ** holding any locks while reading them, and removes the expired
+   ** triplets among each batch unless they have been changed since.
+   ** Once all records have been gone over, the next batch starts over
+   ** with the first one.
+   ** ** **/
+  class sweeper {
+    public:
+      sweeper(unsigned int lifetime, unsigned int timeout,
+              const std::string& cursor = std::string());
+
+      unsigned int sweep(database&, size_t);
+      void resume(const std::string&);
+
+      const std::string& cursor() const {
+        return _cursor;
+      }
+
+      bool done() const {
+        return _done;
+      }
+
+    protected:
+      const unsigned int _lifetime;
+      const unsigned int _timeout;
+      std::string _cursor;
+      std::pair<std::string, std::string> _held;
+      bool _done;
+  };
+}
+
+#endif /* TGREY_EXPIRY_HH */
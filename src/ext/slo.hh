@@ -32,11 +32,20 @@
 #ifndef SLO_HH
 #define SLO_HH
 
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stddef.h>
+#include <string.h>
 #include <syslog.h>
+#include <algorithm>
 #include <memory>
 #include <vector>
 #include <sstream>
 #include <iostream>
+#include <stdexcept>
 
 namespace slo
 {
@@ -65,23 +74,132 @@ namespace slo
   inline const level& alert()  { static level l(7000); return l; }
   inline const level& emerg()  { static level l(8000); return l; }
 
+  namespace slo_detail
+  {
+    const size_t msg_text_max = 1024;
+
+    /** A stream formatting messages into a fixed buffer, truncating
+     ** those that do not fit. Every thread keeps one for the messages it
+     ** logs, so no memory is allocated per message.
+     ** ** **/
+    class formatter : public std::streambuf {
+      protected:
+        char _buf[msg_text_max];
+        std::ios_base::fmtflags _flags;
+
+        virtual int_type overflow(int_type) {
+          return traits_type::eof();
+        }
+
+      public:
+        std::ostream os;
+        bool busy;
+        bool pooled;
+
+        formatter(bool p = false) : os(this), busy(true), pooled(p) {
+          _flags = os.flags();
+          setp(_buf, _buf + sizeof(_buf));
+        }
+
+        const char* data() const { return pbase(); }
+        size_t size() const { return pptr() - pbase(); }
+
+        void reset() {
+          setp(_buf, _buf + sizeof(_buf));
+          os.clear();
+          os.flags(_flags);
+          os.width(0);
+          os.precision(6);
+          os.fill(' ');
+        }
+    };
+
+    inline pthread_key_t& formatter_key() {
+      static pthread_key_t key;
+      return key;
+    }
+
+    inline void delete_formatter(void* fmt) {
+      delete static_cast<formatter*>(fmt);
+    }
+
+    inline void create_formatter_key() {
+      ::pthread_key_create(&formatter_key(), &delete_formatter);
+    }
+
+    /** The formatter of the calling thread or, if that one is in use by
+     ** another message being built at the same time, a new one.
+     ** ** **/
+    inline formatter* acquire_formatter() {
+      static pthread_once_t once = PTHREAD_ONCE_INIT;
+      ::pthread_once(&once, &create_formatter_key);
+
+      formatter* fmt =
+        static_cast<formatter*>(::pthread_getspecific(formatter_key()));
+
+      if(!fmt) {
+        fmt = new formatter(true);
+        ::pthread_setspecific(formatter_key(), fmt);
+        return fmt;
+      }
+
+      if(fmt->busy)
+        return new formatter;
+
+      fmt->busy = true;
+      return fmt;
+    }
+
+    inline void release_formatter(formatter* fmt) {
+      if(!fmt->pooled) {
+        delete fmt;
+        return;
+      }
+
+      fmt->reset();
+      fmt->busy = false;
+    }
+  }
+
+  /** A message being built. Messages below the lowest level any pipe of
+   ** the logger lets through are neither formatted nor sent; set the
+   ** level before anything else, as what is written to a message while
+   ** its level is too low is lost.
+   ** ** **/
   class msg {
     protected:
       const logger& _logger;
       level _level;
-      std::auto_ptr<std::ostringstream> _stream;
+      slo_detail::formatter* _fmt;
+      const char* _text;
+      size_t _len;
+      bool _live;
+
+      bool wanted() const;
 
     public:
       msg(msg& m)
-        : _logger(m._logger), _level(m._level), _stream(m._stream) {
-        /* empty */
+        : _logger(m._logger), _level(m._level), _fmt(m._fmt),
+          _text(m._text), _len(m._len), _live(m._live) {
+        m._fmt = 0;
+        m._live = false;
       }
 
       msg(const logger& l);
+      msg(const logger& l, const level& lvl, const std::string& text);
+      msg(const logger& l, const level& lvl, const char* text, size_t len);
       ~msg();
 
+      const char* data() const {
+        return _fmt ? _fmt->data() : _text;
+      }
+
+      size_t size() const {
+        return _fmt ? _fmt->size() : _len;
+      }
+
       const std::string str() const {
-        return _stream->str();
+        return std::string(data(), size());
       }
 
       const level& lvl() const {
@@ -89,7 +207,12 @@ namespace slo
       }
 
       template<typename T> msg& operator<< (const T& value) {
-        *_stream << value;
+        if(!_fmt && wanted())
+          _fmt = slo_detail::acquire_formatter();
+
+        if(_fmt)
+          _fmt->os << value;
+
         return *this;
       }
 
@@ -111,6 +234,24 @@ namespace slo
 
       virtual bool pass(msg&) const = 0;
 
+      /** Lowest level of the messages this stage lets through.
+       ** ** **/
+      virtual unsigned int lowest() const {
+        return 0;
+      }
+
+      /** Lowest level of the messages that make it through the stage and
+       ** all that follow it.
+       ** ** **/
+      unsigned int floor() const {
+        unsigned int own = lowest();
+
+        if(!next.get())
+          return own;
+
+        return std::max(own, next->floor());
+      }
+
       void append(ptr& item) {
         if(next.get())
           next->append(item);
@@ -141,9 +282,10 @@ namespace slo
     protected:
       level _msg_level;
       std::vector<stage*> _pipes;
+      unsigned int _floor;
 
     public:
-      logger() : _msg_level(notice()) { /* empty */ }
+      logger() : _msg_level(notice()), _floor(~0u) { /* empty */ }
 
       ~logger() {
         for(std::vector<stage*>::iterator it = _pipes.begin();
@@ -151,13 +293,21 @@ namespace slo
           delete *it;
       }
 
-      void add_pipe(stage::ptr stage) { _pipes.push_back(stage.release()); }
+      void add_pipe(stage::ptr stage) {
+        _floor = std::min(_floor, stage->floor());
+        _pipes.push_back(stage.release());
+      }
+
       void add_pipe(stage::ptr (&fun)()) { add_pipe(fun()); }
 
       void msg_level(const level& lvl)      { _msg_level = lvl; }
       void msg_level(const level& (&fun)()) { msg_level(fun()); }
       const level& msg_level() const        { return _msg_level; }
 
+      /** Lowest level of the messages any of the pipes lets through.
+       ** ** **/
+      unsigned int floor() const { return _floor; }
+
       void send(msg& m) const {
         for(std::vector<stage*>::const_iterator it = _pipes.begin();
             it != _pipes.end(); ++ it)
@@ -172,13 +322,38 @@ namespace slo
   };
 
   inline msg::msg(const logger& l)
-    : _logger(l), _level(l.msg_level()), _stream(new std::ostringstream) {
+    : _logger(l), _level(l.msg_level()), _fmt(0), _text(""), _len(0),
+      _live(true) {
+    /* empty */
+  }
+
+  inline msg::msg(const logger& l, const level& lvl, const std::string& text)
+    : _logger(l), _level(lvl), _fmt(slo_detail::acquire_formatter()),
+      _text(""), _len(0), _live(true) {
+    _fmt->os.write(text.data(), text.length());
+  }
+
+  /** A message made of text kept elsewhere, which is neither copied nor
+   ** sent on destruction: it is for handing text that has been formatted
+   ** already to stages, and must not outlive it.
+   ** ** **/
+  inline msg::msg(const logger& l, const level& lvl, const char* text,
+                  size_t len)
+    : _logger(l), _level(lvl), _fmt(0), _text(text), _len(len),
+      _live(false) {
     /* empty */
   }
 
   inline msg::~msg() {
-    if(_stream.get())
+    if(_live && wanted())
       _logger.send(*this);
+
+    if(_fmt)
+      slo_detail::release_formatter(_fmt);
+  }
+
+  inline bool msg::wanted() const {
+    return _level >= _logger.floor();
   }
 
   namespace slo_detail
@@ -186,7 +361,7 @@ namespace slo
     class stderr_stage : public stage {
       public:
         virtual bool pass(msg& m) const {
-          std::cerr << m.str() << std::endl;
+          std::cerr.write(m.data(), m.size()) << std::endl;
           return false;
         }
     };
@@ -211,7 +386,7 @@ namespace slo
                    lvl <= crit   ? LOG_CRIT :
                    lvl <= alert  ? LOG_ALERT :
                    LOG_EMERG,
-                   "%s", m.str().c_str());
+                   "%.*s", int(m.size()), m.data());
           return false;
         }
     };
@@ -220,18 +395,154 @@ namespace slo
       protected:
         T _fun;
         const level& _with;
+        const unsigned int _lowest;
 
       public:
-        level_cmp_stage(T fun, const level& with) : _fun(fun), _with(with) {
+        level_cmp_stage(T fun, const level& with, unsigned int lowest = 0)
+          : _fun(fun), _with(with), _lowest(lowest) {
           /* empty */
         }
 
         virtual bool pass(msg& m) const {
           return _fun(m.lvl(), _with);
         }
+
+        virtual unsigned int lowest() const {
+          return _lowest;
+        }
+    };
+  }
+
+  enum overflow {
+    drop,
+    block
+  };
+
+  namespace slo_detail
+  {
+    const size_t async_text_max = 496;
+
+    struct async_slot {
+      volatile size_t seq;
+      unsigned int lvl;
+      size_t len;
+      char text[async_text_max];
+    };
+
+    /** Hands messages over to a thread passing them on to the following
+     ** stages, so that writing them never holds up the threads logging.
+     ** Messages are copied into a bounded ring buffer, longer ones being
+     ** truncated. Any number of threads put messages in without locking:
+     ** each slot carries a sequence number telling whether it is free for
+     ** the position a producer claimed with a compare-and-swap or filled
+     ** for the one the drain thread is at. With the buffer full a message
+     ** is either dropped, which is counted and reported later, or the
+     ** thread logging it waits for room. The drain thread is only woken
+     ** up if it has said it is about to sleep, and passes messages on
+     ** straight from their slots.
+     ** ** **/
+    class async_stage : public stage {
+      protected:
+        struct state {
+          std::vector<async_slot> slots;
+          size_t mask;
+          overflow policy;
+          volatile size_t head;
+          size_t tail;
+          volatile size_t dropped;
+          size_t reported;
+          volatile bool stopping;
+          volatile bool sleeping;
+          sem_t ready;
+          pthread_t thread;
+          logger* sink;
+        };
+
+        std::auto_ptr<state> _state;
+
+        static void* drain_main(void* arg) {
+          static_cast<async_stage*>(arg)->drain();
+          return 0;
+        }
+
+        /** The slot the drain thread is at if it has been filled.
+         ** ** **/
+        async_slot* peek() const {
+          state& st = *_state;
+          async_slot& s = st.slots[st.tail & st.mask];
+
+          if(s.seq != st.tail + 1)
+            return 0;
+
+          __sync_synchronize();
+          return &s;
+        }
+
+        /** Hand the slot the drain thread is at back to the producers.
+         ** ** **/
+        void release(async_slot& s) const {
+          state& st = *_state;
+          __sync_synchronize();
+          s.seq = st.tail + st.mask + 1;
+          st.tail++;
+        }
+
+        void drain() const;
+
+      public:
+        async_stage(size_t capacity, overflow policy);
+        virtual ~async_stage();
+
+        virtual bool pass(msg& m) const {
+          state& st = *_state;
+          size_t pos = st.head;
+          async_slot* s;
+
+          while(true) {
+            s = &st.slots[pos & st.mask];
+            size_t seq = s->seq;
+            __sync_synchronize();
+
+            if(seq == pos) {
+              if(__sync_bool_compare_and_swap(&st.head, pos, pos + 1))
+                break;
+            }
+            else if(seq < pos) {
+              if(st.policy == drop) {
+                __sync_add_and_fetch(&st.dropped, 1);
+                return false;
+              }
+
+              ::sched_yield();
+            }
+
+            pos = st.head;
+          }
+
+          s->lvl = m.lvl();
+          s->len = std::min(m.size(), async_text_max);
+          ::memcpy(s->text, m.data(), s->len);
+          __sync_synchronize();
+          s->seq = pos + 1;
+          __sync_synchronize();
+
+          if(st.sleeping &&
+             __sync_bool_compare_and_swap(&st.sleeping, true, false))
+            ::sem_post(&st.ready);
+
+          return false;
+        }
     };
   }
 
+  inline stage::ptr async(size_t capacity, overflow policy = drop) {
+    return stage::ptr(new slo_detail::async_stage(capacity, policy));
+  }
+
+  inline stage::ptr async() {
+    return async(1024);
+  }
+
   inline stage::ptr stderr() {
     return stage::ptr(new slo_detail::stderr_stage());
   }
@@ -244,7 +555,8 @@ namespace slo
   inline stage::ptr min_level(const level& (&fun)()) {
     return stage::ptr(new slo_detail::level_cmp_stage
                             <std::greater_equal<const level> >
-                            (std::greater_equal<const level>(), fun()));
+                            (std::greater_equal<const level>(), fun(),
+                             fun()));
   }
 
   inline stage::ptr max_level(const level& (&fun)()) {
@@ -254,4 +566,110 @@ namespace slo
   }
 }
 
+namespace slo
+{
+  namespace slo_detail
+  {
+    /** The capacity is rounded up to a power of two. The drain thread
+     ** blocks all signals, leaving them to the threads of the program.
+     ** ** **/
+    inline async_stage::async_stage(size_t capacity, overflow policy)
+      : _state(new state) {
+      size_t size = 1;
+
+      while(size < capacity)
+        size <<= 1;
+
+      state& st = *_state;
+      st.slots.resize(size);
+      st.mask = size - 1;
+      st.policy = policy;
+      st.head = st.tail = 0;
+      st.dropped = st.reported = 0;
+      st.stopping = false;
+      st.sleeping = false;
+      st.sink = new logger;
+
+      for(size_t i = 0; i < size; ++i)
+        st.slots[i].seq = i;
+
+      ::sem_init(&st.ready, 0, 0);
+
+      sigset_t all, old;
+      ::sigfillset(&all);
+      ::pthread_sigmask(SIG_SETMASK, &all, &old);
+      int err = ::pthread_create(&st.thread, 0, &drain_main, this);
+      ::pthread_sigmask(SIG_SETMASK, &old, 0);
+
+      if(err) {
+        ::sem_destroy(&st.ready);
+        delete st.sink;
+        throw std::runtime_error("error starting log thread");
+      }
+    }
+
+    /** Pass on the messages still queued before returning.
+     ** ** **/
+    inline async_stage::~async_stage() {
+      state& st = *_state;
+
+      st.stopping = true;
+      ::sem_post(&st.ready);
+      ::pthread_join(st.thread, 0);
+
+      ::sem_destroy(&st.ready);
+      delete st.sink;
+    }
+
+    /** Pass on what has been queued, then say that the thread is about
+     ** to sleep and look once more, so that a message put in before a
+     ** producer could have seen that is not left waiting.
+     ** ** **/
+    inline void async_stage::drain() const {
+      state& st = *_state;
+
+      while(true) {
+        // whatever has been queued before stopping is passed on first
+        bool stop = st.stopping;
+
+        while(async_slot* s = peek()) {
+          msg m(*st.sink, level(s->lvl), s->text, s->len);
+
+          if(next.get())
+            next->send(m);
+
+          release(*s);
+        }
+
+        if(st.dropped != st.reported) {
+          size_t dropped = st.dropped;
+          std::ostringstream note;
+          note << "dropped " << dropped - st.reported
+               << " log messages with the queue full";
+          st.reported = dropped;
+
+          msg m(*st.sink, warn(), note.str());
+
+          if(next.get())
+            next->send(m);
+        }
+
+        if(stop)
+          return;
+
+        st.sleeping = true;
+        __sync_synchronize();
+
+        if(peek() || st.stopping) {
+          st.sleeping = false;
+          continue;
+        }
+
+        while(::sem_wait(&st.ready) && errno == EINTR)
+          ;
+      }
+    }
+  }
+}
+
 #endif /* SLO_HH */
@@ -0,0 +1,297 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#include <time.h>
+#include <stdexcept>
+#include <string>
+
+#include "expiry.hh"
+#include "greylist.hh"
+#include "logging.hh"
+#include "misc.hh"
+#include "record.hh"
+#include "stats.hh"
+
+tgrey::greylist::greylist(database& d,
+                          const unsigned int dl,
+                          const unsigned int to,
+                          const unsigned int lt,
+                          const unsigned int v4,
+                          const unsigned int v6,
+                          const bool hk,
+                          record_cache* c,
+                          const unsigned int rf,
+                          const bool ie,
+                          const unsigned int ss)
+  : db(d), delay(dl), timeout(to), lifetime(lt), v4mask(v4), v6mask(v6),
+    hash_keys(hk), cache(c), refresh(rf), index_expiry(ie),
+    sweep_size(ss), cleaner(lt, to), swept(0), unswept(0), resumed(false),
+    unsaved(0) {
+  /* empty */
+}
+
+/** Leave the position of sweeping behind for the next process.
+ ** ** **/
+tgrey::greylist::~greylist() {
+  if(!unsaved)
+    return;
+
+  try {
+    save_cursor();
+    db.commit();
+  }
+  catch(const std::exception& err) {
+    tgrey::log << slo::error << err.what();
+  }
+}
+
+/** Milliseconds the server has to be idle before sweeping once more.
+ ** ** **/
+const long sweep_interval = 100;
+
+/** Sweeps after which the position is written to the database.
+ ** ** **/
+const unsigned int cursor_sweeps = 64;
+
+/** Answer a single policy request. If sweeping, the next few records of
+ ** the database are gone over for expired triplets once the response
+ ** has been written.
+ ** ** **/
+const tgrey::policy_response&
+tgrey::greylist::handle(const policy_request& req) {
+  const policy_response* res;
+
+  try {
+    stage_timer timer(stage_decide);
+    res = &decide(req);
+  }
+  catch(...) {
+    tgrey::stats.add(stat_db_errors);
+    throw;
+  }
+
+  if(sweep_size)
+    __sync_add_and_fetch(&unswept, 1);
+
+  return *res;
+}
+
+/** Decide on a single policy request: look up the triplet in the
+ ** database, update it as needed and return the response to send back
+ ** to Postfix. Any database error is passed on as an exception.
+ ** ** **/
+const tgrey::policy_response&
+tgrey::greylist::decide(const policy_request& req) {
+  // this is an noop if the database is already open, otherwise it
+  // tries to open it; might throw
+  db.open();
+
+  // hashed keys need the salt stored in the database
+  if(hash_keys)
+    hasher.open(db);
+
+  bool exists;
+  std::string key;
+  record rec;
+  int64_t now = ::time(0);
+
+  // try to get data associated with triplet from database; the lock
+  // makes fetch and store atomic with regard to other worker threads
+  // handling the same triplet
+  stage_timer timer(stage_key);
+  key = req.to_key(v4mask, v6mask);
+
+  if(hash_keys)
+    key = hasher(key);
+
+  timer.stop();
+
+  scoped_lock l(locks.stripe(key));
+
+  // a cached record saves the database lookup; records are cached
+  // whenever they are read from or written to the database
+  exists = cache && cache->lookup(key, rec);
+
+  if(!exists && fetch(key, rec)) {
+    exists = true;
+
+    if(cache)
+      cache->update(key, rec);
+  }
+
+  // create a fresh database entry if:
+  //  - either there is none yet
+  //  - or if the existing one is expired, meaning that it is:
+  //    + either older than lifetime
+  //    + or older than timeout and has not yet been cleared
+  if(   (!exists)
+     || (tgrey::older_than(lifetime, rec.lastseen))
+     || (tgrey::older_than(timeout, rec.lastseen) && !rec.cleared)) {
+    rec = record();
+    rec.lastseen = rec.firstseen = now;
+    store(key, rec);
+
+    // later refreshes are picked up by the cleanup going over the index
+    if(index_expiry)
+      tgrey::index_expiry(db, key, expires_at(rec, lifetime, timeout));
+
+    tgrey::stats.add(stat_new);
+    tgrey::log << "new ( " << req.to_key(" / ", v4mask, v6mask) << " )";
+    return policy_response::service_unavailable;
+  }
+
+  // set database entry to cleared and update lastseen if:
+  //  - either entry is cleared already
+  //  - or the last delivery attempt was longer than delay ago
+  else if(   rec.cleared
+          || tgrey::older_than(delay, rec.lastseen)) {
+    // entries already cleared are only written again once lastseen is
+    // older than the refresh granularity; until then passes are not
+    // counted either
+    if(!refresh || !rec.cleared || tgrey::older_than(refresh, rec.lastseen)) {
+      rec.lastseen = now;
+      rec.cleared = true;
+      rec.passes++;
+      store(key, rec);
+    }
+    tgrey::stats.add(stat_ok);
+    tgrey::log << "ok ( " << req.to_key(" / ", v4mask, v6mask) << " )";
+    return policy_response::dunno;
+  }
+
+  // do not allow to pass and don't change database otherwise
+  tgrey::stats.add(stat_wait);
+  tgrey::log << "wait ( " << req.to_key(" / ", v4mask, v6mask) << " )";
+  return policy_response::service_unavailable;
+}
+
+/** Changes are grouped by the database, if at all.
+ ** ** **/
+long tgrey::greylist::commit_due() {
+  return db.commit_due();
+}
+
+void tgrey::greylist::commit() {
+  try {
+    db.commit();
+  }
+  catch(...) {
+    tgrey::stats.add(stat_db_errors);
+    throw;
+  }
+}
+
+/** While no requests come in, keep sweeping in the background.
+ ** ** **/
+long tgrey::greylist::idle() {
+  if(!sweep_size)
+    return -1;
+
+  sweep(sweep_size);
+
+  try {
+    commit();
+  }
+  catch(const std::exception& err) {
+    tgrey::log << slo::error << err.what();
+  }
+
+  return sweep_interval;
+}
+
+/** Sweep as many records as the requests answered since the last time
+ ** call for. The changes are committed along with those of the next
+ ** requests, unless they are due already.
+ ** ** **/
+void tgrey::greylist::answered() {
+  unsigned int requests = __sync_fetch_and_and(&unswept, 0);
+
+  if(!requests)
+    return;
+
+  sweep(size_t(requests) * sweep_size);
+
+  try {
+    if(!commit_due())
+      commit();
+  }
+  catch(const std::exception& err) {
+    tgrey::log << slo::error << err.what();
+  }
+}
+
+/** Remove the expired triplets among the next count records, unless
+ ** another thread is doing so already. Triplets that have expired but
+ ** are still cached are reset on their next request anyway. Errors are
+ ** only logged, as they do not concern any request. The position is
+ ** written to the database every cursor_sweeps sweeps, at the end of a
+ ** pass and on shutdown, so that processes answering a few requests
+ ** each still get around all of it between them.
+ ** ** **/
+void tgrey::greylist::sweep(size_t count) {
+  if(!sweep_lock.try_lock())
+    return;
+
+  try {
+    db.open();
+
+    if(!resumed) {
+      std::string cursor;
+
+      if(db.fetch(sweep_cursor_key, cursor))
+        cleaner.resume(cursor);
+
+      resumed = true;
+    }
+
+    unsigned int removed = cleaner.sweep(db, count);
+    tgrey::stats.add(stat_removed, removed);
+
+    if(++unsaved >= cursor_sweeps || cleaner.done())
+      save_cursor();
+
+    swept += removed;
+
+    // report once per pass over the database
+    if(cleaner.done() && swept) {
+      tgrey::log << "sweep removed " << swept << " database entries";
+      swept = 0;
+    }
+  }
+  catch(const std::exception& err) {
+    tgrey::stats.add(stat_db_errors);
+    tgrey::log << slo::error << err.what();
+  }
+
+  sweep_lock.unlock();
+}
+
+void tgrey::greylist::save_cursor() {
+  db.store(sweep_cursor_key, cleaner.done() ? "" : cleaner.cursor());
+  unsaved = 0;
+}
+
+/** Look up a record in the database, timing the lookup.
+ ** ** **/
+bool tgrey::greylist::fetch(const std::string& key, record& rec) {
+  stage_timer timer(stage_fetch);
+  return db.fetch(key, rec);
+}
+
+/** Write a record through the cache to the database.
+ ** ** **/
+void tgrey::greylist::store(const std::string& key, const record& rec) {
+  stage_timer timer(stage_store);
+  db.store(key, tgrey::encode_record(rec));
+  timer.stop();
+
+  if(cache)
+    cache->update(key, rec);
+}
@@ -0,0 +1,73 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#ifndef TGREY_GREYLIST_HH
+#define TGREY_GREYLIST_HH
+
+#include "cache.hh"
+#include "database.hh"
+#include "expiry.hh"
+#include "keys.hh"
+#include "policy.hh"
+#include "thread.hh"
+
+namespace tgrey
+{
+  class greylist : public request_handler {
+    public:
+      greylist(database&,
+               const unsigned int delay,
+               const unsigned int timeout,
+               const unsigned int lifetime,
+               const unsigned int v4mask,
+               const unsigned int v6mask,
+               const bool hash_keys = false,
+               record_cache* cache = 0,
+               const unsigned int refresh = 0,
+               const bool index_expiry = false,
+               const unsigned int sweep_size = 0);
+      ~greylist();
+
+      virtual const policy_response& handle(const policy_request&);
+      virtual long commit_due();
+      virtual void commit();
+      virtual long idle();
+      virtual void answered();
+
+    protected:
+      database& db;
+      const unsigned int delay;
+      const unsigned int timeout;
+      const unsigned int lifetime;
+      const unsigned int v4mask;
+      const unsigned int v6mask;
+      const bool hash_keys;
+      record_cache* cache;
+      const unsigned int refresh;
+      const bool index_expiry;
+      const unsigned int sweep_size;
+      key_hasher hasher;
+      lock_table locks;
+      sweeper cleaner;
+      mutex sweep_lock;
+      unsigned int swept;
+      volatile unsigned int unswept;
+      bool resumed;
+      unsigned int unsaved;
+
+      const policy_response& decide(const policy_request&);
+      bool fetch(const std::string&, record&);
+      void store(const std::string&, const record&);
+      void sweep(size_t);
+      void save_cursor();
+  };
+}
+
+#endif /* TGREY_GREYLIST_HH */
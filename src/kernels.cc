@@ -0,0 +1,237 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#include "kernels.hh"
+
+#if defined(__SSE2__)
+#  define TGREY_KERNELS_X86 1
+#  include <immintrin.h>
+#endif
+
+/** Find the end of the line starting at pos, that is the next newline
+ ** character, or end if there is none. If eq is not yet set, it is set to
+ ** the first equal sign found before the end of the line.
+ ** ** **/
+const char* tgrey::kernels::scalar::find_line(const char* pos,
+                                              const char* end,
+                                              const char** eq) {
+  for(; pos < end; ++pos) {
+    if(*pos == '\n')
+      return pos;
+
+    if(*pos == '=' && !*eq)
+      *eq = pos;
+  }
+
+  return end;
+}
+
+/** Find the first occurrence of two consecutive characters c. Returns a
+ ** pointer to the first of them or end if there is none.
+ ** ** **/
+const char* tgrey::kernels::scalar::find_pair(const char* pos,
+                                              const char* end, char c) {
+  for(; pos + 1 < end; ++pos)
+    if(pos[0] == c && pos[1] == c)
+      return pos;
+
+  return end;
+}
+
+/** Turn all ASCII uppercase characters into lowercase; this is the same
+ ** as tolower in the C locale we run in.
+ ** ** **/
+void tgrey::kernels::scalar::lowercase(char* str, size_t len) {
+  for(char* end = str + len; str < end; ++str)
+    if(*str >= 'A' && *str <= 'Z')
+      *str += 'a' - 'A';
+}
+
+#ifdef TGREY_KERNELS_X86
+
+/** The vector implementations process 16 (SSE2) or 32 (AVX2) bytes per
+ ** step using unaligned loads and leave the remaining bytes to the scalar
+ ** implementations. Bit masks of matching bytes are obtained by movemask,
+ ** so the lowest set bit is the first match.
+ ** ** **/
+inline const char* sse2_find_line(const char* pos, const char* end,
+                                  const char** eq) {
+  const __m128i nl = _mm_set1_epi8('\n');
+  const __m128i is = _mm_set1_epi8('=');
+
+  for(; pos + 16 <= end; pos += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pos));
+    unsigned int mnl = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+    unsigned int meq = *eq ? 0 : _mm_movemask_epi8(_mm_cmpeq_epi8(v, is));
+
+    // only equal signs before the newline count
+    if(mnl)
+      meq &= (1u << __builtin_ctz(mnl)) - 1;
+
+    if(meq)
+      *eq = pos + __builtin_ctz(meq);
+
+    if(mnl)
+      return pos + __builtin_ctz(mnl);
+  }
+
+  return tgrey::kernels::scalar::find_line(pos, end, eq);
+}
+
+inline const char* sse2_find_pair(const char* pos, const char* end,
+                                  char c) {
+  const __m128i cv = _mm_set1_epi8(c);
+
+  for(; pos + 17 <= end; pos += 16) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pos));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pos + 1));
+    unsigned int m = _mm_movemask_epi8(
+                       _mm_and_si128(_mm_cmpeq_epi8(a, cv),
+                                     _mm_cmpeq_epi8(b, cv)));
+    if(m)
+      return pos + __builtin_ctz(m);
+  }
+
+  return tgrey::kernels::scalar::find_pair(pos, end, c);
+}
+
+inline void sse2_lowercase(char* str, size_t len) {
+  // shift 'A'..'Z' to the bottom of the signed range so a single signed
+  // compare selects exactly the uppercase letters
+  const __m128i shift = _mm_set1_epi8(static_cast<char>(128 - 'A'));
+  const __m128i limit = _mm_set1_epi8(static_cast<char>(-128 + 26));
+  const __m128i flip = _mm_set1_epi8(0x20);
+
+  char* pos = str;
+  for(char* end = str + len; pos + 16 <= end; pos += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i*>(pos));
+    __m128i m = _mm_cmplt_epi8(_mm_add_epi8(v, shift), limit);
+    v = _mm_or_si128(v, _mm_and_si128(m, flip));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(pos), v);
+  }
+
+  tgrey::kernels::scalar::lowercase(pos, len - (pos - str));
+}
+
+__attribute__((target("avx2")))
+inline const char* avx2_find_line(const char* pos, const char* end,
+                                  const char** eq) {
+  const __m256i nl = _mm256_set1_epi8('\n');
+  const __m256i is = _mm256_set1_epi8('=');
+
+  for(; pos + 32 <= end; pos += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pos));
+    unsigned int mnl = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+    unsigned int meq = *eq ? 0 :
+                         _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, is));
+
+    if(mnl)
+      meq &= (1u << __builtin_ctz(mnl)) - 1;
+
+    if(meq)
+      *eq = pos + __builtin_ctz(meq);
+
+    if(mnl)
+      return pos + __builtin_ctz(mnl);
+  }
+
+  return sse2_find_line(pos, end, eq);
+}
+
+__attribute__((target("avx2")))
+inline const char* avx2_find_pair(const char* pos, const char* end,
+                                  char c) {
+  const __m256i cv = _mm256_set1_epi8(c);
+
+  for(; pos + 33 <= end; pos += 32) {
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pos));
+    __m256i b = _mm256_loadu_si256(
+                  reinterpret_cast<const __m256i*>(pos + 1));
+    unsigned int m = _mm256_movemask_epi8(
+                       _mm256_and_si256(_mm256_cmpeq_epi8(a, cv),
+                                        _mm256_cmpeq_epi8(b, cv)));
+    if(m)
+      return pos + __builtin_ctz(m);
+  }
+
+  return sse2_find_pair(pos, end, c);
+}
+
+__attribute__((target("avx2")))
+inline void avx2_lowercase(char* str, size_t len) {
+  const __m256i shift = _mm256_set1_epi8(static_cast<char>(128 - 'A'));
+  const __m256i limit = _mm256_set1_epi8(static_cast<char>(-128 + 26));
+  const __m256i flip = _mm256_set1_epi8(0x20);
+
+  char* pos = str;
+  for(char* end = str + len; pos + 32 <= end; pos += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<__m256i*>(pos));
+    __m256i m = _mm256_cmpgt_epi8(limit, _mm256_add_epi8(v, shift));
+    v = _mm256_or_si256(v, _mm256_and_si256(m, flip));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(pos), v);
+  }
+
+  sse2_lowercase(pos, len - (pos - str));
+}
+
+#endif /* TGREY_KERNELS_X86 */
+
+/** The set of implementations in use, selected once on first use.
+ ** ** **/
+struct kernel_set {
+    const char* isa;
+    const char* (*find_line)(const char*, const char*, const char**);
+    const char* (*find_pair)(const char*, const char*, char);
+    void (*lowercase)(char*, size_t);
+};
+
+inline kernel_set select_kernels() {
+#ifdef TGREY_KERNELS_X86
+  __builtin_cpu_init();
+
+  if(__builtin_cpu_supports("avx2")) {
+    kernel_set k = { "avx2", avx2_find_line, avx2_find_pair,
+                     avx2_lowercase };
+    return k;
+  }
+
+  kernel_set k = { "sse2", sse2_find_line, sse2_find_pair,
+                   sse2_lowercase };
+  return k;
+#else
+  kernel_set k = { "scalar", tgrey::kernels::scalar::find_line,
+                   tgrey::kernels::scalar::find_pair,
+                   tgrey::kernels::scalar::lowercase };
+  return k;
+#endif
+}
+
+inline const kernel_set& active() {
+  static const kernel_set k = select_kernels();
+  return k;
+}
+
+const char* tgrey::kernels::find_line(const char* pos, const char* end,
+                                      const char** eq) {
+  return active().find_line(pos, end, eq);
+}
+
+const char* tgrey::kernels::find_pair(const char* pos, const char* end,
+                                      char c) {
+  return active().find_pair(pos, end, c);
+}
+
+void tgrey::kernels::lowercase(char* str, size_t len) {
+  active().lowercase(str, len);
+}
+
+const char* tgrey::kernels::isa() {
+  return active().isa;
+}
@@ -0,0 +1,40 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#ifndef TGREY_KERNELS_HH
+#define TGREY_KERNELS_HH
+
+#include <stddef.h>
+
+namespace tgrey
+{
+  /** Byte scanning and case folding routines used on every request.
+   ** Depending on what the CPU supports at runtime these are SSE2 or
+   ** AVX2 implementations or portable scalar fallbacks.
+   ** ** **/
+  namespace kernels
+  {
+    const char* find_line(const char*, const char*, const char**);
+    const char* find_pair(const char*, const char*, char);
+    void lowercase(char*, size_t);
+    const char* isa();
+
+    /** The portable implementations; always available for comparison.
+     ** ** **/
+    namespace scalar
+    {
+      const char* find_line(const char*, const char*, const char**);
+      const char* find_pair(const char*, const char*, char);
+      void lowercase(char*, size_t);
+    }
+  }
+}
+
+#endif /* TGREY_KERNELS_HH */
@@ -0,0 +1,163 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <stdexcept>
+#include <string>
+
+#include "keys.hh"
+#include "misc.hh"
+
+/** Name of the record the per-database salt for key hashing is kept in.
+ ** ** **/
+const std::string salt_key(std::string(1, tgrey::meta_key_tag) + "salt");
+
+bool tgrey::is_meta_key(const std::string& key) {
+  return !key.empty() && key[0] == meta_key_tag;
+}
+
+bool tgrey::is_meta_key(const strview& key) {
+  return key.size && key.data[0] == meta_key_tag;
+}
+
+bool tgrey::is_hashed_key(const std::string& key) {
+  return key.length() == hashed_key_length && key[0] == hashed_key_tag;
+}
+
+inline uint64_t rotl(uint64_t x, int b) {
+  return (x << b) | (x >> (64 - b));
+}
+
+inline uint64_t load_le64(const unsigned char* p) {
+  uint64_t v = 0;
+  for(int i = 7; i >= 0; --i)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+inline void store_le64(unsigned char* p, uint64_t v) {
+  for(int i = 0; i < 8; ++i, v >>= 8)
+    p[i] = v & 0xff;
+}
+
+inline void sipround(uint64_t& v0, uint64_t& v1, uint64_t& v2, uint64_t& v3) {
+  v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32);
+  v2 += v3; v3 = rotl(v3, 16); v3 ^= v2;
+  v0 += v3; v3 = rotl(v3, 21); v3 ^= v0;
+  v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32);
+}
+
+/** SipHash-2-4 with 128 bit output as specified by Aumasson and
+ ** Bernstein, keyed with a 16 byte secret.
+ ** ** **/
+void tgrey::siphash128(const unsigned char key[16],
+                       const char* data, size_t len,
+                       unsigned char out[16]) {
+  const unsigned char* in = reinterpret_cast<const unsigned char*>(data);
+  const uint64_t k0 = load_le64(key);
+  const uint64_t k1 = load_le64(key + 8);
+
+  uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+  uint64_t v1 = 0x646f72616e646f6dULL ^ k1 ^ 0xee;
+  uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+  uint64_t v3 = 0x7465646279746573ULL ^ k1;
+
+  const unsigned char* end = in + (len & ~size_t(7));
+
+  for(; in != end; in += 8) {
+    uint64_t m = load_le64(in);
+    v3 ^= m;
+    sipround(v0, v1, v2, v3);
+    sipround(v0, v1, v2, v3);
+    v0 ^= m;
+  }
+
+  uint64_t b = uint64_t(len) << 56;
+  for(int i = (len & 7) - 1; i >= 0; --i)
+    b |= uint64_t(in[i]) << (8 * i);
+
+  v3 ^= b;
+  sipround(v0, v1, v2, v3);
+  sipround(v0, v1, v2, v3);
+  v0 ^= b;
+
+  v2 ^= 0xee;
+  for(int i = 0; i < 4; ++i)
+    sipround(v0, v1, v2, v3);
+  store_le64(out, v0 ^ v1 ^ v2 ^ v3);
+
+  v1 ^= 0xdd;
+  for(int i = 0; i < 4; ++i)
+    sipround(v0, v1, v2, v3);
+  store_le64(out + 8, v0 ^ v1 ^ v2 ^ v3);
+}
+
+tgrey::key_hasher::key_hasher() : ready(false) {
+  memset(salt, 0, sizeof(salt));
+}
+
+/** Load the salt of the database or, if it has none yet, create one from
+ ** the system's random number generator. Concurrent processes creating a
+ ** salt at the same time agree on the one stored first.
+ ** ** **/
+void tgrey::key_hasher::open(database& db) {
+  scoped_lock l(lock);
+
+  if(ready)
+    return;
+
+  std::string val;
+
+  if(!db.fetch(salt_key, val)) {
+    int fd = ::open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    unsigned char buf[sizeof(salt)];
+
+    if(fd < 0 || ::read(fd, buf, sizeof(buf)) != sizeof(buf)) {
+      std::runtime_error err = tgrey::sys_error("error creating salt");
+
+      if(fd >= 0)
+        ::close(fd);
+
+      throw err;
+    }
+
+    ::close(fd);
+
+    val.assign(reinterpret_cast<char*>(buf), sizeof(buf));
+
+    if(!db.insert(salt_key, val) && !db.fetch(salt_key, val))
+      throw std::runtime_error("error creating salt");
+  }
+
+  if(val.length() != sizeof(salt))
+    throw std::runtime_error("database contains an invalid salt");
+
+  memcpy(salt, val.data(), sizeof(salt));
+  ready = true;
+}
+
+/** Turn a plain text triplet key into its fixed length hashed form.
+ ** ** **/
+const std::string
+tgrey::key_hasher::operator() (const std::string& key) const {
+  if(!ready)
+    throw std::runtime_error("trying to hash key without salt");
+
+  unsigned char hash[16];
+  siphash128(salt, key.data(), key.length(), hash);
+
+  std::string res(1, hashed_key_tag);
+  res.append(reinterpret_cast<char*>(hash), sizeof(hash));
+  return res;
+}
@@ -0,0 +1,52 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#ifndef TGREY_KEYS_HH
+#define TGREY_KEYS_HH
+
+#include <stdint.h>
+#include <string>
+
+#include "database.hh"
+#include "thread.hh"
+
+namespace tgrey
+{
+  /** Keys of records holding data about the database itself instead of a
+   ** triplet start with a null byte; hashed triplet keys start with 0x01
+   ** followed by 16 bytes of hash. Plain text triplet keys can start with
+   ** neither.
+   ** ** **/
+  const char meta_key_tag = 0;
+  const char hashed_key_tag = 1;
+  const size_t hashed_key_length = 17;
+
+  bool is_meta_key(const std::string&);
+  bool is_meta_key(const strview&);
+  bool is_hashed_key(const std::string&);
+
+  void siphash128(const unsigned char[16], const char*, size_t,
+                  unsigned char[16]);
+
+  class key_hasher {
+    public:
+      key_hasher();
+
+      void open(database&);
+      const std::string operator() (const std::string&) const;
+
+    protected:
+      mutex lock;
+      bool ready;
+      unsigned char salt[16];
+  };
+}
+
+#endif /* TGREY_KEYS_HH */
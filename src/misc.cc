@@ -8,11 +8,15 @@
   included file COPYING.
  * * */
 
-#include <algorithm>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
 #include <sstream>
 #include <stdexcept>
 #include <string>
 
+#include "kernels.hh"
 #include "misc.hh"
 
 /** Convert a string consisting of numbers and time-suffixes to an
@@ -41,51 +45,66 @@ unsigned int tgrey::convert_timespan(const std::string& value) {
  ** ** **/
 std::string tgrey::lowercase(const std::string& str) {
   std::string res(str);
-  std::transform(res.begin(), res.end(), res.begin(), tolower);
+
+  if(!res.empty())
+    kernels::lowercase(&res[0], res.length());
+
   return res;
 }
 
-
-/**
+/** Lowercase a range of characters in place.
  ** ** **/
-inline void assert_char(std::istream& is, const char& c) {
-  if(c != is.get())
-    throw std::runtime_error("invalid field delimiter");
+void tgrey::lowercase(char* str, size_t len) {
+  kernels::lowercase(str, len);
 }
 
-template<typename T> void fetch_field(std::istream& is, T& val) {
-  is >> val;
-}
+/** Compare a string to an all lowercase literal, ignoring the case of
+ ** the former.
+ ** ** **/
+bool tgrey::equals_nocase(const strview& str, const char* lit) {
+  for(size_t i = 0; i < str.size; ++i, ++lit)
+    if(!*lit || tolower(static_cast<unsigned char>(str.data[i])) != *lit)
+      return false;
 
-template<> void fetch_field(std::istream& is, bool& val) {
-  is >> std::boolalpha >> val >> std::noboolalpha;
+  return !*lit;
 }
 
-template<typename T> void write_field(std::ostream& os, const T& val) {
-  os << val;
+
+bool tgrey::older_than(const unsigned int& val, const int64_t& lastseen) {
+  return lastseen < ::time(0) - val;
 }
 
-template<> void write_field(std::ostream& os, const bool& val) {
-  os << std::boolalpha << val << std::noboolalpha;
+/** Hash a byte string with 64 bit FNV-1a. The result does not depend on
+ ** the platform or the process, so it may be used to pick stripes, shards
+ ** or anything else that has to be stable across runs.
+ ** ** **/
+uint64_t tgrey::stable_hash(const char* data, size_t len) {
+  uint64_t hash = 14695981039346656037ULL;
+
+  for(size_t i = 0; i < len; ++i) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= 1099511628211ULL;
+  }
+
+  return hash;
 }
 
-void tgrey::fetch_fields(const std::string& data,
-                         int64_t& lastseen, bool& cleared) {
-  std::istringstream iss(data);
-  fetch_field(iss, lastseen);
-  assert_char(iss, field_separator);
-  fetch_field(iss, cleared);
+uint64_t tgrey::stable_hash(const std::string& data) {
+  return stable_hash(data.data(), data.length());
 }
 
-const std::string tgrey::join_fields(const int64_t& lastseen,
-                                     const bool& cleared) {
-  std::ostringstream oss;
-  write_field(oss, lastseen);
-  write_field(oss, field_separator);
-  write_field(oss, cleared);
-  return oss.str();
+/** Milliseconds on a clock that is never set back, for measuring how
+ ** much time has passed.
+ ** ** **/
+int64_t tgrey::monotonic_ms() {
+  struct timespec ts;
+  ::clock_gettime(CLOCK_MONOTONIC, &ts);
+  return int64_t(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
 }
 
-bool tgrey::older_than(const unsigned int& val, const int64_t& lastseen) {
-  return lastseen < ::time(0) - val;
+/** An error saying what failed and why, as given by errno.
+ ** ** **/
+std::runtime_error tgrey::sys_error(const std::string& what) {
+  int errnum = errno;
+  return std::runtime_error(what + ": " + std::string(strerror(errnum)));
 }
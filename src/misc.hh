@@ -11,17 +11,40 @@
 #ifndef TGREY_MISC_HH
 #define TGREY_MISC_HH
 
+#include <stdint.h>
+#include <stdexcept>
 #include <string>
 
 namespace tgrey
 {
   const char field_separator = 31;
 
+  /** A non-owning reference to a range of characters; only valid as long
+   ** as the memory it points to.
+   ** ** **/
+  struct strview {
+      const char* data;
+      size_t size;
+
+      strview() : data(0), size(0) { /* empty */ }
+      strview(const char* d, size_t s) : data(d), size(s) { /* empty */ }
+      strview(const std::string& s) : data(s.data()), size(s.length()) {
+        /* empty */
+      }
+
+      bool empty() const { return !size; }
+      std::string str() const { return std::string(data, size); }
+  };
+
   unsigned int convert_timespan(const std::string&);
   std::string lowercase(const std::string&);
-  void fetch_fields(const std::string&, int64_t&, bool&);
-  const std::string join_fields(const int64_t&, const bool&);
+  void lowercase(char*, size_t);
+  bool equals_nocase(const strview&, const char*);
   bool older_than(const unsigned int&, const int64_t&);
+  uint64_t stable_hash(const char*, size_t);
+  uint64_t stable_hash(const std::string&);
+  int64_t monotonic_ms();
+  std::runtime_error sys_error(const std::string&);
 }
 
 #endif /* TGREY_MISC_HH */
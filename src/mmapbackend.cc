@@ -0,0 +1,826 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "backend.hh"
+#include "misc.hh"
+#include "thread.hh"
+
+/** A memory mapped database is a file holding a header page followed by
+ ** a fixed number of equally sized slots, used as an open addressing
+ ** hash table with linear probing. Any number of processes map the file
+ ** and access it without locks:
+ **
+ ** The first word of a slot holds 32 bits of the hash of its key and a
+ ** 32 bit version. All changes to a slot are made by first incrementing
+ ** the version to an odd value with a compare-and-swap, which fails if
+ ** somebody else got there first, and incrementing it to an even value
+ ** again when done. Readers copy a slot and retry if the word changed in
+ ** the meantime. A slot never used has a zero word, a deleted one a zero
+ ** hash and an even version; lookups stop at the former only, or once
+ ** they have looked at as many slots as the header records any key has
+ ** ever been stored away from its home slot, whichever comes first.
+ **
+ ** Whoever locks a slot records its process as the owner right after.
+ ** A process dying in the middle of a change leaves the slot locked;
+ ** readers give up on it after stale_lock_ms, and writers then take it
+ ** over, provided its owner is gone. Only the owner and a writer taking
+ ** over change the owner, each with a compare-and-swap, and lock words
+ ** are released with one, so a writer that is merely slow either keeps
+ ** its slot or finds out it has lost it before changing anything. The
+ ** file is not portable between architectures.
+ ** ** **/
+const char map_magic[8] = { 't', 'g', 'r', 'e', 'y', 'm', 'a', 'p' };
+const size_t header_size = 4096;
+const size_t key_max = 200;
+const size_t val_max = 40;
+const int64_t stale_lock_ms = 1000;
+
+struct map_header {
+    char magic[8];
+    uint64_t slots;
+    uint32_t slot_size;
+    uint32_t key_max;
+    uint32_t val_max;
+    volatile uint64_t max_probe;
+};
+
+struct map_slot {
+    volatile uint64_t word;
+    uint16_t key_len;
+    uint16_t val_len;
+    volatile uint32_t owner;
+    char key[key_max];
+    char val[val_max];
+};
+
+inline uint32_t tag_of(uint64_t word) {
+  return word >> 32;
+}
+
+inline uint64_t make_word(uint32_t tag, uint32_t version) {
+  return (uint64_t(tag) << 32) | version;
+}
+
+inline bool is_locked(uint64_t word) {
+  return word & 1;
+}
+
+/** Wait until nobody changes the slot. Returns its word, which is still
+ ** locked if the change did not finish within stale_lock_ms.
+ ** ** **/
+inline uint64_t settled(const map_slot& slot) {
+  uint64_t word = slot.word;
+  int64_t deadline = 0;
+
+  for(unsigned int spins = 0; is_locked(word); ++spins) {
+    if(spins > 64) {
+      ::sched_yield();
+
+      if(!deadline)
+        deadline = tgrey::monotonic_ms() + stale_lock_ms;
+      else if(tgrey::monotonic_ms() > deadline)
+        return word;
+    }
+
+    word = slot.word;
+  }
+
+  __sync_synchronize();
+  return word;
+}
+
+/** Try to take a slot for changing it, given the word it was seen with,
+ ** and record this process as its owner. Fails if the word has changed
+ ** or the slot has been taken over before the owner could be recorded.
+ ** ** **/
+inline bool lock(map_slot& slot, uint64_t word) {
+  if(!__sync_bool_compare_and_swap(&slot.word, word, word + 1))
+    return false;
+
+  const uint32_t pid = ::getpid();
+
+  // a writer about to take the slot over holds the owner until it has
+  // either changed the word or found it has no reason to
+  while(!__sync_bool_compare_and_swap(&slot.owner, 0, pid)) {
+    if(slot.word != word + 1)
+      return false;
+
+    ::sched_yield();
+  }
+
+  return true;
+}
+
+/** Finish changing a slot locked with the given word, publishing the new
+ ** hash tag. Fails if the slot has been taken over in the meantime.
+ ** ** **/
+inline bool unlock(map_slot& slot, uint64_t locked, uint32_t tag) {
+  slot.owner = 0;
+  return __sync_bool_compare_and_swap(&slot.word, locked,
+                                      make_word(tag, uint32_t(locked) + 1));
+}
+
+/** Free a slot that has been left locked with the given word for longer
+ ** than stale_lock_ms, as its content cannot be trusted. Slots whose
+ ** owner is still running are left alone.
+ ** ** **/
+inline void take_over(map_slot& slot, uint64_t word) {
+  const uint32_t owner = slot.owner;
+
+  if(owner && (!::kill(owner, 0) || errno != ESRCH))
+    return;
+
+  const uint32_t pid = ::getpid();
+
+  if(!__sync_bool_compare_and_swap(&slot.owner, owner, pid))
+    return;
+
+  // the writer may have finished after all
+  if(!__sync_bool_compare_and_swap(&slot.word, word, word + 2)) {
+    __sync_bool_compare_and_swap(&slot.owner, pid, 0);
+    return;
+  }
+
+  slot.key_len = 0;
+  unlock(slot, word + 2, 0);
+}
+
+inline bool holds(const map_slot& slot, const std::string& key) {
+  return slot.key_len == key.length() &&
+         !memcmp(slot.key, key.data(), key.length());
+}
+
+inline void fill(map_slot& slot, const std::string& key,
+                 const std::string& val) {
+  memcpy(slot.key, key.data(), key.length());
+  memcpy(slot.val, val.data(), val.length());
+  slot.key_len = key.length();
+  slot.val_len = val.length();
+}
+
+class mmap_engine : public tgrey::backend {
+  public:
+    mmap_engine(const std::string& f, size_t s)
+      : filename(f), create_slots(s), fd(-1), base(0), size(0), slots(0),
+        mode(tgrey::durability_none), max_writes(1), max_delay(0),
+        writes(0), dirty_since(0), held(0) {
+      /* empty */
+    }
+
+    virtual ~mmap_engine();
+
+    virtual void open();
+    virtual bool fetch(const std::string&, std::string&);
+    virtual void store(const std::string&, const std::string&);
+    virtual bool insert(const std::string&, const std::string&);
+    virtual void remove(const std::string&);
+    virtual size_t apply(const tgrey::write_batch&);
+    virtual void traverse(tgrey::database&, tgrey::db_visitor&);
+    virtual void traverse_part(tgrey::database&, tgrey::db_visitor&,
+                               size_t, size_t);
+    virtual size_t traverse_view(tgrey::database&,
+                                 tgrey::db_view_visitor&, size_t, size_t);
+    virtual bool scan(tgrey::database&, tgrey::db_visitor&, std::string&,
+                      size_t);
+
+    virtual void group_commit(tgrey::durability, size_t, unsigned int);
+    virtual long commit_due();
+    virtual void commit();
+
+  protected:
+    const std::string filename;
+    const size_t create_slots;
+    tgrey::mutex open_lock;
+    int fd;
+    char* volatile base;
+    size_t size;
+    size_t slots;
+    tgrey::durability mode;
+    size_t max_writes;
+    unsigned int max_delay;
+    volatile size_t writes;
+    volatile int64_t dirty_since;
+    volatile unsigned int held;
+
+    map_header& header() {
+      return *reinterpret_cast<map_header*>(base);
+    }
+
+    map_slot& slot(size_t idx) {
+      return reinterpret_cast<map_slot*>(base + header_size)[idx];
+    }
+
+    map_header* map();
+    void check(const std::string&, const char*) const;
+    size_t find(const std::string&, uint32_t, size_t, std::string*,
+                uint64_t&);
+    bool write(const std::string&, const std::string&, bool);
+    bool erase(const std::string&, const std::string*);
+    bool read(size_t, std::string&, std::string&);
+    void reach(size_t);
+    void written();
+    void hold();
+    void release(bool);
+};
+
+mmap_engine::~mmap_engine() {
+  if(base) {
+    if(mode == tgrey::durability_fsync)
+      ::msync(base, size, MS_SYNC);
+
+    ::munmap(base, size);
+  }
+
+  if(fd >= 0)
+    ::close(fd);
+}
+
+/** Number of slots a lookup has to look at to find every key in the
+ ** mapped file, by going over all of them.
+ ** ** **/
+inline uint64_t farthest_probe(map_header* header) {
+  const map_slot* slots = reinterpret_cast<const map_slot*>(
+                            reinterpret_cast<char*>(header) + header_size);
+  uint64_t farthest = 1;
+
+  for(uint64_t idx = 0; idx < header->slots; ++idx) {
+    const map_slot& s = slots[idx];
+
+    if(!tag_of(s.word))
+      continue;
+
+    uint64_t home = tgrey::stable_hash(
+                      std::string(s.key, std::min<size_t>(s.key_len, key_max)))
+                    % header->slots;
+
+    farthest = std::max<uint64_t>(
+                 farthest, (idx + header->slots - home) % header->slots + 1);
+  }
+
+  return farthest;
+}
+
+/** Map the file, creating and initializing it if it is empty. Other
+ ** processes opening it at the same time wait for that on a file lock;
+ ** afterwards no locks are used at all.
+ ** ** **/
+map_header* mmap_engine::map() {
+  while(::flock(fd, LOCK_EX) && errno == EINTR);
+
+  struct stat st;
+
+  if(::fstat(fd, &st)) {
+    ::flock(fd, LOCK_UN);
+    throw tgrey::sys_error("error opening mmap database");
+  }
+
+  bool create = st.st_size == 0;
+  size = create ? header_size + create_slots * sizeof(map_slot) : st.st_size;
+
+  if(create && ::ftruncate(fd, size)) {
+    ::flock(fd, LOCK_UN);
+    throw tgrey::sys_error("error creating mmap database");
+  }
+
+  void* ptr = ::mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  if(ptr == MAP_FAILED) {
+    ::flock(fd, LOCK_UN);
+    throw tgrey::sys_error("error mapping database");
+  }
+
+  map_header* header = static_cast<map_header*>(ptr);
+
+  if(create) {
+    header->slots = create_slots;
+    header->slot_size = sizeof(map_slot);
+    header->key_max = key_max;
+    header->val_max = val_max;
+    header->max_probe = 1;
+    __sync_synchronize();
+    memcpy(header->magic, map_magic, sizeof(map_magic));
+    ::msync(ptr, header_size, MS_SYNC);
+  }
+
+  bool valid =
+       size >= header_size
+    && !memcmp(header->magic, map_magic, sizeof(map_magic))
+    && header->slot_size == sizeof(map_slot)
+    && header->slots == (size - header_size) / sizeof(map_slot);
+
+  // files from before lookups were bounded get their bound on first use
+  if(valid && !header->max_probe)
+    header->max_probe = farthest_probe(header);
+
+  ::flock(fd, LOCK_UN);
+
+  if(!valid) {
+    ::munmap(ptr, size);
+    throw std::runtime_error("not a valid mmap database: " + filename);
+  }
+
+  return header;
+}
+
+void mmap_engine::open() {
+  if(base)
+    return;
+
+  tgrey::scoped_lock l(open_lock);
+
+  if(base)
+    return;
+
+  fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_CLOEXEC,
+              S_IRUSR | S_IWUSR);
+
+  if(fd < 0)
+    throw tgrey::sys_error("error opening mmap database");
+
+  map_header* header;
+
+  try {
+    header = map();
+  }
+  catch(...) {
+    ::close(fd);
+    fd = -1;
+    throw;
+  }
+
+  slots = header->slots;
+  __sync_synchronize();
+  base = reinterpret_cast<char*>(header);
+}
+
+void mmap_engine::check(const std::string& key, const char* what) const {
+  if(!base)
+    throw std::runtime_error(std::string("trying to ") + what +
+                             " unopened mmap database");
+
+  if(key.length() > key_max)
+    throw std::runtime_error("key too long for mmap database; "
+                             "use hashed keys");
+}
+
+/** Look for the slot holding key, starting at its home slot and giving
+ ** up past the farthest any key has been stored from its own. Returns
+ ** the index or slots if there is none. If val is given, a copy of the
+ ** value consistent with the returned word is put there.
+ ** ** **/
+size_t mmap_engine::find(const std::string& key, uint32_t tag, size_t home,
+                         std::string* val, uint64_t& word) {
+  const uint64_t max_probe = header().max_probe;
+  const size_t limit = std::min<uint64_t>(max_probe, slots);
+
+  for(size_t i = 0; i < limit; ++i) {
+    size_t idx = (home + i) % slots;
+    map_slot& s = slot(idx);
+
+    word = s.word;
+
+    if(!word)
+      break;
+
+    if(tag_of(word) != tag)
+      continue;
+
+    while(true) {
+      word = settled(s);
+
+      // a slot left locked is skipped until a writer frees it
+      if(is_locked(word) || tag_of(word) != tag)
+        break;
+
+      bool match = holds(s, key);
+
+      if(match && val)
+        val->assign(s.val, std::min<size_t>(s.val_len, val_max));
+
+      __sync_synchronize();
+
+      if(s.word != word)
+        continue;
+
+      if(match)
+        return idx;
+
+      break;
+    }
+  }
+
+  return slots;
+}
+
+bool mmap_engine::fetch(const std::string& key, std::string& val) {
+  check(key, "fetch from");
+
+  uint64_t hash = tgrey::stable_hash(key);
+  uint32_t tag = tag_of(hash) ? tag_of(hash) : 1;
+  uint64_t word;
+
+  return find(key, tag, hash % slots, &val, word) != slots;
+}
+
+/** Store a value, replacing an existing one unless only inserting. The
+ ** first free slot found on the way to the end of the probe sequence is
+ ** claimed for a new key; as everybody claims the same one, a concurrent
+ ** store of the same key fails to do so and retries, finding the key.
+ ** ** **/
+bool mmap_engine::write(const std::string& key, const std::string& val,
+                        bool replace) {
+  if(val.length() > val_max)
+    throw std::runtime_error("value too long for mmap database");
+
+  uint64_t hash = tgrey::stable_hash(key);
+  uint32_t tag = tag_of(hash) ? tag_of(hash) : 1;
+  size_t home = hash % slots;
+
+  while(true) {
+    uint64_t word;
+    size_t idx = find(key, tag, home, 0, word);
+
+    if(idx != slots) {
+      if(!replace)
+        return false;
+
+      map_slot& s = slot(idx);
+
+      if(!lock(s, word))
+        continue;
+
+      fill(s, key, val);
+
+      if(!unlock(s, word + 1, tag))
+        continue;
+
+      written();
+      return true;
+    }
+
+    // look for the first slot that is free
+    size_t i = 0;
+
+    for(; i < slots; ++i) {
+      idx = (home + i) % slots;
+      word = slot(idx).word;
+
+      // slots left locked by a process that died are taken over
+      if(is_locked(word) && is_locked(word = settled(slot(idx)))) {
+        take_over(slot(idx), word);
+        word = slot(idx).word;
+      }
+
+      if(!tag_of(word) && !is_locked(word))
+        break;
+    }
+
+    if(i == slots)
+      throw std::runtime_error("mmap database is full");
+
+    if(!lock(slot(idx), word))
+      continue;
+
+    // lookups have to reach the slot before the key shows up in it
+    reach(i + 1);
+
+    map_slot& s = slot(idx);
+    fill(s, key, val);
+
+    if(!unlock(s, word + 1, tag))
+      continue;
+
+    // in the rare case of the same key being stored into two slots at
+    // the same time, the one found first wins
+    if(find(key, tag, home, 0, word) != idx) {
+      while(!is_locked(word = settled(s))) {
+        if(lock(s, word)) {
+          unlock(s, word + 1, holds(s, key) ? 0 : tag_of(word));
+          break;
+        }
+      }
+
+      continue;
+    }
+
+    written();
+    return true;
+  }
+}
+
+void mmap_engine::store(const std::string& key, const std::string& val) {
+  check(key, "store to");
+  write(key, val, true);
+}
+
+bool mmap_engine::insert(const std::string& key, const std::string& val) {
+  check(key, "store to");
+  return write(key, val, false);
+}
+
+/** Delete a record. If expected is given, only if it still has that
+ ** value; as the slot is taken with the word its value was read with,
+ ** the comparison and the delete are atomic. Returns whether the record
+ ** has been deleted.
+ ** ** **/
+bool mmap_engine::erase(const std::string& key, const std::string* expected) {
+  uint64_t hash = tgrey::stable_hash(key);
+  uint32_t tag = tag_of(hash) ? tag_of(hash) : 1;
+
+  while(true) {
+    uint64_t word;
+    std::string val;
+    size_t idx = find(key, tag, hash % slots, expected ? &val : 0, word);
+
+    if(idx == slots) {
+      if(expected)
+        return false;
+
+      throw std::runtime_error("error deleting from mmap database: "
+                               "record does not exist");
+    }
+
+    if(expected && val != *expected)
+      return false;
+
+    if(!lock(slot(idx), word))
+      continue;
+
+    // a slot taken over in the meantime is freed all the same
+    slot(idx).key_len = 0;
+    unlock(slot(idx), word + 1, 0);
+    written();
+    return true;
+  }
+}
+
+void mmap_engine::remove(const std::string& key) {
+  check(key, "delete from");
+  erase(key, 0);
+}
+
+/** Apply the writes of a batch one after the other, syncing once they
+ ** have all been made.
+ ** ** **/
+size_t mmap_engine::apply(const tgrey::write_batch& batch) {
+  size_t removed = 0;
+  hold();
+
+  try {
+    for(std::vector<tgrey::write_batch::op>::const_iterator it =
+          batch.ops().begin(); it != batch.ops().end(); ++it) {
+      check(it->key, "store to");
+
+      if(it->append)
+        throw std::runtime_error("database engine does not support "
+                                 "appending to records");
+      else if(!it->remove)
+        write(it->key, it->val, true);
+      else if(erase(it->key, it->conditional ? &it->val : 0))
+        removed++;
+    }
+  }
+  catch(...) {
+    release(false);
+    throw;
+  }
+
+  release(true);
+  return removed;
+}
+
+/** Copy the record in a slot. Returns false if there is none or the slot
+ ** has been left locked.
+ ** ** **/
+bool mmap_engine::read(size_t idx, std::string& key, std::string& val) {
+  map_slot& s = slot(idx);
+
+  while(true) {
+    uint64_t word = s.word;
+
+    if(!tag_of(word))
+      return false;
+
+    if(is_locked(word = settled(s)))
+      return false;
+
+    key.assign(s.key, std::min<size_t>(s.key_len, key_max));
+    val.assign(s.val, std::min<size_t>(s.val_len, val_max));
+    __sync_synchronize();
+
+    if(s.word == word)
+      return tag_of(word) != 0;
+  }
+}
+
+/** Visit all records. Records changed during the traversal may or may
+ ** not be visited with either their old or new value.
+ ** ** **/
+void mmap_engine::traverse(tgrey::database& db, tgrey::db_visitor& visitor) {
+  if(!base)
+    throw std::runtime_error("trying to traverse unopened mmap database");
+
+  std::string key, val;
+  hold();
+
+  try {
+    for(size_t idx = 0; idx < slots; ++idx)
+      if(read(idx, key, val) && visitor.visit(db, key, val))
+        break;
+  }
+  catch(...) {
+    release(false);
+    throw;
+  }
+
+  release(true);
+}
+
+/** Visit the records in a contiguous range of slots. As records never
+ ** move between slots, the ranges of different parts may be walked at
+ ** the same time.
+ ** ** **/
+void mmap_engine::traverse_part(tgrey::database& db,
+                                tgrey::db_visitor& visitor,
+                                size_t part, size_t parts) {
+  if(!base)
+    throw std::runtime_error("trying to traverse unopened mmap database");
+
+  std::string key, val;
+  const size_t end = slots * (part + 1) / parts;
+  hold();
+
+  try {
+    for(size_t idx = slots * part / parts; idx < end; ++idx)
+      if(read(idx, key, val) && visitor.visit(db, key, val))
+        break;
+  }
+  catch(...) {
+    release(false);
+    throw;
+  }
+
+  release(true);
+}
+
+/** Visit the records in a range of slots like traverse_part(), reading
+ ** them into the same buffers over and over. A record is only removed
+ ** if it still has the value the visitor has seen.
+ ** ** **/
+size_t mmap_engine::traverse_view(tgrey::database& db,
+                                  tgrey::db_view_visitor& visitor,
+                                  size_t part, size_t parts) {
+  if(!base)
+    throw std::runtime_error("trying to traverse unopened mmap database");
+
+  std::string key, val;
+  size_t removed = 0;
+  const size_t end = slots * (part + 1) / parts;
+  hold();
+
+  try {
+    for(size_t idx = slots * part / parts; idx < end; ++idx) {
+      if(!read(idx, key, val))
+        continue;
+
+      tgrey::db_view_visitor::action act = visitor.visit(key, val);
+
+      if(act == tgrey::db_view_visitor::stop)
+        break;
+
+      if(act == tgrey::db_view_visitor::remove && erase(key, &val))
+        removed++;
+    }
+  }
+  catch(...) {
+    release(false);
+    throw;
+  }
+
+  release(true);
+  return removed;
+}
+
+/** Walk the slots in order; the cursor holds the index of the next one.
+ ** ** **/
+bool mmap_engine::scan(tgrey::database& db, tgrey::db_visitor& visitor,
+                       std::string& cursor, size_t count) {
+  if(!base)
+    throw std::runtime_error("trying to traverse unopened mmap database");
+
+  size_t idx = ::strtoul(cursor.c_str(), 0, 10);
+  std::string key, val;
+
+  for(size_t n = 0; idx < slots; ) {
+    bool found = read(idx++, key, val);
+
+    if(found && (visitor.visit(db, key, val) || ++n >= count))
+      break;
+  }
+
+  if(idx >= slots) {
+    cursor.clear();
+    return false;
+  }
+
+  std::ostringstream pos;
+  pos << idx;
+  cursor = pos.str();
+  return true;
+}
+
+/** Raise the number of slots lookups look at to at least probes.
+ ** ** **/
+void mmap_engine::reach(size_t probes) {
+  volatile uint64_t& max_probe = header().max_probe;
+
+  for(uint64_t cur = max_probe; cur < probes; cur = max_probe)
+    if(__sync_bool_compare_and_swap(&max_probe, cur, probes))
+      break;
+}
+
+/** Changes are in the shared mapping right away; there are no
+ ** transactions. With fsync durability the mapping is synced to disk
+ ** once a group of writes is full or due, but not while a traversal or
+ ** a batch is still making its writes.
+ ** ** **/
+void mmap_engine::group_commit(tgrey::durability m, size_t w,
+                               unsigned int d) {
+  mode = m;
+  max_writes = w ? w : 1;
+  max_delay = d;
+}
+
+void mmap_engine::written() {
+  if(mode != tgrey::durability_fsync)
+    return;
+
+  __sync_bool_compare_and_swap(&dirty_since, 0, tgrey::monotonic_ms());
+
+  if(__sync_add_and_fetch(&writes, 1) >= max_writes && !held)
+    commit();
+}
+
+void mmap_engine::hold() {
+  __sync_add_and_fetch(&held, 1);
+}
+
+/** End holding back syncs and, unless giving up on an error, sync the
+ ** writes made in the meantime if they fill a group.
+ ** ** **/
+void mmap_engine::release(bool sync) {
+  if(!__sync_sub_and_fetch(&held, 1) && sync && writes >= max_writes)
+    commit();
+}
+
+long mmap_engine::commit_due() {
+  int64_t since = dirty_since;
+
+  if(!since)
+    return -1;
+
+  int64_t left = since + max_delay - tgrey::monotonic_ms();
+  return left > 0 ? left : 0;
+}
+
+void mmap_engine::commit() {
+  int64_t since = dirty_since;
+
+  if(!since || !__sync_bool_compare_and_swap(&dirty_since, since, 0))
+    return;
+
+  writes = 0;
+
+  if(::msync(base, size, MS_SYNC))
+    throw tgrey::sys_error("error syncing mmap database");
+}
+
+tgrey::backend* tgrey::mmap_backend(const std::string& filename,
+                                    size_t slots) {
+  return new mmap_engine(filename, slots);
+}
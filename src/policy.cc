@@ -8,75 +8,172 @@
   included file COPYING.
  * * */
 
-#include <iomanip>
+#include <algorithm>
 #include <istream>
-#include <sstream>
 #include <string>
 #include <stdexcept>
-#include <vector>
-
-#include <arpa/inet.h>
-#include <netdb.h>
-#include <netinet/in.h>
-#include <string.h>
-#include <sys/socket.h>
 
+#include "address.hh"
+#include "kernels.hh"
 #include "policy.hh"
 #include "misc.hh"
+#include "stats.hh"
 
 /** Forward declare helper functions.
  ** ** **/
 const std::string mask_name(const std::string&);
-const std::string mask_addr(const std::string&, unsigned int, unsigned int);
 
-/** Construct policy request by parsing from a text stream. Extracts some
- ** fields by implementing the abstract protocol (one key=value pair per
- ** line, empty line ends request) used by the Postfix policy delegation.
+/** Construct policy request by parsing from a text stream. Reads lines up
+ ** to and including the empty line ending the request and parses them
+ ** like a buffer.
  ** ** **/
 tgrey::policy_request::policy_request(std::istream& inp) {
-  std::string request;
+  std::string buf;
 
-  for(std::string line; std::getline(inp, line) && !line.empty(); ) {
-    size_t pos = line.find('=');
+  for(std::string line; std::getline(inp, line); ) {
+    buf += line;
+    buf += '\n';
 
-    // ignore lines without an equal sign
-    if(pos == std::string::npos)
-      continue;
+    if(line.empty())
+      break;
+  }
+
+  if(inp.eof())
+    throw std::runtime_error("input stream closed");
+
+  parse(buf.data(), buf.data() + buf.length());
+}
+
+/** Construct policy request by parsing from a buffer holding at least
+ ** one complete request.
+ ** ** **/
+tgrey::policy_request::policy_request(const char* begin, const char* end) {
+  parse(begin, end);
+}
+
+/** The attributes we are interested in. Their names all differ in length,
+ ** which makes the length a perfect hash for this set of keys: a single
+ ** switch selects the only candidate, which is then compared. All other
+ ** attributes are skipped without any further work.
+ ** ** **/
+enum attribute {
+  attr_other,
+  attr_request,
+  attr_sender,
+  attr_recipient,
+  attr_client_name,
+  attr_client_address
+};
+
+inline attribute lookup(const tgrey::strview& key) {
+  switch(key.size) {
+    case 6:
+      return tgrey::equals_nocase(key, "sender") ? attr_sender : attr_other;
+    case 7:
+      return tgrey::equals_nocase(key, "request") ? attr_request : attr_other;
+    case 9:
+      return tgrey::equals_nocase(key, "recipient") ?
+               attr_recipient : attr_other;
+    case 11:
+      return tgrey::equals_nocase(key, "client_name") ?
+               attr_client_name : attr_other;
+    case 14:
+      return tgrey::equals_nocase(key, "client_address") ?
+               attr_client_address : attr_other;
+    default:
+      return attr_other;
+  }
+}
+
+/** Copy a value into one of the fields we keep and lowercase it there.
+ ** ** **/
+inline void keep(std::string& field, const tgrey::strview& val) {
+  field.assign(val.data, val.size);
+
+  if(!field.empty())
+    tgrey::lowercase(&field[0], field.length());
+}
 
-    // insert key value pair
-    std::string key = lowercase(line.substr(0, pos));
-    std::string val = lowercase(line.substr(pos + 1));
+/** Count a malformed request before giving up on it.
+ ** ** **/
+inline std::runtime_error invalid(const char* what) {
+  tgrey::stats.add(tgrey::stat_parse_errors);
+  return std::runtime_error(what);
+}
 
-    if(key == "request")
-      request = val;
+/** Extract some fields by implementing the abstract protocol (one
+ ** key=value pair per line, empty line ends request) used by the Postfix
+ ** policy delegation. Works on the buffer in a single pass, finding both
+ ** the end of line and the equal sign with one scan, and copies nothing
+ ** but the values of the fields we keep.
+ ** ** **/
+void tgrey::policy_request::parse(const char* pos, const char* end) {
+  stage_timer timer(stage_parse);
+  strview request;
 
-    if(key == "sender")
-      sender = val;
+  while(true) {
+    const char* eq = 0;
+    const char* eol = kernels::find_line(pos, end, &eq);
 
-    if(key == "recipient")
-      recipient = val;
+    // a request not terminated by an empty line is incomplete
+    if(eol == end)
+      throw std::runtime_error("input stream closed");
 
-    if(val != "unknown") {
-      if(key == "client_name")
-        client_name = val;
+    if(eol == pos)
+      break;
 
-      if(key == "client_address")
-        client_address = val;
+    // ignore lines without an equal sign
+    if(eq) {
+      strview val(eq + 1, eol - eq - 1);
+
+      switch(lookup(strview(pos, eq - pos))) {
+        case attr_request:
+          request = val;
+          break;
+
+        case attr_sender:
+          keep(sender, val);
+          break;
+
+        case attr_recipient:
+          keep(recipient, val);
+          break;
+
+        case attr_client_name:
+          if(!equals_nocase(val, "unknown"))
+            keep(client_name, val);
+          break;
+
+        case attr_client_address:
+          if(!equals_nocase(val, "unknown"))
+            keep(client_address, val);
+          break;
+
+        case attr_other:
+          break;
+      }
     }
-  }
 
-  if(inp.eof())
-    throw std::runtime_error("input stream closed");
+    pos = eol + 1;
+  }
 
-  if(request != "smtpd_access_policy")
-    throw std::runtime_error("policy request is not smtpd_access_policy");
+  if(!equals_nocase(request, "smtpd_access_policy"))
+    throw invalid("policy request is not smtpd_access_policy");
 
   if(recipient.empty())
-    throw std::runtime_error("policy request missing recipient");
+    throw invalid("policy request missing recipient");
 
   if(client_name.empty() && client_address.empty())
-    throw std::runtime_error(
+    throw invalid(
               "policy request missing known client_name and client_address");
+
+  // the address only goes into the key if there is no name; checking it
+  // here keeps it from being taken for a database error later on
+  unsigned char addr[max_addr_bytes];
+
+  if(client_name.empty() &&
+     !parse_addr(client_address.data(), client_address.length(), addr))
+    throw invalid("policy request has an invalid client_address");
 }
 
 const std::string
@@ -89,17 +186,51 @@ const std::string
 tgrey::policy_request::to_key(const std::string& delim,
                               const unsigned int v4mask,
                               const unsigned int v6mask) const {
-  std::ostringstream oss;
+  std::string key;
 
-  oss << sender << delim << recipient << delim;
+  key.reserve(sender.length() + recipient.length() + 2 * delim.length() +
+              std::max(client_name.length(), max_masked_addr_length));
+  key.append(sender).append(delim).append(recipient).append(delim);
 
   if(!client_name.empty())
-    oss << mask_name(client_name);
+    key.append(mask_name(client_name));
+
+  else {
+    char buf[max_masked_addr_length];
+    key.append(buf, mask_addr(client_address.data(), client_address.length(),
+                              v4mask, v6mask, buf));
+  }
+
+  return key;
+}
 
-  else
-    oss << mask_addr(client_address, v4mask, v6mask);
+/** Find the end of the first complete request in a buffer, starting the
+ ** search at the given offset. A request is terminated by an empty line.
+ ** Returns the offset just after the terminating line or
+ ** std::string::npos if the buffer holds no complete request yet.
+ ** ** **/
+size_t tgrey::request_end(const std::string& buf, size_t from) {
+  if(from < buf.length() && buf[from] == '\n')
+    return from + 1;
+
+  const char* begin = buf.data();
+  const char* end = begin + buf.length();
+  const char* pos = kernels::find_pair(begin + from, end, '\n');
 
-  return oss.str();
+  return pos == end ? std::string::npos : pos - begin + 2;
+}
+
+/** Helper building the serialization (understood by Postfix) of a
+ ** policy response. This is done once when the response is created.
+ ** ** **/
+inline const std::string serialize(const std::string& action,
+                                   const std::string& text) {
+  std::string res = "action=" + action;
+
+  if(!text.empty())
+    res += " " + text;
+
+  return res + "\n\n";
 }
 
 /** Simple constructors for policy response objects. These are created
@@ -107,28 +238,22 @@ tgrey::policy_request::to_key(const std::string& delim,
  ** */
 tgrey::policy_response::policy_response(const std::string& a,
                                         const std::string& t)
-  : action(a), text(t) {
+  : action(a), text(t), wire(serialize(a, t)) {
   /* empty */
 }
 
 tgrey::policy_response::policy_response(const std::string& a)
-  : action(a) {
+  : action(a), wire(serialize(a, "")) {
   /* empty */
 }
 
 /** Implement the bitwise left shift operator to be able to easily write
- ** a vaild serialization (understood by Postfix) of an policy response
- ** object to a stream.
+ ** a vaild serialization of an policy response object to a stream. This
+ ** does not flush the stream.
  ** ** **/
 std::ostream& tgrey::operator<< (std::ostream& out,
                                  const tgrey::policy_response& res) {
-  out << "action=" << res.action;
-
-  if(!res.text.empty())
-    out << " " << res.text;
-
-  out << std::endl << std::endl;
-  return out;
+  return out << res.wire;
 }
 
 /** Predefined policy responses used by the protocol.
@@ -137,51 +262,6 @@ const tgrey::policy_response tgrey::policy_response::dunno("dunno");
 const tgrey::policy_response tgrey::policy_response::service_unavailable(
                                  "defer_if_permit", "Service is unavailable");
 
-/** Helper function to mask bits of an IPv4 or IPv6 address and return
- ** an string representation of it.
- ** ** **/
-inline const std::string mask_addr(
-          const std::string& ip, unsigned int v4mask, unsigned int v6mask) {
-  struct addrinfo hints;
-  struct addrinfo* result = 0;
-
-  // restrict getaddrinfo so it returns at most one result
-  memset(&hints, 0, sizeof(struct addrinfo));
-  hints.ai_flags = AI_NUMERICHOST;
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-
-  // validate the string representation and detect whether it is v4 or v6
-  if(getaddrinfo(ip.c_str(), 0, &hints, &result) || !result)
-    throw std::runtime_error("not a valid IP address: " + ip);
-
-  int af = result->ai_family;
-  freeaddrinfo(result);
-
-  // allocate space for the byte representation and convert from string
-  std::vector<unsigned char> addr(
-       af == AF_INET ? sizeof(struct in_addr) : sizeof(struct in6_addr), 0);
-  inet_pton(af, ip.c_str(), &addr[0]);
-
-  // depending on address type use correct mask
-  unsigned int mask = af == AF_INET ? v4mask : v6mask;
-
-  // modify the (mask/8)th byte and set all after that to zero
-  addr[mask/8] &= 256 - (1 << (8 - (mask % 8)));
-  std::fill(addr.begin() + mask/8, addr.end(), 0);
-
-  // convert bytes back to string
-  std::ostringstream oss;
-
-  for(std::vector<unsigned char>::const_iterator it = addr.begin();
-      it != addr.end(); ++it) {
-    oss << std::hex << std::setw(2) << std::setfill('0')
-        << static_cast<unsigned int>(*it);
-  }
-
-  return oss.str();
-}
-
 inline const std::string mask_name(const std::string& name) {
   size_t pos;
 
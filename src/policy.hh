@@ -14,11 +14,14 @@
 #include <istream>
 #include <string>
 
+#include "misc.hh"
+
 namespace tgrey
 {
   class policy_request {
     public:
       policy_request(std::istream&);
+      policy_request(const char*, const char*);
       const std::string to_key(const std::string&,
                                const unsigned int,
                                const unsigned int) const;
@@ -30,6 +33,9 @@ namespace tgrey
       std::string recipient;
       std::string client_name;
       std::string client_address;
+
+    private:
+      void parse(const char*, const char*);
   };
 
   class policy_response {
@@ -39,12 +45,34 @@ namespace tgrey
 
       const std::string action;
       const std::string text;
+      const std::string wire;
 
       policy_response(const std::string&, const std::string&);
       policy_response(const std::string&);
   };
 
   std::ostream& operator<< (std::ostream&, const policy_response&);
+  size_t request_end(const std::string&, size_t = 0);
+
+  /** Evaluates policy requests. A handler may defer making its changes
+   ** durable; callers have to commit before sending the responses to
+   ** the requests handled so far and should do so once commit_due (in
+   ** milliseconds, -1 if nothing is pending) reaches 0. Servers call
+   ** idle when no requests have come in for as many milliseconds as it
+   ** returned the last time, -1 meaning never again, so the handler can
+   ** do background work; its changes are to be committed by itself.
+   ** Callers also call answered once the responses to the requests
+   ** handled so far have been written, for work that should not hold
+   ** them up; its changes are committed along with those of requests.
+   ** ** **/
+  class request_handler {
+    public:
+      virtual const policy_response& handle(const policy_request&) = 0;
+      virtual long commit_due() { return -1; }
+      virtual void commit() { /* empty */ }
+      virtual long idle() { return -1; }
+      virtual void answered() { /* empty */ }
+  };
 }
 
 #endif /* TGREY_POLICY_HH */
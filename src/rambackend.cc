@@ -0,0 +1,1096 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <tr1/unordered_map>
+#include <vector>
+
+#include "backend.hh"
+#include "misc.hh"
+#include "thread.hh"
+
+/** A RAM database keeps all records in a hash table. Changes are made
+ ** durable by appending them to a log, PATH.log, and a snapshot of the
+ ** whole table is written to PATH once the log has grown larger than
+ ** it. For that the log is moved aside to PATH.log.old and a new one is
+ ** started, and a copy of the table is written by a thread of its own;
+ ** the old log is deleted once the snapshot is in place. Opening loads
+ ** the snapshot and replays the logs on top of it.
+ **
+ ** Each log starts with its generation and each snapshot records the
+ ** first generation it does not hold, so that logs that are already
+ ** part of the snapshot are not replayed a second time when a crash has
+ ** kept them from being deleted.
+ **
+ ** Every log entry carries a checksum; replaying stops at the first
+ ** entry that is incomplete or damaged, which is where a crash cut off
+ ** the last append, and the log is truncated there. Entries written by
+ ** one batch are flagged as continued up to the last one and are only
+ ** applied as a whole.
+ **
+ ** A change is only made to the table once its entry has been written
+ ** to the log, or queued to be written with the rest of its group. If
+ ** writing the log fails, the change is taken back and the entries
+ ** queued before it stay queued.
+ **
+ ** PATH.lock is locked while open, so only one process at a time may use
+ ** the database.
+ ** ** **/
+const char snapshot_magic[8] = { 't', 'g', 'r', 'e', 'y', 'r', 'a', 'm' };
+const size_t entry_header = 9;
+const size_t entry_trailer = 8;
+const size_t min_snapshot_log = 1048576;
+const size_t write_chunk = 65536;
+
+const unsigned char op_store = 'S';
+const unsigned char op_remove = 'R';
+const unsigned char op_append = 'A';
+const unsigned char op_generation = 'G';
+const unsigned char op_continued = 0x80;
+
+typedef std::tr1::unordered_map<std::string, std::string> ram_table;
+
+/** A record as it was before a batch changed it, for taking the batch
+ ** back.
+ ** ** **/
+struct ram_undo {
+    std::string key;
+    std::string val;
+    bool existed;
+};
+
+inline void put_u32(std::string& out, uint32_t v) {
+  for(int i = 0; i < 4; ++i)
+    out += char(v >> (8 * i));
+}
+
+inline void put_u64(std::string& out, uint64_t v) {
+  for(int i = 0; i < 8; ++i)
+    out += char(v >> (8 * i));
+}
+
+inline uint64_t get_le(const char* in, int bytes) {
+  uint64_t v = 0;
+
+  for(int i = bytes - 1; i >= 0; --i)
+    v = (v << 8) | static_cast<unsigned char>(in[i]);
+
+  return v;
+}
+
+inline void append_entry(std::string& out, unsigned char op,
+                         const std::string& key, const std::string& val) {
+  const size_t start = out.length();
+
+  out += char(op);
+  put_u32(out, key.length());
+  put_u32(out, val.length());
+  out += key;
+  out += val;
+  put_u64(out, tgrey::stable_hash(out.data() + start, out.length() - start));
+}
+
+/** Decode the entry at the start of in. Returns its length or 0 if it
+ ** is incomplete or its checksum does not match.
+ ** ** **/
+inline size_t parse_entry(const char* in, size_t len, unsigned char& op,
+                          std::string& key, std::string& val) {
+  if(len < entry_header + entry_trailer)
+    return 0;
+
+  uint64_t key_len = get_le(in + 1, 4);
+  uint64_t val_len = get_le(in + 5, 4);
+  uint64_t size = entry_header + key_len + val_len;
+
+  if(size + entry_trailer > len ||
+     get_le(in + size, 8) != tgrey::stable_hash(in, size))
+    return 0;
+
+  op = in[0];
+  key.assign(in + entry_header, key_len);
+  val.assign(in + entry_header + key_len, val_len);
+  return size + entry_trailer;
+}
+
+inline std::string generation_entry(uint64_t gen) {
+  std::string val, out;
+  put_u64(val, gen);
+  append_entry(out, op_generation, std::string(), val);
+  return out;
+}
+
+/** Decode the generation entry at pos, if there is one. Returns its
+ ** length or 0.
+ ** ** **/
+inline size_t parse_generation(const std::string& data, size_t pos,
+                               uint64_t& gen) {
+  unsigned char op;
+  std::string key, val;
+  size_t len = parse_entry(data.data() + pos, data.length() - pos,
+                           op, key, val);
+
+  if(!len || op != op_generation || val.length() != 8)
+    return 0;
+
+  gen = get_le(val.data(), 8);
+  return len;
+}
+
+inline bool read_file(int fd, std::string& out) {
+  char buf[write_chunk];
+  ssize_t len;
+
+  while((len = ::read(fd, buf, sizeof(buf))) != 0) {
+    if(len < 0 && errno == EINTR)
+      continue;
+
+    if(len < 0)
+      return false;
+
+    out.append(buf, len);
+  }
+
+  return true;
+}
+
+inline bool write_all(int fd, const char* data, size_t len) {
+  while(len) {
+    ssize_t done = ::write(fd, data, len);
+
+    if(done < 0 && errno == EINTR)
+      continue;
+
+    if(done < 0)
+      return false;
+
+    data += done;
+    len -= done;
+  }
+
+  return true;
+}
+
+/** Sync the directory holding path, so that files created in or renamed
+ ** into it are there after a crash.
+ ** ** **/
+inline bool sync_dir(const std::string& path) {
+  std::string::size_type slash = path.rfind('/');
+  std::string dir = slash == std::string::npos ? "." :
+                    path.substr(0, slash ? slash : 1);
+  int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+  if(fd < 0)
+    return false;
+
+  bool ok = !::fsync(fd);
+  ::close(fd);
+  return ok;
+}
+
+/** Write a snapshot of table holding the logs before the given
+ ** generation. It is synced before being renamed into place, as those
+ ** logs are deleted afterwards. Returns its size.
+ ** ** **/
+inline size_t write_snapshot(const std::string& filename,
+                             const ram_table& table, uint64_t gen) {
+  const std::string tmpname = filename + ".tmp";
+  int fd = ::open(tmpname.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  S_IRUSR | S_IWUSR);
+
+  if(fd < 0)
+    throw tgrey::sys_error("error creating RAM database snapshot");
+
+  std::string buf(snapshot_magic, sizeof(snapshot_magic));
+  buf += generation_entry(gen);
+  size_t size = 0;
+  bool ok = true;
+
+  for(ram_table::const_iterator it = table.begin();
+      ok && it != table.end(); ++it) {
+    append_entry(buf, op_store, it->first, it->second);
+
+    if(buf.length() >= write_chunk) {
+      ok = write_all(fd, buf.data(), buf.length());
+      size += buf.length();
+      buf.clear();
+    }
+  }
+
+  ok = ok && write_all(fd, buf.data(), buf.length()) && !::fsync(fd);
+  size += buf.length();
+
+  if(!ok || ::rename(tmpname.c_str(), filename.c_str())) {
+    std::runtime_error err =
+      tgrey::sys_error("error writing RAM database snapshot");
+    ::close(fd);
+    ::unlink(tmpname.c_str());
+    throw err;
+  }
+
+  ::close(fd);
+
+  if(!sync_dir(filename))
+    throw tgrey::sys_error("error syncing RAM database snapshot");
+
+  return size;
+}
+
+class ram_engine : public tgrey::backend {
+  public:
+    ram_engine(const std::string& f)
+      : filename(f), logname(f + ".log"), oldname(f + ".log.old"),
+        lock(true), opened(false), lock_fd(-1), log_fd(-1), log_size(0),
+        snapshot_size(0), generation(0), old_pending(false),
+        snapshotting(false), joinable(false), copy(0), copy_generation(0),
+        mode(tgrey::durability_none), max_writes(1), max_delay(0),
+        writes(0), started(0), holds(0) {
+      /* empty */
+    }
+
+    virtual ~ram_engine();
+
+    virtual void open();
+    virtual bool fetch(const std::string&, std::string&);
+    virtual bool fetch_record(const std::string&, tgrey::record&);
+    virtual void store(const std::string&, const std::string&);
+    virtual bool insert(const std::string&, const std::string&);
+    virtual void append(const std::string&, const std::string&);
+    virtual bool can_append() { return true; }
+    virtual void remove(const std::string&);
+    virtual size_t apply(const tgrey::write_batch&);
+    virtual void traverse(tgrey::database&, tgrey::db_visitor&);
+    virtual size_t traverse_view(tgrey::database&,
+                                 tgrey::db_view_visitor&, size_t, size_t);
+    virtual bool scan(tgrey::database&, tgrey::db_visitor&, std::string&,
+                      size_t);
+
+    virtual void group_commit(tgrey::durability, size_t, unsigned int);
+    virtual long commit_due();
+    virtual void commit();
+
+  protected:
+    const std::string filename;
+    const std::string logname;
+    const std::string oldname;
+    tgrey::mutex lock;
+    bool opened;
+    ram_table table;
+    int lock_fd;
+    int log_fd;
+    size_t log_size;
+    size_t snapshot_size;
+    uint64_t generation;
+    bool old_pending;
+    bool snapshotting;
+    bool joinable;
+    pthread_t thread;
+    ram_table* copy;
+    uint64_t copy_generation;
+    std::string snapshot_failure;
+    tgrey::durability mode;
+    size_t max_writes;
+    unsigned int max_delay;
+    std::string pending;
+    size_t writes;
+    int64_t started;
+    unsigned int holds;
+
+    uint64_t load();
+    bool replay_old(uint64_t);
+    size_t replay(const std::string&, size_t);
+    void start_log();
+    void logged(unsigned char, const std::string&, const std::string&);
+    bool end_write(size_t, size_t = 1);
+    void write_log();
+    void flush();
+    void check_snapshot();
+    void start_snapshot();
+    void snapshot();
+
+    static void* snapshot_main(void*);
+};
+
+ram_engine::~ram_engine() {
+  if(!opened)
+    return;
+
+  if(joinable)
+    ::pthread_join(thread, 0);
+
+  // leave a fresh snapshot behind to keep the next start quick
+  try {
+    write_log();
+    snapshot();
+  }
+  catch(const std::exception&) {
+    /* the logs still hold everything written successfully */
+  }
+
+  ::close(log_fd);
+  ::close(lock_fd);
+}
+
+void ram_engine::open() {
+  tgrey::scoped_lock l(lock);
+
+  if(opened)
+    return;
+
+  // the logs are moved around, so the lock is kept on a file of its own
+  lock_fd = ::open((filename + ".lock").c_str(),
+                   O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+
+  if(lock_fd < 0)
+    throw tgrey::sys_error("error opening RAM database lock");
+
+  try {
+    if(::flock(lock_fd, LOCK_EX | LOCK_NB)) {
+      if(errno == EWOULDBLOCK)
+        throw std::runtime_error("RAM database is in use by another "
+                                 "process: " + filename);
+
+      throw tgrey::sys_error("error locking RAM database");
+    }
+
+    const uint64_t covered = load();
+    bool stale = replay_old(covered);
+
+    log_fd = ::open(logname.c_str(),
+                    O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC,
+                    S_IRUSR | S_IWUSR);
+
+    if(log_fd < 0)
+      throw tgrey::sys_error("error opening RAM database log");
+
+    std::string data;
+
+    if(!read_file(log_fd, data))
+      throw tgrey::sys_error("error reading RAM database log");
+
+    uint64_t gen = 0;
+    size_t start = parse_generation(data, 0, gen);
+
+    // logs written before generations were recorded are replayed as well
+    if(!start || gen >= covered) {
+      size_t good = replay(data, start);
+
+      if(good < data.length() && ::ftruncate(log_fd, good))
+        throw tgrey::sys_error("error truncating RAM database log");
+
+      log_size = good;
+    }
+    else
+      stale = true;
+
+    generation = std::max(gen, covered);
+
+    // start over with a single log that is not part of the snapshot
+    if(stale || (!start && !data.empty()))
+      snapshot();
+    else if(!start)
+      start_log();
+  }
+  catch(...) {
+    if(log_fd >= 0)
+      ::close(log_fd);
+
+    ::close(lock_fd);
+    log_fd = lock_fd = -1;
+    table.clear();
+    throw;
+  }
+
+  opened = true;
+}
+
+/** Fill the table from the snapshot, if there is one. Returns the first
+ ** generation of logs not held by it.
+ ** ** **/
+uint64_t ram_engine::load() {
+  int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+
+  if(fd < 0 && errno == ENOENT)
+    return 0;
+
+  if(fd < 0)
+    throw tgrey::sys_error("error opening RAM database snapshot");
+
+  std::string data;
+  bool ok = read_file(fd, data);
+  ::close(fd);
+
+  if(!ok)
+    throw tgrey::sys_error("error reading RAM database snapshot");
+
+  if(data.compare(0, sizeof(snapshot_magic),
+                  snapshot_magic, sizeof(snapshot_magic)))
+    throw std::runtime_error("not a valid RAM database snapshot: " +
+                             filename);
+
+  unsigned char op;
+  std::string key, val;
+  uint64_t covered = 0;
+  size_t pos = sizeof(snapshot_magic);
+
+  pos += parse_generation(data, pos, covered);
+
+  while(pos < data.length()) {
+    size_t len = parse_entry(data.data() + pos, data.length() - pos,
+                             op, key, val);
+
+    // snapshots are renamed into place only once complete
+    if(!len || op != op_store)
+      throw std::runtime_error("damaged RAM database snapshot: " + filename);
+
+    table[key] = val;
+    pos += len;
+  }
+
+  snapshot_size = data.length();
+  return covered;
+}
+
+/** Apply the log left behind by a snapshot that has not been completed,
+ ** unless the snapshot has been written after all. Returns whether there
+ ** has been such a log.
+ ** ** **/
+bool ram_engine::replay_old(uint64_t covered) {
+  int fd = ::open(oldname.c_str(), O_RDONLY | O_CLOEXEC);
+
+  if(fd < 0 && errno == ENOENT)
+    return false;
+
+  if(fd < 0)
+    throw tgrey::sys_error("error opening old RAM database log");
+
+  std::string data;
+  bool ok = read_file(fd, data);
+  ::close(fd);
+
+  if(!ok)
+    throw tgrey::sys_error("error reading old RAM database log");
+
+  uint64_t gen = 0;
+  size_t start = parse_generation(data, 0, gen);
+
+  if(!start || gen >= covered)
+    replay(data, start);
+
+  return true;
+}
+
+/** Apply the entries of a log from pos on top of the table. Returns the
+ ** end of the last complete entry.
+ ** ** **/
+size_t ram_engine::replay(const std::string& data, size_t pos) {
+  std::vector<std::pair<std::string, std::string> > batch;
+  std::vector<unsigned char> ops;
+  unsigned char op;
+  std::string key, val;
+  size_t good = pos;
+
+  while(size_t len = parse_entry(data.data() + pos, data.length() - pos,
+                                 op, key, val)) {
+    pos += len;
+    batch.push_back(std::make_pair(key, val));
+    ops.push_back(op & ~op_continued);
+
+    if(op & op_continued)
+      continue;
+
+    for(size_t i = 0; i < batch.size(); ++i) {
+      if(ops[i] == op_remove)
+        table.erase(batch[i].first);
+      else if(ops[i] == op_append)
+        table[batch[i].first] += batch[i].second;
+      else
+        table[batch[i].first] = batch[i].second;
+    }
+
+    batch.clear();
+    ops.clear();
+    good = pos;
+  }
+
+  return good;
+}
+
+/** Write the generation to the start of the empty log.
+ ** ** **/
+void ram_engine::start_log() {
+  const std::string entry = generation_entry(generation);
+
+  if(!write_all(log_fd, entry.data(), entry.length()))
+    throw tgrey::sys_error("error writing RAM database log");
+
+  log_size = entry.length();
+}
+
+/** Queue a change to be appended to the log.
+ ** ** **/
+void ram_engine::logged(unsigned char op, const std::string& key,
+                        const std::string& val) {
+  if(pending.empty())
+    started = tgrey::monotonic_ms();
+
+  append_entry(pending, op, key, val);
+}
+
+/** Count writes and write the log once a group is full, returning
+ ** whether it has been. If that fails, the entries queued from mark on
+ ** are taken back, so the caller has to leave its change unmade. Writing
+ ** is held back while a traversal is running.
+ ** ** **/
+bool ram_engine::end_write(size_t mark, size_t count) {
+  writes += count;
+
+  if(writes < max_writes || holds)
+    return false;
+
+  try {
+    write_log();
+  }
+  catch(...) {
+    pending.resize(mark);
+    throw;
+  }
+
+  return true;
+}
+
+/** Append the queued changes to the log, syncing it if asked for. On
+ ** failure they stay queued, to be written again with the next ones.
+ ** ** **/
+void ram_engine::write_log() {
+  writes = 0;
+
+  if(pending.empty())
+    return;
+
+  const char* what = 0;
+
+  if(!write_all(log_fd, pending.data(), pending.length()))
+    what = "error writing RAM database log";
+  else if(mode == tgrey::durability_fsync && ::fdatasync(log_fd))
+    what = "error syncing RAM database log";
+
+  if(what) {
+    std::runtime_error err = tgrey::sys_error(what);
+
+    // do not leave a partial entry for later ones to be appended to
+    if(::ftruncate(log_fd, log_size)) {
+      /* replaying stops at the partial entry */
+    }
+
+    throw err;
+  }
+
+  log_size += pending.length();
+  pending.clear();
+}
+
+/** Write the queued changes and see to the snapshot.
+ ** ** **/
+void ram_engine::flush() {
+  write_log();
+  check_snapshot();
+}
+
+/** Start a snapshot once the log is larger than the last one, after the
+ ** log has been written. Errors of snapshots written in the background
+ ** are reported by the next call.
+ ** ** **/
+void ram_engine::check_snapshot() {
+  if(!snapshot_failure.empty()) {
+    std::runtime_error err(snapshot_failure);
+    snapshot_failure.clear();
+    throw err;
+  }
+
+  if(snapshotting || log_size <= min_snapshot_log ||
+     log_size <= snapshot_size)
+    return;
+
+  // the log left behind by a failed snapshot is still needed, so this
+  // one cannot be moved aside and the snapshot is written right away
+  if(old_pending)
+    snapshot();
+  else
+    start_snapshot();
+}
+
+/** Move the log aside, start a new one and have a copy of the table
+ ** written by a thread of its own, so that requests are only held up by
+ ** copying the table.
+ ** ** **/
+void ram_engine::start_snapshot() {
+  if(joinable) {
+    ::pthread_join(thread, 0);
+    joinable = false;
+  }
+
+  if(::rename(logname.c_str(), oldname.c_str()))
+    throw tgrey::sys_error("error moving RAM database log aside");
+
+  int fd = ::open(logname.c_str(),
+                  O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                  S_IRUSR | S_IWUSR);
+
+  if(fd < 0) {
+    std::runtime_error err =
+      tgrey::sys_error("error creating RAM database log");
+    ::rename(oldname.c_str(), logname.c_str());
+    throw err;
+  }
+
+  ::close(log_fd);
+  log_fd = fd;
+  old_pending = true;
+  generation++;
+  start_log();
+
+  if(mode == tgrey::durability_fsync && !sync_dir(logname))
+    throw tgrey::sys_error("error syncing RAM database log");
+
+  copy = new ram_table(table);
+  copy_generation = generation;
+  snapshotting = true;
+
+  if(int err = ::pthread_create(&thread, 0, &ram_engine::snapshot_main,
+                                this)) {
+    delete copy;
+    copy = 0;
+    snapshotting = false;
+    throw std::runtime_error(std::string("error starting RAM database "
+                                         "snapshot: ") +
+                             std::string(strerror(err)));
+  }
+
+  joinable = true;
+}
+
+void* ram_engine::snapshot_main(void* arg) {
+  ram_engine& e = *static_cast<ram_engine*>(arg);
+  std::string error;
+  size_t size = 0;
+
+  try {
+    size = write_snapshot(e.filename, *e.copy, e.copy_generation);
+
+    if(::unlink(e.oldname.c_str()))
+      throw tgrey::sys_error("error deleting old RAM database log");
+  }
+  catch(const std::exception& err) {
+    error = err.what();
+  }
+
+  tgrey::scoped_lock l(e.lock);
+  delete e.copy;
+  e.copy = 0;
+  e.snapshotting = false;
+
+  if(error.empty()) {
+    e.snapshot_size = size;
+    e.old_pending = false;
+  }
+  else
+    e.snapshot_failure = error;
+
+  return 0;
+}
+
+/** Replace the snapshot by the current table right away and start the
+ ** log over. The logs are part of the new snapshot whether or not a
+ ** crash keeps them from being emptied.
+ ** ** **/
+void ram_engine::snapshot() {
+  snapshot_size = write_snapshot(filename, table, generation + 1);
+  generation++;
+
+  if(::ftruncate(log_fd, 0))
+    throw tgrey::sys_error("error truncating RAM database log");
+
+  start_log();
+
+  if(::unlink(oldname.c_str()) && errno != ENOENT)
+    throw tgrey::sys_error("error deleting old RAM database log");
+
+  old_pending = false;
+}
+
+bool ram_engine::fetch(const std::string& key, std::string& val) {
+  tgrey::scoped_lock l(lock);
+
+  if(!opened)
+    throw std::runtime_error("trying to fetch from unopened RAM database");
+
+  ram_table::const_iterator it = table.find(key);
+
+  if(it == table.end())
+    return false;
+
+  val = it->second;
+  return true;
+}
+
+bool ram_engine::fetch_record(const std::string& key, tgrey::record& rec) {
+  tgrey::scoped_lock l(lock);
+
+  if(!opened)
+    throw std::runtime_error("trying to fetch from unopened RAM database");
+
+  ram_table::const_iterator it = table.find(key);
+
+  if(it == table.end())
+    return false;
+
+  tgrey::decode_record(it->second, rec);
+  return true;
+}
+
+void ram_engine::store(const std::string& key, const std::string& val) {
+  tgrey::scoped_lock l(lock);
+
+  if(!opened)
+    throw std::runtime_error("trying to store to unopened RAM database");
+
+  const size_t mark = pending.length();
+  logged(op_store, key, val);
+  bool written = end_write(mark);
+  table[key] = val;
+
+  if(written)
+    check_snapshot();
+}
+
+bool ram_engine::insert(const std::string& key, const std::string& val) {
+  tgrey::scoped_lock l(lock);
+
+  if(!opened)
+    throw std::runtime_error("trying to store to unopened RAM database");
+
+  if(table.count(key))
+    return false;
+
+  const size_t mark = pending.length();
+  logged(op_store, key, val);
+  bool written = end_write(mark);
+  table.insert(std::make_pair(key, val));
+
+  if(written)
+    check_snapshot();
+
+  return true;
+}
+
+void ram_engine::append(const std::string& key, const std::string& val) {
+  tgrey::scoped_lock l(lock);
+
+  if(!opened)
+    throw std::runtime_error("trying to store to unopened RAM database");
+
+  const size_t mark = pending.length();
+  logged(op_append, key, val);
+  bool written = end_write(mark);
+  table[key] += val;
+
+  if(written)
+    check_snapshot();
+}
+
+void ram_engine::remove(const std::string& key) {
+  tgrey::scoped_lock l(lock);
+
+  if(!opened)
+    throw std::runtime_error("trying to delete from unopened RAM database");
+
+  ram_table::iterator it = table.find(key);
+
+  if(it == table.end())
+    throw std::runtime_error("error deleting from RAM database: "
+                             "record does not exist");
+
+  const size_t mark = pending.length();
+  logged(op_remove, key, std::string());
+  bool written = end_write(mark);
+  table.erase(it);
+
+  if(written)
+    check_snapshot();
+}
+
+/** Apply a batch, logging its entries so that they are replayed all or
+ ** not at all. As the writes of a batch depend on each other, they are
+ ** made to the table right away and taken back if the log cannot be
+ ** written.
+ ** ** **/
+size_t ram_engine::apply(const tgrey::write_batch& batch) {
+  tgrey::scoped_lock l(lock);
+
+  if(!opened)
+    throw std::runtime_error("trying to store to unopened RAM database");
+
+  const std::vector<tgrey::write_batch::op>& ops = batch.ops();
+  std::vector<size_t> done;
+  std::vector<ram_undo> undo;
+  size_t removed = 0;
+
+  for(size_t i = 0; i < ops.size(); ++i) {
+    ram_table::iterator it = table.find(ops[i].key);
+
+    if(ops[i].conditional && (it == table.end() || it->second != ops[i].val))
+      continue;
+
+    if(ops[i].remove && it == table.end())
+      continue;
+
+    ram_undo u = { ops[i].key,
+                   it != table.end() ? it->second : std::string(),
+                   it != table.end() };
+    undo.push_back(u);
+
+    if(ops[i].append)
+      table[ops[i].key] += ops[i].val;
+    else if(!ops[i].remove)
+      table[ops[i].key] = ops[i].val;
+    else {
+      table.erase(it);
+      removed++;
+    }
+
+    done.push_back(i);
+  }
+
+  const size_t mark = pending.length();
+
+  for(size_t i = 0; i < done.size(); ++i) {
+    const tgrey::write_batch::op& o = ops[done[i]];
+    unsigned char op =
+      o.remove ? op_remove : o.append ? op_append : op_store;
+
+    if(i + 1 < done.size())
+      op |= op_continued;
+
+    logged(op, o.key, o.remove ? std::string() : o.val);
+  }
+
+  bool written;
+
+  try {
+    written = end_write(mark, done.size());
+  }
+  catch(...) {
+    for(size_t i = undo.size(); i-- > 0; ) {
+      if(undo[i].existed)
+        table[undo[i].key] = undo[i].val;
+      else
+        table.erase(undo[i].key);
+    }
+
+    throw;
+  }
+
+  if(written)
+    check_snapshot();
+
+  return removed;
+}
+
+/** Visit all records present when the traversal starts that have not
+ ** been removed by the time they are reached. Visitors may change the
+ ** database.
+ ** ** **/
+void ram_engine::traverse(tgrey::database& db, tgrey::db_visitor& visitor) {
+  tgrey::scoped_lock l(lock);
+
+  if(!opened)
+    throw std::runtime_error("trying to traverse unopened RAM database");
+
+  std::vector<std::string> keys;
+  keys.reserve(table.size());
+
+  for(ram_table::const_iterator it = table.begin(); it != table.end(); ++it)
+    keys.push_back(it->first);
+
+  holds++;
+
+  try {
+    std::string val;
+
+    // visitors get copies, as they may remove the record
+    for(size_t i = 0; i < keys.size(); ++i) {
+      ram_table::const_iterator it = table.find(keys[i]);
+
+      if(it == table.end())
+        continue;
+
+      val = it->second;
+
+      if(visitor.visit(db, keys[i], val))
+        break;
+    }
+  }
+  catch(...) {
+    holds--;
+    throw;
+  }
+
+  holds--;
+
+  // flush what has been held back while traversing
+  if(writes >= max_writes)
+    flush();
+}
+
+/** Walk the table in place, handing out views of its entries; as the
+ ** visitor cannot change the table, no copy of the keys is needed.
+ ** ** **/
+size_t ram_engine::traverse_view(tgrey::database& db,
+                                 tgrey::db_view_visitor& visitor,
+                                 size_t part, size_t parts) {
+  tgrey::scoped_lock l(lock);
+
+  if(!opened)
+    throw std::runtime_error("trying to traverse unopened RAM database");
+
+  if(part)
+    return 0;
+
+  size_t removed = 0;
+  holds++;
+
+  try {
+    for(ram_table::iterator it = table.begin(); it != table.end(); ) {
+      tgrey::db_view_visitor::action act = visitor.visit(it->first,
+                                                         it->second);
+
+      if(act == tgrey::db_view_visitor::stop)
+        break;
+
+      if(act != tgrey::db_view_visitor::remove) {
+        ++it;
+        continue;
+      }
+
+      // erasing an entry leaves the iterators to the others valid
+      ram_table::iterator next = it;
+      ++next;
+
+      const size_t mark = pending.length();
+      logged(op_remove, it->first, std::string());
+      end_write(mark);
+      table.erase(it);
+      removed++;
+      it = next;
+    }
+  }
+  catch(...) {
+    holds--;
+    throw;
+  }
+
+  holds--;
+
+  if(writes >= max_writes)
+    flush();
+
+  return removed;
+}
+
+/** Walk the table bucket by bucket, the cursor holding the number of
+ ** buckets and the index of the next one. If the table has been rehashed
+ ** in between, the walk starts over, visiting records twice rather than
+ ** skipping them.
+ ** ** **/
+bool ram_engine::scan(tgrey::database& db, tgrey::db_visitor& visitor,
+                      std::string& cursor, size_t count) {
+  tgrey::scoped_lock l(lock);
+
+  if(!opened)
+    throw std::runtime_error("trying to traverse unopened RAM database");
+
+  const size_t buckets = table.bucket_count();
+  size_t seen = 0, idx = 0;
+  char colon;
+
+  std::istringstream in(cursor);
+  in >> seen >> colon >> idx;
+
+  if(!in || seen != buckets)
+    idx = 0;
+
+  std::vector<std::pair<std::string, std::string> > batch;
+
+  for(; idx < buckets && batch.size() < count; ++idx)
+    for(ram_table::const_local_iterator it = table.begin(idx);
+        it != table.end(idx); ++it)
+      batch.push_back(*it);
+
+  std::ostringstream pos;
+  pos << buckets << ':' << idx;
+  cursor = idx < buckets ? pos.str() : std::string();
+
+  for(size_t i = 0; i < batch.size(); ++i)
+    if(visitor.visit(db, batch[i].first, batch[i].second))
+      break;
+
+  return idx < buckets;
+}
+
+/** Without grouping every change is written to the log on its own, so
+ ** it survives the process but not the system crashing. Otherwise the
+ ** changes are written once a group is full or commit() is called and,
+ ** with fsync durability, synced to disk.
+ ** ** **/
+void ram_engine::group_commit(tgrey::durability m, size_t w,
+                              unsigned int d) {
+  tgrey::scoped_lock l(lock);
+
+  if(opened)
+    throw std::runtime_error("cannot change durability of open database");
+
+  mode = m;
+  max_writes = m == tgrey::durability_none || !w ? 1 : w;
+  max_delay = d;
+}
+
+long ram_engine::commit_due() {
+  tgrey::scoped_lock l(lock);
+
+  if(mode == tgrey::durability_none || pending.empty())
+    return -1;
+
+  int64_t left = started + max_delay - tgrey::monotonic_ms();
+  return left > 0 ? left : 0;
+}
+
+void ram_engine::commit() {
+  tgrey::scoped_lock l(lock);
+
+  if(opened)
+    flush();
+}
+
+tgrey::backend* tgrey::ram_backend(const std::string& filename) {
+  return new ram_engine(filename);
+}
@@ -0,0 +1,110 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#include <string.h>
+#include <stdexcept>
+#include <string>
+
+#include "misc.hh"
+#include "record.hh"
+
+inline uint64_t load_le(const unsigned char* p, int len) {
+  uint64_t v = 0;
+  for(int i = len - 1; i >= 0; --i)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+inline void store_le(unsigned char* p, uint64_t v, int len) {
+  for(int i = 0; i < len; ++i, v >>= 8)
+    p[i] = v & 0xff;
+}
+
+/** Parse a record in the text format used before the binary one:
+ ** lastseen as a decimal number, the field separator and the cleared
+ ** flag as "true" or "false".
+ ** ** **/
+inline void decode_legacy(const char* pos, size_t len, tgrey::record& rec) {
+  const char* end = pos + len;
+  bool negative = pos < end && *pos == '-';
+  uint64_t num = 0;
+
+  if(negative)
+    ++pos;
+
+  const char* digits = pos;
+
+  for(; pos < end && *pos >= '0' && *pos <= '9'; ++pos)
+    num = num * 10 + (*pos - '0');
+
+  if(pos == digits)
+    throw std::runtime_error("invalid lastseen field");
+
+  if(pos == end || *pos++ != tgrey::field_separator)
+    throw std::runtime_error("invalid field delimiter");
+
+  if(end - pos == 4 && !memcmp(pos, "true", 4))
+    rec.cleared = true;
+  else if(end - pos == 5 && !memcmp(pos, "false", 5))
+    rec.cleared = false;
+  else
+    throw std::runtime_error("invalid cleared field");
+
+  rec.lastseen = negative ? -int64_t(num) : int64_t(num);
+  rec.firstseen = 0;
+  rec.passes = 0;
+}
+
+/** Records in the legacy text format start with the digits (or the sign)
+ ** of lastseen, binary records with a small version number.
+ ** ** **/
+bool tgrey::is_legacy_record(const char* data, size_t len) {
+  return len && ((data[0] >= '0' && data[0] <= '9') || data[0] == '-');
+}
+
+bool tgrey::is_legacy_record(const std::string& data) {
+  return is_legacy_record(data.data(), data.length());
+}
+
+/** Decode a record directly from the bytes stored in the database.
+ ** ** **/
+void tgrey::decode_record(const char* data, size_t len, record& rec) {
+  if(is_legacy_record(data, len)) {
+    decode_legacy(data, len, rec);
+    return;
+  }
+
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+
+  // later versions only append fields, which are skipped
+  if(len < record_size || p[0] < record_version)
+    throw std::runtime_error("invalid database record");
+
+  rec.cleared = p[1] & 1;
+  rec.lastseen = load_le(p + 2, 8);
+  rec.firstseen = load_le(p + 10, 8);
+  rec.passes = load_le(p + 18, 4);
+}
+
+void tgrey::decode_record(const std::string& data, record& rec) {
+  decode_record(data.data(), data.length(), rec);
+}
+
+const std::string tgrey::encode_record(const record& rec) {
+  unsigned char buf[record_size];
+
+  buf[0] = record_version;
+  buf[1] = rec.cleared ? 1 : 0;
+  store_le(buf + 2, rec.lastseen, 8);
+  store_le(buf + 10, rec.firstseen, 8);
+  store_le(buf + 18, rec.passes, 4);
+
+  return std::string(reinterpret_cast<char*>(buf), sizeof(buf));
+}
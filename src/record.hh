@@ -0,0 +1,55 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#ifndef TGREY_RECORD_HH
+#define TGREY_RECORD_HH
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+namespace tgrey
+{
+  /** The data stored for every triplet. Records are stored in a fixed
+   ** binary layout (all integers little endian):
+   **
+   **   offset  size  field
+   **        0     1  version, currently 1
+   **        1     1  flags, bit 0 set if the triplet is cleared
+   **        2     8  lastseen, seconds since the epoch
+   **       10     8  firstseen, seconds since the epoch; 0 if unknown
+   **       18     4  passes, number of deliveries let through
+   **
+   ** Later versions may only append fields; their records are read up to
+   ** the fields above and the rest is ignored. Records written by earlier
+   ** releases as text ("<lastseen>\x1f<true|false>") are still read.
+   ** ** **/
+  struct record {
+      int64_t lastseen;
+      int64_t firstseen;
+      uint32_t passes;
+      bool cleared;
+
+      record() : lastseen(0), firstseen(0), passes(0), cleared(false) {
+        /* empty */
+      }
+  };
+
+  const unsigned char record_version = 1;
+  const size_t record_size = 22;
+
+  void decode_record(const char*, size_t, record&);
+  void decode_record(const std::string&, record&);
+  const std::string encode_record(const record&);
+  bool is_legacy_record(const char*, size_t);
+  bool is_legacy_record(const std::string&);
+}
+
+#endif /* TGREY_RECORD_HH */
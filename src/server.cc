@@ -0,0 +1,677 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "logging.hh"
+#include "misc.hh"
+#include "server.hh"
+#include "stats.hh"
+#include "thread.hh"
+#include "workers.hh"
+
+/** Upper bound for the size of a single request; a client sending more
+ ** than this without ever finishing a request is disconnected.
+ ** ** **/
+const size_t max_request_size = 65536;
+
+/** Number of events handled per call to epoll_wait.
+ ** ** **/
+const int max_events = 64;
+
+/** Address used as epoll user data to tell the completion notification
+ ** apart from the listening socket (null) and the connections.
+ ** ** **/
+static char completion_marker;
+
+/** Whether SIGTERM or SIGINT has arrived, and the descriptor written to
+ ** then to wake up the event loop. There is only ever one server.
+ ** ** **/
+static volatile sig_atomic_t stop_requested = 0;
+static volatile int stop_fd = -1;
+
+extern "C" void request_stop(int) {
+  int saved = errno;
+  uint64_t one = 1;
+  stop_requested = 1;
+
+  if(stop_fd >= 0 && ::write(stop_fd, &one, sizeof(one)) < 0) {
+    /* the loop is woken up by the interrupted wait anyway */
+  }
+
+  errno = saved;
+}
+
+/** State kept for every accepted client connection: the bytes received
+ ** but not yet parsed and the serialized responses not yet written. At
+ ** most one request of a connection is handled at a time, which keeps
+ ** the responses in the order of the requests. Responses are held back
+ ** while the changes made for them are not committed yet.
+ ** ** **/
+struct connection {
+    int fd;
+    bool want_write;
+    bool eof;
+    bool busy;
+    bool closing;
+    bool held;
+    std::string in;
+    std::string out;
+
+    connection(int f)
+      : fd(f), want_write(false), eof(false), busy(false), closing(false),
+        held(false) {
+      /* empty */
+    }
+
+    ~connection() { ::close(fd); }
+};
+
+/** A single request handed to the worker pool. When done, the job puts
+ ** itself on the completion list of the server and wakes up the event
+ ** loop, which then writes the response.
+ ** ** **/
+class handle_job : public tgrey::job {
+  public:
+    connection* const conn;
+    const tgrey::policy_request req;
+    const tgrey::policy_response* res;
+    std::string error;
+
+    handle_job(tgrey::server_data& s, tgrey::request_handler& h,
+               connection* c, const tgrey::policy_request& r)
+      : conn(c), req(r), res(0), srv(s), handler(h) {
+      /* empty */
+    }
+
+    virtual void run();
+
+  protected:
+    tgrey::server_data& srv;
+    tgrey::request_handler& handler;
+};
+
+struct tgrey::server_data {
+    std::string unix_path;
+    int listen_fd;
+    int epoll_fd;
+    int event_fd;
+    std::auto_ptr<tgrey::worker_pool> pool;
+    tgrey::mutex lock;
+    std::vector<handle_job*> done;
+    std::vector<connection*> closed;
+    std::vector<connection*> held;
+
+    server_data() : listen_fd(-1), epoll_fd(-1), event_fd(-1) {
+      /* empty */
+    }
+};
+
+void handle_job::run() {
+  try {
+    res = &handler.handle(req);
+  }
+  catch(const std::exception& err) {
+    error = err.what();
+  }
+
+  {
+    tgrey::scoped_lock l(srv.lock);
+    srv.done.push_back(this);
+  }
+
+  uint64_t one = 1;
+  while(::write(srv.event_fd, &one, sizeof(one)) < 0 && errno == EINTR);
+}
+
+inline void answer(connection* conn, const tgrey::policy_response& res) {
+  conn->out += res.wire;
+}
+
+tgrey::server::server(const std::string& a, unsigned int t)
+  : address(a), threads(t), data(new server_data) {
+  /* empty */
+}
+
+tgrey::server::~server() {
+  stop_fd = -1;
+
+  // stop the workers first, they still reference the server data
+  data->pool.reset();
+
+  for(std::vector<handle_job*>::iterator it = data->done.begin();
+      it != data->done.end(); ++it)
+    delete *it;
+
+  for(std::vector<connection*>::iterator it = data->closed.begin();
+      it != data->closed.end(); ++it)
+    delete *it;
+
+  if(data->event_fd >= 0)
+    ::close(data->event_fd);
+
+  if(data->epoll_fd >= 0)
+    ::close(data->epoll_fd);
+
+  if(data->listen_fd >= 0) {
+    ::close(data->listen_fd);
+
+    if(!data->unix_path.empty())
+      ::unlink(data->unix_path.c_str());
+  }
+}
+
+/** Create the listening socket. The address is either a filesystem path
+ ** (optionally prefixed by "unix:") for a UNIX domain socket or a
+ ** host:port pair (optionally prefixed by "inet:") for a TCP socket. This
+ ** is the same notation Postfix uses in check_policy_service.
+ ** ** **/
+void tgrey::server::open() {
+  if(data->listen_fd >= 0)
+    return;
+
+  std::string addr = address;
+  bool is_unix = addr.find('/') != std::string::npos;
+
+  if(addr.compare(0, 5, "unix:") == 0) {
+    addr = addr.substr(5);
+    is_unix = true;
+  }
+  else if(addr.compare(0, 5, "inet:") == 0) {
+    addr = addr.substr(5);
+    is_unix = false;
+  }
+
+  if(is_unix) {
+    struct sockaddr_un sun;
+    struct stat st;
+
+    if(addr.length() >= sizeof(sun.sun_path))
+      throw std::runtime_error("socket path too long: " + addr);
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strncpy(sun.sun_path, addr.c_str(), sizeof(sun.sun_path) - 1);
+
+    // remove a stale socket left behind by a previous instance
+    if(::lstat(addr.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+      ::unlink(addr.c_str());
+
+    data->listen_fd = ::socket(AF_UNIX,
+                               SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if(data->listen_fd < 0)
+      throw tgrey::sys_error("error creating socket");
+
+    if(::bind(data->listen_fd, (struct sockaddr*) &sun, sizeof(sun)))
+      throw tgrey::sys_error("error binding to " + addr);
+
+    data->unix_path = addr;
+  }
+  else {
+    size_t pos = addr.rfind(':');
+
+    if(pos == std::string::npos)
+      throw std::runtime_error("listen address lacks a port: " + addr);
+
+    std::string host = addr.substr(0, pos);
+    std::string port = addr.substr(pos + 1);
+
+    // allow for [::1]:port notation of IPv6 addresses
+    if(host.length() >= 2 && host[0] == '[' && host[host.length() - 1] == ']')
+      host = host.substr(1, host.length() - 2);
+
+    struct addrinfo hints;
+    struct addrinfo* result = 0;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_flags = AI_PASSIVE;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int err = ::getaddrinfo(host.empty() || host == "*" ? 0 : host.c_str(),
+                            port.c_str(), &hints, &result);
+
+    if(err || !result)
+      throw std::runtime_error("cannot resolve listen address " + addr +
+                               ": " + std::string(::gai_strerror(err)));
+
+    data->listen_fd = ::socket(result->ai_family,
+                               SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if(data->listen_fd < 0) {
+      ::freeaddrinfo(result);
+      throw tgrey::sys_error("error creating socket");
+    }
+
+    int one = 1;
+    ::setsockopt(data->listen_fd, SOL_SOCKET, SO_REUSEADDR,
+                 &one, sizeof(one));
+
+    if(::bind(data->listen_fd, result->ai_addr, result->ai_addrlen)) {
+      ::freeaddrinfo(result);
+      throw tgrey::sys_error("error binding to " + addr);
+    }
+
+    ::freeaddrinfo(result);
+  }
+
+  if(::listen(data->listen_fd, SOMAXCONN))
+    throw tgrey::sys_error("error listening on " + addr);
+
+  data->epoll_fd = ::epoll_create1(EPOLL_CLOEXEC);
+
+  if(data->epoll_fd < 0)
+    throw tgrey::sys_error("error creating epoll instance");
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = 0;
+
+  if(::epoll_ctl(data->epoll_fd, EPOLL_CTL_ADD, data->listen_fd, &ev))
+    throw tgrey::sys_error("error registering listening socket");
+
+  // the workers report finished requests through an eventfd, which also
+  // wakes the loop up to stop
+  data->event_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  if(data->event_fd < 0)
+    throw tgrey::sys_error("error creating eventfd");
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = &completion_marker;
+
+  if(::epoll_ctl(data->epoll_fd, EPOLL_CTL_ADD, data->event_fd, &ev))
+    throw tgrey::sys_error("error registering eventfd");
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = &request_stop;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+
+  stop_fd = data->event_fd;
+
+  if(::sigaction(SIGTERM, &sa, 0) || ::sigaction(SIGINT, &sa, 0))
+    throw tgrey::sys_error("error setting up signal handling");
+
+  if(threads)
+    data->pool.reset(new worker_pool(threads));
+}
+
+/** Write as much of the pending output of a connection as the socket
+ ** accepts without blocking and adjust the set of events we wait for
+ ** accordingly. Returns false if the connection broke down.
+ ** ** **/
+inline bool flush(tgrey::server_data& srv, connection* conn) {
+  while(!conn->out.empty()) {
+    tgrey::stage_timer timer(tgrey::stage_write);
+    ssize_t num = ::send(conn->fd, conn->out.data(), conn->out.length(),
+                         MSG_NOSIGNAL);
+
+    if(num < 0) {
+      if(errno == EINTR)
+        continue;
+
+      if(errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+
+      return false;
+    }
+
+    conn->out.erase(0, num);
+  }
+
+  // connections the peer has shut down are no longer watched
+  bool want_write = !conn->out.empty();
+
+  if(!conn->eof && want_write != conn->want_write) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+    ev.data.ptr = conn;
+
+    if(::epoll_ctl(srv.epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev))
+      return false;
+
+    conn->want_write = want_write;
+  }
+
+  return true;
+}
+
+/** Read everything available from a connection into its buffer. Returns
+ ** false if the connection broke down.
+ ** ** **/
+inline bool receive(connection* conn) {
+  char buf[16384];
+
+  while(true) {
+    ssize_t num = ::read(conn->fd, buf, sizeof(buf));
+
+    if(num < 0) {
+      if(errno == EINTR)
+        continue;
+
+      if(errno == EAGAIN || errno == EWOULDBLOCK)
+        return true;
+
+      return false;
+    }
+
+    if(num == 0) {
+      conn->eof = true;
+      return true;
+    }
+
+    conn->in.append(buf, num);
+  }
+}
+
+/** Handle the complete requests found in the buffer of a connection:
+ ** either answer them right away or pass the first one to the worker
+ ** pool. Returns false if the connection should be closed.
+ ** ** **/
+inline bool dispatch(tgrey::server_data& srv,
+                     tgrey::request_handler& handler, connection* conn) {
+  while(!conn->busy) {
+    size_t end = tgrey::request_end(conn->in);
+
+    if(end == std::string::npos) {
+      if(conn->in.length() <= max_request_size)
+        return true;
+
+      tgrey::stats.add(tgrey::stat_parse_errors);
+      tgrey::log << slo::error << "policy request exceeds maximum size";
+      return false;
+    }
+
+    try {
+      const tgrey::policy_request req(conn->in.data(),
+                                      conn->in.data() + end);
+      conn->in.erase(0, end);
+
+      if(srv.pool.get()) {
+        conn->busy = true;
+        srv.pool->submit(new handle_job(srv, handler, conn, req));
+      }
+      else
+        answer(conn, handler.handle(req));
+    }
+    // same as in the stdin/stdout mode: give up on the client; Postfix
+    // will treat this as a temporary failure of the policy service
+    catch(const std::exception& err) {
+      tgrey::log << slo::error << err.what();
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/** Stop watching a connection and schedule it for being closed once the
+ ** current batch of events is through. If a worker still handles one of
+ ** its requests, the completion takes care of that instead.
+ ** ** **/
+inline void finish(tgrey::server_data& srv, connection* conn) {
+  if(conn->closing)
+    return;
+
+  conn->closing = true;
+  ::epoll_ctl(srv.epoll_fd, EPOLL_CTL_DEL, conn->fd, 0);
+
+  if(conn->held) {
+    conn->held = false;
+    srv.held.erase(std::find(srv.held.begin(), srv.held.end(), conn));
+  }
+
+  if(!conn->busy)
+    srv.closed.push_back(conn);
+}
+
+/** Continue work on a connection after new input arrived or one of its
+ ** requests has been handled.
+ ** ** **/
+inline void process(tgrey::server_data& srv,
+                    tgrey::request_handler& handler, connection* conn) {
+  bool keep = dispatch(srv, handler, conn);
+
+  // responses wait for the commit of the changes made for them
+  if(keep && !conn->out.empty() && handler.commit_due() >= 0) {
+    if(!conn->held) {
+      conn->held = true;
+      srv.held.push_back(conn);
+    }
+
+    return;
+  }
+
+  keep = keep && flush(srv, conn);
+
+  // answers to requests sent right before the peer shut down its side
+  // are still written out on a best effort basis
+  if(!keep || (conn->eof && !conn->busy)) {
+    finish(srv, conn);
+    return;
+  }
+
+  // a peer that has shut down would flood us with events while we wait
+  // for the worker to finish its last request
+  if(conn->eof)
+    ::epoll_ctl(srv.epoll_fd, EPOLL_CTL_DEL, conn->fd, 0);
+}
+
+/** Accept all pending connections on the listening socket and register
+ ** them with the epoll instance.
+ ** ** **/
+inline void accept_all(tgrey::server_data& srv) {
+  while(true) {
+    int fd = ::accept4(srv.listen_fd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if(fd < 0) {
+      if(errno == EINTR || errno == ECONNABORTED)
+        continue;
+
+      if(errno == EAGAIN || errno == EWOULDBLOCK)
+        return;
+
+      // running out of descriptors is not fatal; the pending connections
+      // stay in the backlog until some client disconnects
+      tgrey::log << slo::warn << tgrey::sys_error("error accepting").what();
+      return;
+    }
+
+    connection* conn = new connection(fd);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+
+    if(::epoll_ctl(srv.epoll_fd, EPOLL_CTL_ADD, fd, &ev))
+      delete conn;
+  }
+}
+
+/** Take the requests finished by the workers and write their responses.
+ ** ** **/
+inline void complete_all(tgrey::server_data& srv,
+                         tgrey::request_handler& handler) {
+  uint64_t count;
+  while(::read(srv.event_fd, &count, sizeof(count)) < 0 && errno == EINTR);
+
+  std::vector<handle_job*> done;
+
+  {
+    tgrey::scoped_lock l(srv.lock);
+    done.swap(srv.done);
+  }
+
+  for(std::vector<handle_job*>::iterator it = done.begin();
+      it != done.end(); ++it) {
+    std::auto_ptr<handle_job> job(*it);
+    connection* conn = job->conn;
+
+    conn->busy = false;
+
+    if(conn->closing)
+      srv.closed.push_back(conn);
+
+    else if(!job->res) {
+      tgrey::log << slo::error << job->error;
+      finish(srv, conn);
+    }
+
+    else {
+      answer(conn, *job->res);
+      process(srv, handler, conn);
+    }
+  }
+}
+
+/** Commit the changes made for the requests handled so far once that is
+ ** due and continue with the connections whose responses were held back
+ ** until then. Returns the time in milliseconds until the next commit
+ ** is due, or -1 if nothing is waiting for one.
+ ** ** **/
+inline int settle(tgrey::server_data& srv, tgrey::request_handler& handler) {
+  long due = handler.commit_due();
+
+  if(due > 0)
+    return due;
+
+  std::vector<connection*> held;
+  held.swap(srv.held);
+
+  for(std::vector<connection*>::iterator it = held.begin();
+      it != held.end(); ++it)
+    (*it)->held = false;
+
+  try {
+    if(due == 0)
+      handler.commit();
+  }
+  // the held responses might rely on the lost changes, so give up on
+  // those clients like on any other failed request
+  catch(const std::exception& err) {
+    tgrey::log << slo::error << err.what();
+
+    for(std::vector<connection*>::iterator it = held.begin();
+        it != held.end(); ++it)
+      finish(srv, *it);
+
+    return handler.commit_due();
+  }
+
+  for(std::vector<connection*>::iterator it = held.begin();
+      it != held.end(); ++it)
+    process(srv, handler, *it);
+
+  return handler.commit_due();
+}
+
+/** Serve policy requests from any number of clients connected to the
+ ** listening socket, passing each of them to the handler. Runs until
+ ** SIGTERM or SIGINT arrives, then commits and writes the responses
+ ** held back for that as far as the clients take them without waiting;
+ ** requests still with the workers are left unanswered. Unrecoverable
+ ** errors are thrown as exceptions.
+ ** ** **/
+void tgrey::server::run(request_handler& handler) {
+  open();
+
+  struct epoll_event events[max_events];
+  int timeout = -1;
+  long idle = 0;
+
+  while(!stop_requested) {
+    // with no commit due, wait only as long as the handler asked to be
+    // left idle for
+    int num = ::epoll_wait(data->epoll_fd, events, max_events,
+                           timeout >= 0 ? timeout : int(idle));
+
+    if(num < 0) {
+      if(errno == EINTR)
+        continue;
+
+      throw tgrey::sys_error("error waiting for events");
+    }
+
+    for(int i = 0; i < num; ++i) {
+      void* ptr = events[i].data.ptr;
+
+      if(!ptr) {
+        accept_all(*data);
+        continue;
+      }
+
+      if(ptr == &completion_marker) {
+        complete_all(*data, handler);
+        continue;
+      }
+
+      connection* conn = static_cast<connection*>(ptr);
+
+      // skip events of connections closed earlier in this batch
+      if(conn->closing)
+        continue;
+
+      if(   (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+         && !receive(conn)) {
+        finish(*data, conn);
+        continue;
+      }
+
+      process(*data, handler, conn);
+    }
+
+    if(!num && timeout < 0)
+      idle = handler.idle();
+
+    timeout = settle(*data, handler);
+
+    // what could be answered has been written by now
+    if(num) {
+      handler.answered();
+      timeout = handler.commit_due();
+    }
+
+    for(std::vector<connection*>::iterator it = data->closed.begin();
+        it != data->closed.end(); ++it)
+      delete *it;
+
+    data->closed.clear();
+  }
+
+  std::vector<connection*> held;
+  held.swap(data->held);
+  handler.commit();
+
+  for(std::vector<connection*>::iterator it = held.begin();
+      it != held.end(); ++it) {
+    (*it)->held = false;
+    flush(*data, *it);
+  }
+}
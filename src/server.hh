@@ -0,0 +1,38 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#ifndef TGREY_SERVER_HH
+#define TGREY_SERVER_HH
+
+#include <string>
+#include <memory>
+
+#include "policy.hh"
+
+namespace tgrey
+{
+  struct server_data;
+
+  class server {
+    public:
+      server(const std::string&, unsigned int threads = 0);
+      ~server();
+
+      void open();
+      void run(request_handler&);
+
+    protected:
+      const std::string address;
+      const unsigned int threads;
+      std::auto_ptr<struct server_data> data;
+  };
+}
+
+#endif /* TGREY_SERVER_HH */
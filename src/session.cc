@@ -0,0 +1,127 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+#include "misc.hh"
+#include "session.hh"
+#include "stats.hh"
+
+/** Size of the chunks read from the input descriptor.
+ ** ** **/
+const size_t read_size = 65536;
+
+tgrey::session::session(int i, int o) : in_fd(i), out_fd(o) {
+  /* empty */
+}
+
+/** Append the next chunk of input to the buffer, waiting for it if
+ ** necessary. Returns false at the end of input.
+ ** ** **/
+bool tgrey::session::fill() {
+  size_t len = in.length();
+  in.resize(len + read_size);
+
+  while(true) {
+    ssize_t num = ::read(in_fd, &in[len], read_size);
+
+    if(num < 0 && errno == EINTR)
+      continue;
+
+    in.resize(len + (num > 0 ? num : 0));
+
+    if(num < 0)
+      throw tgrey::sys_error("error reading request");
+
+    return num > 0;
+  }
+}
+
+/** Write all queued responses with as few system calls as possible. The
+ ** queue only references the serialization held by the response objects.
+ ** ** **/
+void tgrey::session::flush() {
+  std::vector<struct iovec>::iterator it = out.begin();
+
+  while(it != out.end()) {
+    int cnt = std::min<size_t>(out.end() - it, IOV_MAX);
+    stage_timer timer(stage_write);
+    ssize_t num = ::writev(out_fd, &*it, cnt);
+
+    if(num < 0) {
+      if(errno == EINTR)
+        continue;
+
+      throw tgrey::sys_error("error writing response");
+    }
+
+    // skip what has been written completely and adjust a partially
+    // written entry
+    for(; it != out.end() && static_cast<size_t>(num) >= it->iov_len; ++it)
+      num -= it->iov_len;
+
+    if(num) {
+      it->iov_base = static_cast<char*>(it->iov_base) + num;
+      it->iov_len -= num;
+    }
+  }
+
+  out.clear();
+}
+
+/** Answer requests arriving on the input descriptor until it is closed.
+ ** All requests already received are handled before any response is
+ ** written, so a client sending several requests back to back gets all
+ ** responses with a single write and all their changes are committed
+ ** together before that. Errors are thrown after writing the
+ ** responses to the requests preceding the failed one.
+ ** ** **/
+void tgrey::session::run(request_handler& handler) {
+  while(true) {
+    size_t pos = 0;
+
+    try {
+      for(size_t end; (end = request_end(in, pos)) != std::string::npos; ) {
+        const policy_request req(in.data() + pos, in.data() + end);
+        pos = end;
+
+        const policy_response& res = handler.handle(req);
+
+        struct iovec iov;
+        iov.iov_base = const_cast<char*>(res.wire.data());
+        iov.iov_len = res.wire.length();
+        out.push_back(iov);
+      }
+    }
+    catch(...) {
+      handler.commit();
+      flush();
+      throw;
+    }
+
+    in.erase(0, pos);
+
+    // the input is drained, so this is the time to make the changes
+    // durable and write
+    handler.commit();
+    flush();
+    handler.answered();
+
+    if(!fill())
+      throw std::runtime_error("input stream closed");
+  }
+}
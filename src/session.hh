@@ -0,0 +1,39 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#ifndef TGREY_SESSION_HH
+#define TGREY_SESSION_HH
+
+#include <sys/uio.h>
+#include <string>
+#include <vector>
+
+#include "policy.hh"
+
+namespace tgrey
+{
+  class session {
+    public:
+      session(int, int);
+
+      void run(request_handler&);
+
+    protected:
+      const int in_fd;
+      const int out_fd;
+      std::string in;
+      std::vector<struct iovec> out;
+
+      bool fill();
+      void flush();
+  };
+}
+
+#endif /* TGREY_SESSION_HH */
@@ -0,0 +1,331 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#include <stdlib.h>
+
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "backend.hh"
+#include "misc.hh"
+
+/** Spreads the records over a number of databases of the same engine,
+ ** picking the shard of a key by its stable hash. Each shard has its
+ ** own locks, so writers contend only with those of the same shard and
+ ** a shard may be traversed while the others keep being used.
+ ** ** **/
+class shard_engine : public tgrey::backend {
+  public:
+    shard_engine(const std::vector<tgrey::backend*>& s) : shards(s) {
+      /* empty */
+    }
+
+    virtual ~shard_engine();
+
+    virtual void open();
+    virtual bool fetch(const std::string&, std::string&);
+    virtual bool fetch_record(const std::string&, tgrey::record&);
+    virtual void store(const std::string&, const std::string&);
+    virtual bool insert(const std::string&, const std::string&);
+    virtual void append(const std::string&, const std::string&);
+    virtual bool can_append() { return shards[0]->can_append(); }
+    virtual void remove(const std::string&);
+    virtual size_t apply(const tgrey::write_batch&);
+    virtual void traverse(tgrey::database&, tgrey::db_visitor&);
+    virtual bool scan(tgrey::database&, tgrey::db_visitor&, std::string&,
+                      size_t);
+
+    virtual size_t num_shards();
+    virtual void traverse_shard(tgrey::database&, tgrey::db_visitor&,
+                                size_t);
+    virtual void traverse_part(tgrey::database&, tgrey::db_visitor&,
+                               size_t, size_t);
+    virtual size_t traverse_view(tgrey::database&,
+                                 tgrey::db_view_visitor&, size_t, size_t);
+
+    virtual void group_commit(tgrey::durability, size_t, unsigned int);
+    virtual long commit_due();
+    virtual void commit();
+
+  protected:
+    const std::vector<tgrey::backend*> shards;
+
+    /** The shard is picked by the upper half of the hash only. The mmap
+     ** engine picks the home slot within a shard by the whole hash modulo
+     ** the number of slots, so if that shares a factor with the number of
+     ** shards, the keys of a shard would only ever start out from some of
+     ** the slots and probe that much longer.
+     ** ** **/
+    size_t shard_of(const std::string& key) {
+      return (tgrey::stable_hash(key) >> 32) % shards.size();
+    }
+
+    tgrey::backend& shard(const std::string& key) {
+      return *shards[shard_of(key)];
+    }
+
+  private:
+    shard_engine(const shard_engine&);
+    shard_engine& operator= (const shard_engine&);
+};
+
+shard_engine::~shard_engine() {
+  for(size_t i = 0; i < shards.size(); ++i)
+    delete shards[i];
+}
+
+void shard_engine::open() {
+  for(size_t i = 0; i < shards.size(); ++i)
+    shards[i]->open();
+}
+
+bool shard_engine::fetch(const std::string& key, std::string& val) {
+  return shard(key).fetch(key, val);
+}
+
+bool shard_engine::fetch_record(const std::string& key, tgrey::record& rec) {
+  return shard(key).fetch_record(key, rec);
+}
+
+void shard_engine::store(const std::string& key, const std::string& val) {
+  shard(key).store(key, val);
+}
+
+bool shard_engine::insert(const std::string& key, const std::string& val) {
+  return shard(key).insert(key, val);
+}
+
+void shard_engine::append(const std::string& key, const std::string& val) {
+  shard(key).append(key, val);
+}
+
+void shard_engine::remove(const std::string& key) {
+  shard(key).remove(key);
+}
+
+/** Split a batch by shard. Each part is applied as the engine of the
+ ** shard does, but the parts are not applied atomically as a whole.
+ ** ** **/
+size_t shard_engine::apply(const tgrey::write_batch& batch) {
+  std::vector<tgrey::write_batch> parts(shards.size());
+
+  for(std::vector<tgrey::write_batch::op>::const_iterator it =
+        batch.ops().begin(); it != batch.ops().end(); ++it) {
+    tgrey::write_batch& part = parts[shard_of(it->key)];
+
+    if(it->conditional)
+      part.remove_unchanged(it->key, it->val);
+    else if(it->remove)
+      part.remove(it->key);
+    else if(it->append)
+      part.append(it->key, it->val);
+    else
+      part.store(it->key, it->val);
+  }
+
+  size_t removed = 0;
+
+  for(size_t i = 0; i < shards.size(); ++i)
+    if(!parts[i].empty())
+      removed += shards[i]->apply(parts[i]);
+
+  return removed;
+}
+
+/** Passes records on to another visitor, counting them and noting if
+ ** it asked to stop.
+ ** ** **/
+class stop_visitor : public tgrey::db_visitor {
+  public:
+    stop_visitor(tgrey::db_visitor& v)
+      : inner(v), stopped(false), visited(0) {
+      /* empty */
+    }
+
+    virtual int visit(tgrey::database& db,
+                      const std::string& key, const std::string& val) {
+      int ret = inner.visit(db, key, val);
+      stopped = stopped || ret;
+      visited++;
+      return ret;
+    }
+
+    tgrey::db_visitor& inner;
+    bool stopped;
+    size_t visited;
+};
+
+/** The same for visitors of views.
+ ** ** **/
+class stop_view_visitor : public tgrey::db_view_visitor {
+  public:
+    stop_view_visitor(tgrey::db_view_visitor& v) : inner(v), stopped(false) {
+      /* empty */
+    }
+
+    virtual action visit(const tgrey::strview& key,
+                         const tgrey::strview& val) {
+      action act = inner.visit(key, val);
+      stopped = stopped || act == stop;
+      return act;
+    }
+
+    tgrey::db_view_visitor& inner;
+    bool stopped;
+};
+
+/** Visit the shards one after the other.
+ ** ** **/
+void shard_engine::traverse(tgrey::database& db, tgrey::db_visitor& vi) {
+  stop_visitor sv(vi);
+
+  for(size_t i = 0; i < shards.size() && !sv.stopped; ++i)
+    shards[i]->traverse(db, sv);
+}
+
+/** Scan the shards one after the other. The cursor is the index of the
+ ** current shard followed by a colon and the cursor within that shard.
+ ** ** **/
+bool shard_engine::scan(tgrey::database& db, tgrey::db_visitor& vi,
+                        std::string& cursor, size_t count) {
+  size_t colon = cursor.find(':');
+  size_t idx = 0;
+  std::string sub;
+
+  if(colon != std::string::npos) {
+    idx = ::strtoul(cursor.c_str(), 0, 10);
+    sub = cursor.substr(colon + 1);
+  }
+
+  stop_visitor sv(vi);
+
+  for(; idx < shards.size(); ++idx, sub.clear()) {
+    // a shard ending right with the batch leaves the next one untouched
+    if(sv.visited < count && !shards[idx]->scan(db, sv, sub,
+                                                 count - sv.visited))
+      continue;
+
+    std::ostringstream pos;
+    pos << idx << ':' << sub;
+    cursor = pos.str();
+    return true;
+  }
+
+  cursor.clear();
+  return false;
+}
+
+size_t shard_engine::num_shards() {
+  return shards.size();
+}
+
+void shard_engine::traverse_shard(tgrey::database& db,
+                                  tgrey::db_visitor& vi, size_t idx) {
+  if(idx >= shards.size())
+    throw std::runtime_error("no such database shard");
+
+  shards[idx]->traverse(db, vi);
+}
+
+/** Hand out whole shards round robin; with more parts than shards, the
+ ** parts falling to a shard split it further.
+ ** ** **/
+void shard_engine::traverse_part(tgrey::database& db, tgrey::db_visitor& vi,
+                                 size_t part, size_t parts) {
+  const size_t n = shards.size();
+
+  if(parts > n) {
+    size_t idx = part % n;
+    shards[idx]->traverse_part(db, vi, part / n, (parts - idx + n - 1) / n);
+    return;
+  }
+
+  stop_visitor sv(vi);
+
+  for(size_t i = part; i < n && !sv.stopped; i += parts)
+    shards[i]->traverse(db, sv);
+}
+
+/** Split into parts like traverse_part().
+ ** ** **/
+size_t shard_engine::traverse_view(tgrey::database& db,
+                                   tgrey::db_view_visitor& vi,
+                                   size_t part, size_t parts) {
+  const size_t n = shards.size();
+
+  if(parts > n) {
+    size_t idx = part % n;
+    return shards[idx]->traverse_view(db, vi, part / n,
+                                      (parts - idx + n - 1) / n);
+  }
+
+  stop_view_visitor sv(vi);
+  size_t removed = 0;
+
+  for(size_t i = part; i < n && !sv.stopped; i += parts)
+    removed += shards[i]->traverse_view(db, sv, 0, 1);
+
+  return removed;
+}
+
+void shard_engine::group_commit(tgrey::durability mode, size_t max_writes,
+                                unsigned int max_delay) {
+  for(size_t i = 0; i < shards.size(); ++i)
+    shards[i]->group_commit(mode, max_writes, max_delay);
+}
+
+long shard_engine::commit_due() {
+  long due = -1;
+
+  for(size_t i = 0; i < shards.size(); ++i) {
+    long d = shards[i]->commit_due();
+
+    if(d >= 0 && (due < 0 || d < due))
+      due = d;
+  }
+
+  return due;
+}
+
+/** Commit all shards, even if committing one of them fails; the first
+ ** error is rethrown afterwards.
+ ** ** **/
+void shard_engine::commit() {
+  std::string error;
+
+  for(size_t i = 0; i < shards.size(); ++i) {
+    try {
+      shards[i]->commit();
+    }
+    catch(const std::exception& err) {
+      if(error.empty())
+        error = err.what();
+    }
+  }
+
+  if(!error.empty())
+    throw std::runtime_error(error);
+}
+
+/** Take ownership of the given shards, deleting them even if this fails.
+ ** ** **/
+tgrey::backend* tgrey::shard_backend(const std::vector<backend*>& shards) {
+  try {
+    return new shard_engine(shards);
+  }
+  catch(...) {
+    for(size_t i = 0; i < shards.size(); ++i)
+      delete shards[i];
+
+    throw;
+  }
+}
@@ -0,0 +1,192 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include "misc.hh"
+#include "stats.hh"
+
+const char stats_magic[8] = { 't', 'g', 'r', 'e', 'y', 's', 't', 'a' };
+const uint32_t stats_version = 2;
+
+const char* const tgrey::stat_names[stat_counters] = {
+  "new", "ok", "wait", "db_errors", "parse_errors", "removed"
+};
+
+const char* const tgrey::stage_names[stat_stages] = {
+  "parse", "key", "fetch", "decide", "store", "write"
+};
+
+tgrey::statistics tgrey::stats;
+
+tgrey::statistics::statistics() : block(new stats_block()), mapped(false) {
+  /* empty */
+}
+
+tgrey::statistics::~statistics() {
+  if(mapped)
+    ::munmap(block, sizeof(stats_block));
+  else
+    delete block;
+}
+
+/** Map the shared memory segment of the given name, creating it unless
+ ** only reading. Processes creating it at the same time wait for each
+ ** other on a file lock. Counts made before are not carried over.
+ ** ** **/
+void tgrey::statistics::open(const std::string& name, bool writable) {
+  int fd = ::shm_open(name.c_str(), writable ? O_RDWR | O_CREAT : O_RDONLY,
+                      S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+  if(fd < 0)
+    throw tgrey::sys_error("error opening statistics " + name);
+
+  while(::flock(fd, LOCK_EX) && errno == EINTR);
+
+  struct stat st;
+  bool create = false;
+
+  if(::fstat(fd, &st)) {
+    ::close(fd);
+    throw tgrey::sys_error("error opening statistics " + name);
+  }
+
+  if(writable && st.st_size == 0) {
+    if(::ftruncate(fd, sizeof(stats_block))) {
+      ::close(fd);
+      throw tgrey::sys_error("error creating statistics " + name);
+    }
+
+    create = true;
+  }
+  else if(st.st_size != sizeof(stats_block)) {
+    ::close(fd);
+    throw std::runtime_error("not a valid statistics segment: " + name);
+  }
+
+  void* ptr = ::mmap(0, sizeof(stats_block),
+                     writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                     MAP_SHARED, fd, 0);
+
+  if(ptr == MAP_FAILED) {
+    ::close(fd);
+    throw tgrey::sys_error("error mapping statistics " + name);
+  }
+
+  stats_block* b = static_cast<stats_block*>(ptr);
+
+  if(create) {
+    b->version = stats_version;
+    b->counters = stat_counters;
+    b->stages = stat_stages;
+    b->buckets = latency_buckets;
+    memcpy(b->magic, stats_magic, sizeof(stats_magic));
+  }
+
+  // the mapping keeps the file open, so the lock has to be released
+  ::flock(fd, LOCK_UN);
+  ::close(fd);
+
+  if(   memcmp(b->magic, stats_magic, sizeof(stats_magic))
+     || b->version != stats_version || b->counters != stat_counters
+     || b->stages != stat_stages || b->buckets != latency_buckets) {
+    ::munmap(ptr, sizeof(stats_block));
+    throw std::runtime_error("not a valid statistics segment: " + name);
+  }
+
+  if(mapped)
+    ::munmap(block, sizeof(stats_block));
+  else
+    delete block;
+
+  block = b;
+  mapped = true;
+}
+
+uint64_t tgrey::statistics::samples(stat_stage s) const {
+  uint64_t num = 0;
+
+  for(size_t i = 0; i < latency_buckets; ++i)
+    num += __atomic_load_n(&block->latency[s][i], __ATOMIC_RELAXED);
+
+  return num;
+}
+
+/** Highest latency of the bucket holding the given fraction of the
+ ** samples of a stage, or 0 if there are none. Samples recorded while
+ ** going over the buckets may or may not be taken into account.
+ ** ** **/
+uint64_t tgrey::statistics::percentile(stat_stage s, double q) const {
+  uint64_t counts[latency_buckets];
+  uint64_t num = 0;
+
+  for(size_t i = 0; i < latency_buckets; ++i)
+    num += counts[i] = __atomic_load_n(&block->latency[s][i],
+                                       __ATOMIC_RELAXED);
+
+  if(!num)
+    return 0;
+
+  uint64_t rank = uint64_t(q * num);
+  uint64_t seen = 0;
+  size_t idx = 0;
+
+  for(; idx < latency_buckets - 1; ++idx)
+    if((seen += counts[idx]) > rank)
+      break;
+
+  // the bucket ends right before the next one starts
+  ++idx;
+
+  if(idx < 2 * latency_sub)
+    return idx - 1;
+
+  unsigned int exp = idx / latency_sub + latency_sub_bits - 1;
+  return ((latency_sub + idx % latency_sub) << (exp - latency_sub_bits)) - 1;
+}
+
+inline std::string format_ns(uint64_t ns) {
+  std::ostringstream out;
+
+  if(ns < 1000)
+    out << ns << " ns";
+  else if(ns < 1000000)
+    out << std::setprecision(3) << ns / 1e3 << " us";
+  else if(ns < 1000000000)
+    out << std::setprecision(3) << ns / 1e6 << " ms";
+  else
+    out << std::setprecision(3) << ns / 1e9 << " s";
+
+  return out.str();
+}
+
+/** A line describing the latency of a stage: the number of samples and
+ ** the median, 99th and 99.9th percentile.
+ ** ** **/
+std::string tgrey::latency_summary(const statistics& stats, stat_stage s) {
+  std::ostringstream out;
+  out << stage_names[s] << ": " << stats.samples(s) << " samples, p50 "
+      << format_ns(stats.percentile(s, 0.5)) << ", p99 "
+      << format_ns(stats.percentile(s, 0.99)) << ", p99.9 "
+      << format_ns(stats.percentile(s, 0.999));
+
+  return out.str();
+}
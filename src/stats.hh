@@ -0,0 +1,171 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#ifndef TGREY_STATS_HH
+#define TGREY_STATS_HH
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <string>
+
+namespace tgrey
+{
+  enum stat_counter {
+    stat_new,
+    stat_ok,
+    stat_wait,
+    stat_db_errors,
+    stat_parse_errors,
+    stat_removed,
+    stat_counters
+  };
+
+  extern const char* const stat_names[stat_counters];
+
+  /** The stages of answering a request whose latency is recorded. The
+   ** decision covers all of the handling, including the lookup, the
+   ** store and waiting for locks.
+   ** ** **/
+  enum stat_stage {
+    stage_parse,
+    stage_key,
+    stage_fetch,
+    stage_decide,
+    stage_store,
+    stage_write,
+    stat_stages
+  };
+
+  extern const char* const stage_names[stat_stages];
+
+  /** Latencies are counted in log-linear buckets of nanoseconds: values
+   ** below 2 * latency_sub have a bucket each, above that every power of
+   ** two is split into latency_sub buckets, which bounds the error to
+   ** 1 / latency_sub. The last bucket takes anything from about two
+   ** minutes up.
+   ** ** **/
+  const unsigned int latency_sub_bits = 3;
+  const uint64_t latency_sub = 1 << latency_sub_bits;
+  const size_t latency_buckets = 280;
+
+  inline size_t latency_bucket(uint64_t ns) {
+    if(ns < 2 * latency_sub)
+      return ns;
+
+    unsigned int exp = 63 - __builtin_clzll(ns);
+    size_t idx = (exp - latency_sub_bits + 1) * latency_sub +
+                 ((ns >> (exp - latency_sub_bits)) & (latency_sub - 1));
+
+    return idx < latency_buckets ? idx : latency_buckets - 1;
+  }
+
+  /** Nanoseconds for timing stages. CLOCK_MONOTONIC is read through the
+   ** vDSO without a system call; the coarse clock would put most stages,
+   ** which take microseconds, into bucket 0 at its 1 to 4 ms resolution.
+   ** ** **/
+  inline uint64_t stats_clock() {
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  }
+
+  /** Layout of the shared memory segment: a header followed by the
+   ** counters, each padded to a cache line of its own so that threads
+   ** counting different things do not contend, and the latency
+   ** histograms.
+   ** ** **/
+  const size_t stats_line = 64;
+
+  struct stats_block {
+      char magic[8];
+      uint32_t version;
+      uint32_t counters;
+      uint32_t stages;
+      uint32_t buckets;
+      char pad[stats_line - 24];
+
+      struct {
+          uint64_t value;
+          char pad[stats_line - 8];
+      } counter[stat_counters];
+
+      uint64_t latency[stat_stages][latency_buckets];
+  };
+
+  /** Counters of what the programs are doing, meant to be read by
+   ** tgreystat while they run. They live in a block of process private
+   ** memory until a shared memory segment is opened, which any number
+   ** of processes may share. Counting is a relaxed atomic add, so the
+   ** counters are exact but not ordered with regard to anything else.
+   ** ** **/
+  class statistics {
+    public:
+      statistics();
+      ~statistics();
+
+      void open(const std::string& name, bool writable = true);
+
+      void add(stat_counter c, uint64_t n = 1) {
+        __atomic_fetch_add(&block->counter[c].value, n, __ATOMIC_RELAXED);
+      }
+
+      uint64_t get(stat_counter c) const {
+        return __atomic_load_n(&block->counter[c].value, __ATOMIC_RELAXED);
+      }
+
+      void record(stat_stage s, uint64_t ns) {
+        __atomic_fetch_add(&block->latency[s][latency_bucket(ns)], 1,
+                           __ATOMIC_RELAXED);
+      }
+
+      uint64_t samples(stat_stage) const;
+      uint64_t percentile(stat_stage, double) const;
+
+    protected:
+      stats_block* block;
+      bool mapped;
+
+    private:
+      statistics(const statistics&);
+      statistics& operator= (const statistics&);
+  };
+
+  extern statistics stats;
+
+  std::string latency_summary(const statistics&, stat_stage);
+
+  /** Records the time from its creation to its destruction, or to an
+   ** earlier call of stop(), as the latency of a stage.
+   ** ** **/
+  class stage_timer {
+    public:
+      stage_timer(stat_stage s) : stage(s), start(stats_clock()) {
+        /* empty */
+      }
+
+      ~stage_timer() {
+        stop();
+      }
+
+      void stop() {
+        if(start)
+          stats.record(stage, stats_clock() - start);
+
+        start = 0;
+      }
+
+    protected:
+      const stat_stage stage;
+      uint64_t start;
+  };
+}
+
+#endif /* TGREY_STATS_HH */
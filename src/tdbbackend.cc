@@ -0,0 +1,573 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <tdb.h>
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "backend.hh"
+#include "database.hh"
+#include "misc.hh"
+#include "record.hh"
+#include "thread.hh"
+
+/** A TDB context must not be used by several threads at the same time,
+ ** so all access to it is serialized. The mutex is recursive to allow
+ ** visitors to modify the database from within a traversal.
+ ** ** **/
+struct tdb_data {
+    TDB_CONTEXT* ctx;
+    tgrey::mutex lock;
+    tgrey::durability mode;
+    size_t max_writes;
+    unsigned int max_delay;
+    bool in_transaction;
+    size_t writes;
+    int64_t started;
+    unsigned int holds;
+
+    tdb_data()
+      : ctx(0), lock(true), mode(tgrey::durability_none), max_writes(0),
+        max_delay(0), in_transaction(false), writes(0), started(0),
+        holds(0) {
+      /* empty */
+    }
+};
+
+/** Make sure a write becomes part of the open transaction when writes
+ ** are grouped, starting one if necessary.
+ ** ** **/
+inline void begin_write(tdb_data& d) {
+  if(d.mode == tgrey::durability_none || d.in_transaction)
+    return;
+
+  if(::tdb_transaction_start(d.ctx))
+    throw std::runtime_error(std::string("error starting TDB transaction: ") +
+                             std::string(::tdb_errorstr(d.ctx)));
+
+  d.in_transaction = true;
+  d.writes = 0;
+  d.started = tgrey::monotonic_ms();
+}
+
+inline void commit_transaction(tdb_data& d) {
+  if(!d.in_transaction)
+    return;
+
+  // a failed commit cancels the transaction
+  d.in_transaction = false;
+
+  if(::tdb_transaction_commit(d.ctx))
+    throw std::runtime_error(
+              std::string("error committing TDB transaction: ") +
+              std::string(::tdb_errorstr(d.ctx)));
+}
+
+/** Count a write and commit once the transaction is full. Commits are
+ ** held back while a traversal or a batch is running.
+ ** ** **/
+inline void end_write(tdb_data& d) {
+  if(!d.in_transaction)
+    return;
+
+  if(++d.writes >= d.max_writes && !d.holds)
+    commit_transaction(d);
+}
+
+/** TDB refuses to start a transaction from within a traversal, so when
+ ** writes are grouped one is started beforehand for the writes of the
+ ** visitor to join, and held open until the traversal is done. Returns
+ ** whether a transaction has been started for the purpose.
+ ** ** **/
+inline bool begin_traversal(tdb_data& d) {
+  bool fresh = !d.in_transaction;
+  begin_write(d);
+  d.holds++;
+
+  return fresh && d.in_transaction;
+}
+
+/** Commit what has been held back while traversing, or drop the
+ ** transaction started for the traversal if nothing has been written.
+ ** ** **/
+inline void end_traversal(tdb_data& d, bool started) {
+  d.holds--;
+
+  if(started && !d.writes) {
+    ::tdb_transaction_cancel(d.ctx);
+    d.in_transaction = false;
+  }
+  else if(d.in_transaction && d.writes >= d.max_writes && !d.holds)
+    commit_transaction(d);
+}
+
+TDB_DATA from_string(const std::string& data) {
+  TDB_DATA ret = { 0, 0 };
+
+  if(data.length()) {
+    ret.dptr = (unsigned char*) data.c_str();
+    ret.dsize = data.length();
+  }
+
+  return ret;
+}
+
+/** The TDB backend. A single context is shared by all threads.
+ ** ** **/
+class tdb_engine : public tgrey::backend {
+  public:
+    tdb_engine(const std::string& f) : filename(f), data(new tdb_data) {
+      /* empty */
+    }
+
+    virtual ~tdb_engine();
+
+    virtual void open();
+    virtual bool fetch(const std::string&, std::string&);
+    virtual bool fetch_record(const std::string&, tgrey::record&);
+    virtual void store(const std::string&, const std::string&);
+    virtual bool insert(const std::string&, const std::string&);
+    virtual void append(const std::string&, const std::string&);
+    virtual bool can_append() { return true; }
+    virtual void remove(const std::string&);
+    virtual size_t apply(const tgrey::write_batch&);
+    virtual void traverse(tgrey::database&, tgrey::db_visitor&);
+    virtual size_t traverse_view(tgrey::database&,
+                                 tgrey::db_view_visitor&, size_t, size_t);
+    virtual bool scan(tgrey::database&, tgrey::db_visitor&, std::string&,
+                      size_t);
+
+    virtual void group_commit(tgrey::durability, size_t, unsigned int);
+    virtual long commit_due();
+    virtual void commit();
+
+  protected:
+    const std::string filename;
+    std::auto_ptr<tdb_data> data;
+};
+
+tdb_engine::~tdb_engine() {
+  if(!data->ctx)
+    return;
+
+  // closing would cancel an open transaction
+  if(data->in_transaction)
+    ::tdb_transaction_commit(data->ctx);
+
+  ::tdb_close(data->ctx);
+}
+
+void tdb_engine::open() {
+  tgrey::scoped_lock l(data->lock);
+
+  if(data->ctx)
+    return;
+
+  data->ctx = ::tdb_open(
+     filename.c_str(), 0,
+     data->mode == tgrey::durability_nosync ? TDB_NOSYNC : TDB_DEFAULT,
+     O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+
+  if(!data->ctx)
+    throw tgrey::sys_error("error opening TDB");
+}
+
+bool tdb_engine::fetch(const std::string& key, std::string& val) {
+  tgrey::scoped_lock l(data->lock);
+
+  if(!data->ctx)
+    throw std::runtime_error("trying to fetch from unopened TDB database");
+
+  TDB_DATA value = ::tdb_fetch(data->ctx, from_string(key));
+
+  if(!value.dptr)
+    return false;
+
+  val = std::string(value.dptr, value.dptr + value.dsize);
+  ::free(value.dptr);
+  return true;
+}
+
+struct parse_state {
+    tgrey::record& rec;
+    bool invalid;
+};
+
+/** Decode a record from the buffer TDB passes in; exceptions must not
+ ** pass through TDB, so errors are only noted.
+ ** ** **/
+inline int record_parser(TDB_DATA key, TDB_DATA val, void* state) {
+  parse_state* ps = static_cast<parse_state*>(state);
+
+  try {
+    tgrey::decode_record((const char*) val.dptr, val.dsize, ps->rec);
+  }
+  catch(const std::exception&) {
+    ps->invalid = true;
+  }
+
+  return 0;
+}
+
+/** Decode the record in place instead of having TDB copy it into memory
+ ** allocated for the purpose.
+ ** ** **/
+bool tdb_engine::fetch_record(const std::string& key, tgrey::record& rec) {
+  tgrey::scoped_lock l(data->lock);
+
+  if(!data->ctx)
+    throw std::runtime_error("trying to fetch from unopened TDB database");
+
+  parse_state ps = { rec, false };
+
+  if(::tdb_parse_record(data->ctx, from_string(key), record_parser, &ps)) {
+    if(::tdb_error(data->ctx) == TDB_ERR_NOEXIST)
+      return false;
+
+    throw std::runtime_error(std::string("error fetching from TDB: ") +
+                             std::string(::tdb_errorstr(data->ctx)));
+  }
+
+  if(ps.invalid)
+    throw std::runtime_error("invalid database record");
+
+  return true;
+}
+
+void tdb_engine::store(const std::string& key, const std::string& val) {
+  tgrey::scoped_lock l(data->lock);
+
+  if(!data->ctx)
+    throw std::runtime_error("trying to store to unopened TDB database");
+
+  begin_write(*data);
+
+  if(::tdb_store(data->ctx,
+                 from_string(key), from_string(val), TDB_REPLACE))
+    throw std::runtime_error(std::string("error storing to TDB: ") +
+                             std::string(::tdb_errorstr(data->ctx)));
+
+  end_write(*data);
+}
+
+bool tdb_engine::insert(const std::string& key, const std::string& val) {
+  tgrey::scoped_lock l(data->lock);
+
+  if(!data->ctx)
+    throw std::runtime_error("trying to store to unopened TDB database");
+
+  begin_write(*data);
+
+  if(!::tdb_store(data->ctx, from_string(key), from_string(val), TDB_INSERT)) {
+    end_write(*data);
+    return true;
+  }
+
+  if(::tdb_error(data->ctx) == TDB_ERR_EXISTS)
+    return false;
+
+  throw std::runtime_error(std::string("error storing to TDB: ") +
+                           std::string(::tdb_errorstr(data->ctx)));
+}
+
+void tdb_engine::append(const std::string& key, const std::string& val) {
+  tgrey::scoped_lock l(data->lock);
+
+  if(!data->ctx)
+    throw std::runtime_error("trying to store to unopened TDB database");
+
+  begin_write(*data);
+
+  if(::tdb_append(data->ctx, from_string(key), from_string(val)))
+    throw std::runtime_error(std::string("error storing to TDB: ") +
+                             std::string(::tdb_errorstr(data->ctx)));
+
+  end_write(*data);
+}
+
+void tdb_engine::remove(const std::string& key) {
+  tgrey::scoped_lock l(data->lock);
+
+  if(!data->ctx)
+    throw std::runtime_error("trying to delete from unopened TDB database");
+
+  begin_write(*data);
+
+  if(::tdb_delete(data->ctx, from_string(key)))
+    throw std::runtime_error(std::string("error deleting from TDB: ") +
+                             std::string(::tdb_errorstr(data->ctx)));
+
+  end_write(*data);
+}
+
+/** Apply a batch in a transaction of its own or, if writes are grouped,
+ ** as part of the current one without committing in between.
+ ** ** **/
+size_t tdb_engine::apply(const tgrey::write_batch& batch) {
+  tgrey::scoped_lock l(data->lock);
+
+  if(!data->ctx)
+    throw std::runtime_error("trying to store to unopened TDB database");
+
+  if(data->mode == tgrey::durability_none) {
+    if(::tdb_transaction_start(data->ctx))
+      throw std::runtime_error(
+                std::string("error starting TDB transaction: ") +
+                std::string(::tdb_errorstr(data->ctx)));
+
+    size_t removed;
+
+    try {
+      removed = backend::apply(batch);
+    }
+    catch(...) {
+      ::tdb_transaction_cancel(data->ctx);
+      throw;
+    }
+
+    if(::tdb_transaction_commit(data->ctx))
+      throw std::runtime_error(
+                std::string("error committing TDB transaction: ") +
+                std::string(::tdb_errorstr(data->ctx)));
+
+    return removed;
+  }
+
+  size_t removed;
+  data->holds++;
+
+  try {
+    removed = backend::apply(batch);
+  }
+  catch(...) {
+    data->holds--;
+    throw;
+  }
+
+  data->holds--;
+
+  if(data->in_transaction && data->writes >= data->max_writes)
+    commit_transaction(*data);
+
+  return removed;
+}
+
+/** State of a traversal. Exceptions must not pass through TDB, so the
+ ** callbacks end the traversal on an error and leave its message here
+ ** to be thrown once TDB has returned.
+ ** ** **/
+struct traverse_callback {
+    tgrey::database& db;
+    tgrey::db_visitor& vi;
+    std::string error;
+};
+
+inline int
+traverse_helper(TDB_CONTEXT* tdb, TDB_DATA key, TDB_DATA val, void* state) {
+  traverse_callback* cb = static_cast<traverse_callback*>(state);
+
+  try {
+    return cb->vi.visit(cb->db,
+                        std::string(key.dptr, key.dptr + key.dsize),
+                        std::string(val.dptr, val.dptr + val.dsize));
+  }
+  catch(const std::exception& err) {
+    cb->error = err.what();
+  }
+  catch(...) {
+    cb->error = "unknown error visiting TDB record";
+  }
+
+  return 1;
+}
+
+void tdb_engine::traverse(tgrey::database& db,
+                          tgrey::db_visitor& visitor) {
+  tgrey::scoped_lock l(data->lock);
+
+  if(!data->ctx)
+    throw std::runtime_error("trying to traverse unopened TDB database");
+
+  struct traverse_callback cb = { db, visitor, "" };
+
+  bool started = begin_traversal(*data);
+  ::tdb_traverse(data->ctx, traverse_helper, &cb);
+  end_traversal(*data, started);
+
+  if(!cb.error.empty())
+    throw std::runtime_error(cb.error);
+}
+
+/** As traverse_callback, for traversals passing views. Removals join
+ ** the transaction started before traversing, if any.
+ ** ** **/
+struct view_callback {
+    tdb_data& data;
+    tgrey::db_view_visitor& vi;
+    std::string error;
+    size_t removed;
+};
+
+inline int
+view_helper(TDB_CONTEXT* tdb, TDB_DATA key, TDB_DATA val, void* state) {
+  view_callback* cb = static_cast<view_callback*>(state);
+  tgrey::db_view_visitor::action act;
+
+  try {
+    act = cb->vi.visit(tgrey::strview((const char*) key.dptr, key.dsize),
+                       tgrey::strview((const char*) val.dptr, val.dsize));
+  }
+  catch(const std::exception& err) {
+    cb->error = err.what();
+    return 1;
+  }
+  catch(...) {
+    cb->error = "unknown error visiting TDB record";
+    return 1;
+  }
+
+  switch(act) {
+    case tgrey::db_view_visitor::remove:
+      if(::tdb_delete(tdb, key)) {
+        cb->error = std::string("error deleting from TDB: ") +
+                    std::string(::tdb_errorstr(tdb));
+        return 1;
+      }
+
+      // commits are held back until the traversal is done
+      if(cb->data.in_transaction)
+        cb->data.writes++;
+
+      cb->removed++;
+      return 0;
+
+    case tgrey::db_view_visitor::stop:
+      return 1;
+
+    default:
+      return 0;
+  }
+}
+
+/** Traverse passing the buffers TDB hands to the callback on as they
+ ** are. A single file cannot be split, so part 0 holds all records.
+ ** ** **/
+size_t tdb_engine::traverse_view(tgrey::database& db,
+                                 tgrey::db_view_visitor& visitor,
+                                 size_t part, size_t parts) {
+  tgrey::scoped_lock l(data->lock);
+
+  if(!data->ctx)
+    throw std::runtime_error("trying to traverse unopened TDB database");
+
+  if(part)
+    return 0;
+
+  struct view_callback cb = { *data, visitor, "", 0 };
+
+  bool started = begin_traversal(*data);
+  ::tdb_traverse(data->ctx, view_helper, &cb);
+  end_traversal(*data, started);
+
+  if(!cb.error.empty())
+    throw std::runtime_error(cb.error);
+
+  return cb.removed;
+}
+
+/** Walk the records by key, each call picking up after the key kept in
+ ** the cursor. TDB cannot continue after a key that has been deleted in
+ ** the meantime and ends the walk there instead.
+ ** ** **/
+bool tdb_engine::scan(tgrey::database& db, tgrey::db_visitor& visitor,
+                      std::string& cursor, size_t count) {
+  tgrey::scoped_lock l(data->lock);
+
+  if(!data->ctx)
+    throw std::runtime_error("trying to traverse unopened TDB database");
+
+  TDB_DATA key = cursor.empty()
+    ? ::tdb_firstkey(data->ctx)
+    : ::tdb_nextkey(data->ctx, from_string(cursor));
+
+  for(size_t n = 0; key.dptr; ) {
+    cursor.assign(key.dptr, key.dptr + key.dsize);
+
+    TDB_DATA value = ::tdb_fetch(data->ctx, key);
+    int stop = 0;
+
+    // records deleted since their key was read are skipped
+    if(value.dptr) {
+      const std::string val(value.dptr, value.dptr + value.dsize);
+      ::free(value.dptr);
+
+      try {
+        stop = visitor.visit(db, cursor, val);
+      }
+      catch(...) {
+        ::free(key.dptr);
+        throw;
+      }
+    }
+
+    if(++n >= count || stop) {
+      ::free(key.dptr);
+      return true;
+    }
+
+    TDB_DATA next = ::tdb_nextkey(data->ctx, key);
+    ::free(key.dptr);
+    key = next;
+  }
+
+  cursor.clear();
+  return false;
+}
+
+void tdb_engine::group_commit(tgrey::durability mode, size_t max_writes,
+                              unsigned int max_delay) {
+  tgrey::scoped_lock l(data->lock);
+
+  if(data->ctx)
+    throw std::runtime_error("cannot change durability of open database");
+
+  data->mode = mode;
+  data->max_writes = max_writes ? max_writes : 1;
+  data->max_delay = max_delay;
+}
+
+long tdb_engine::commit_due() {
+  tgrey::scoped_lock l(data->lock);
+
+  if(!data->in_transaction)
+    return -1;
+
+  int64_t left = data->started + data->max_delay - tgrey::monotonic_ms();
+  return left > 0 ? left : 0;
+}
+
+void tdb_engine::commit() {
+  tgrey::scoped_lock l(data->lock);
+
+  if(data->ctx)
+    commit_transaction(*data);
+}
+
+tgrey::backend* tgrey::tdb_backend(const std::string& filename) {
+  return new tdb_engine(filename);
+}
@@ -8,15 +8,34 @@
   included file COPYING.
  * * */
 
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "ext/slo.hh"
 #include "ext/propa.hh"
 
 #include "misc.hh"
 #include "database.hh"
+#include "expiry.hh"
+#include "keys.hh"
 #include "logging.hh"
+#include "record.hh"
+#include "stats.hh"
 
 slo::logger tgrey::log;
 
@@ -39,23 +58,64 @@ void usage(std::ostream& os, const propa::spec& spec, const char* argv[]) {
      << std::endl;
 }
 
-class cleanup_visitor : public tgrey::db_visitor {
+/** Asks for the expired triplets to be removed; how many actually are
+ ** is up to the database, as they may have been refreshed in between.
+ ** ** **/
+class cleanup_visitor : public tgrey::db_view_visitor {
   public:
-    cleanup_visitor(unsigned int& l) : _lifetime(l), _num_removed(0) {
+    cleanup_visitor(unsigned int& l, unsigned int& t)
+      : _lifetime(l), _timeout(t) {
+      /* empty */
+    }
+
+    virtual action visit(const tgrey::strview& key,
+                         const tgrey::strview& val) {
+      tgrey::record rec;
+
+      if(tgrey::is_meta_key(key))
+        return keep;
+
+      tgrey::decode_record(val.data, val.size, rec);
+
+      if(tgrey::expires_at(rec, _lifetime, _timeout) >= ::time(0))
+        return keep;
+
+      return remove;
+    }
+
+   protected:
+    const unsigned int& _lifetime;
+    const unsigned int& _timeout;
+};
+
+/** Removes expired triplets like cleanup_visitor and lists the others in
+ ** the expiry index, which needs the database to be changed while going
+ ** over it.
+ ** ** **/
+class index_visitor : public tgrey::db_visitor {
+  public:
+    index_visitor(unsigned int& l, unsigned int& t)
+      : _lifetime(l), _timeout(t), _num_removed(0) {
       /* empty */
     }
 
     virtual int visit(tgrey::database& db,
                       const std::string& key, const std::string& val) {
-      bool cleared;
-      int64_t lastseen;
+      tgrey::record rec;
 
-      tgrey::fetch_fields(val, lastseen, cleared);
+      if(tgrey::is_meta_key(key))
+        return 0;
 
-      if(tgrey::older_than(_lifetime, lastseen)) {
+      tgrey::decode_record(val, rec);
+      int64_t expires = tgrey::expires_at(rec, _lifetime, _timeout);
+
+      if(expires < ::time(0)) {
         db.remove(key);
         _num_removed++;
+        tgrey::stats.add(tgrey::stat_removed);
       }
+      else
+        tgrey::index_expiry(db, key, expires);
 
       return 0;
     }
@@ -66,9 +126,348 @@ class cleanup_visitor : public tgrey::db_visitor {
 
    protected:
     const unsigned int& _lifetime;
+    const unsigned int& _timeout;
     unsigned int _num_removed;
 };
 
+/** Collects the triplets stored under plain keys and then moves them to
+ ** their hashed keys. The moves are made after the traversal, as engines
+ ** cannot start the transaction of a batch from within one.
+ ** ** **/
+class convert_visitor : public tgrey::db_visitor {
+  public:
+    convert_visitor(tgrey::key_hasher& h) : _hasher(h), _num_converted(0) {
+      /* empty */
+    }
+
+    virtual int visit(tgrey::database& db,
+                      const std::string& key, const std::string& val) {
+      if(tgrey::is_meta_key(key) || tgrey::is_hashed_key(key))
+        return 0;
+
+      _plain.push_back(std::make_pair(key, val));
+      return 0;
+    }
+
+    void move_all(tgrey::database& db) {
+      for(std::vector<std::pair<std::string, std::string> >::const_iterator
+            it = _plain.begin(); it != _plain.end(); ++it) {
+        const std::string hashed = _hasher(it->first);
+        std::string other;
+        tgrey::write_batch batch;
+
+        // if tgreylist already stored the triplet under its hashed key,
+        // keep whichever of both has been seen last
+        if(db.fetch(hashed, other)) {
+          tgrey::record rec, other_rec;
+
+          tgrey::decode_record(it->second, rec);
+          tgrey::decode_record(other, other_rec);
+
+          if(rec.lastseen > other_rec.lastseen)
+            batch.store(hashed, it->second);
+        }
+        else
+          batch.store(hashed, it->second);
+
+        // move the record in one go where the backend allows for that
+        batch.remove(it->first);
+        db.apply(batch);
+        _num_converted++;
+      }
+
+      _plain.clear();
+    }
+
+    const unsigned int& num_converted() const {
+      return _num_converted;
+    }
+
+   protected:
+    const tgrey::key_hasher& _hasher;
+    std::vector<std::pair<std::string, std::string> > _plain;
+    unsigned int _num_converted;
+};
+
+class upgrade_visitor : public tgrey::db_visitor {
+  public:
+    upgrade_visitor() : _num_upgraded(0) {
+      /* empty */
+    }
+
+    virtual int visit(tgrey::database& db,
+                      const std::string& key, const std::string& val) {
+      tgrey::record rec;
+
+      if(tgrey::is_meta_key(key) || !tgrey::is_legacy_record(val))
+        return 0;
+
+      tgrey::decode_record(val, rec);
+      db.store(key, tgrey::encode_record(rec));
+      _num_upgraded++;
+
+      return 0;
+    }
+
+    const unsigned int& num_upgraded() const {
+      return _num_upgraded;
+    }
+
+   protected:
+    unsigned int _num_upgraded;
+};
+
+/** Read the position a previous run stopped at; empty if there is none.
+ ** ** **/
+inline std::string read_cursor(const std::string& path) {
+  std::ifstream in(path.c_str(), std::ios::binary);
+  std::ostringstream cursor;
+
+  if(in)
+    cursor << in.rdbuf();
+
+  return cursor.str();
+}
+
+/** Save the position to continue at, replacing the file atomically.
+ ** ** **/
+inline void write_cursor(const std::string& path, const std::string& cursor) {
+  const std::string tmp = path + ".tmp";
+
+  {
+    std::ofstream out(tmp.c_str(), std::ios::binary | std::ios::trunc);
+    out << cursor;
+    out.flush();
+
+    if(!out)
+      throw std::runtime_error("error writing cursor file " + tmp);
+  }
+
+  if(::rename(tmp.c_str(), path.c_str()))
+    throw tgrey::sys_error("error writing cursor file " + path);
+}
+
+/** Remove expired triplets a batch at a time instead of in a single
+ ** traversal. Each batch is read without holding any locks and its
+ ** expired triplets are then deleted in a short transaction of their
+ ** own, unless tgreylist has updated them in between; between batches
+ ** the database is left alone for pause milliseconds. Stops after
+ ** time_limit seconds, if not 0, remembering the position in the cursor
+ ** file, if given, for the next run to continue there.
+ ** ** **/
+inline unsigned int cleanup_batches(tgrey::database& db,
+                                    const unsigned int& lifetime,
+                                    const unsigned int& timeout,
+                                    size_t batch_size, unsigned int pause,
+                                    unsigned int time_limit,
+                                    const std::string& cursor_file) {
+  const time_t deadline = time_limit ? ::time(0) + time_limit : 0;
+  tgrey::sweeper sw(lifetime, timeout,
+                    cursor_file.empty() ? "" : read_cursor(cursor_file));
+  unsigned int removed = 0;
+
+  while(true) {
+    unsigned int num = sw.sweep(db, batch_size);
+    db.commit();
+
+    tgrey::stats.add(tgrey::stat_removed, num);
+    removed += num;
+
+    if(!cursor_file.empty())
+      write_cursor(cursor_file, sw.cursor());
+
+    if(sw.done() || (deadline && ::time(0) >= deadline))
+      break;
+
+    if(pause)
+      ::usleep(pause * 1000);
+  }
+
+  if(!sw.done())
+    tgrey::log << "cleanup stopped before the end of the database";
+
+  return removed;
+}
+
+/** Go over the hours of the expiry index that have passed, removing the
+ ** expired triplets listed in them and listing those refreshed since in
+ ** the hour they expire in now. Each chunk of the index is handled in a
+ ** single batch, and so a transaction of its own, pausing for pause
+ ** milliseconds after every hour. Without an index yet, cleans up in a single traversal building
+ ** it instead.
+ ** ** **/
+inline unsigned int cleanup_index(tgrey::database& db,
+                                  unsigned int& lifetime,
+                                  unsigned int& timeout, unsigned int pause) {
+  const int64_t now = ::time(0);
+  const int64_t current = now / tgrey::expiry_span;
+  std::string val;
+
+  if(!db.fetch(tgrey::expiry_next_key, val)) {
+    index_visitor vi(lifetime, timeout);
+    db.traverse(vi);
+
+    std::ostringstream next;
+    next << current;
+    db.store(tgrey::expiry_next_key, next.str());
+    db.commit();
+
+    tgrey::log << "built expiry index";
+    return vi.num_removed();
+  }
+
+  unsigned int removed = 0;
+
+  for(int64_t hour = ::strtoll(val.c_str(), 0, 10); hour < current; ++hour) {
+    for(unsigned int chunk = 0; chunk < tgrey::expiry_chunks; ++chunk) {
+      const std::string index_key = tgrey::expiry_key(hour, chunk);
+      std::string list;
+
+      if(!db.fetch(index_key, list))
+        continue;
+
+      std::vector<std::string> keys;
+      tgrey::decode_expiry_keys(list, keys);
+      std::sort(keys.begin(), keys.end());
+      keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+      tgrey::write_batch batch;
+
+      for(std::vector<std::string>::const_iterator it = keys.begin();
+          it != keys.end(); ++it) {
+        tgrey::record rec;
+
+        if(!db.fetch(*it, val))
+          continue;
+
+        tgrey::decode_record(val, rec);
+        int64_t expires = tgrey::expires_at(rec, lifetime, timeout);
+
+        if(expires < now)
+          batch.remove_unchanged(*it, val);
+        else
+          tgrey::index_expiry(batch, *it, expires);
+      }
+
+      batch.remove_unchanged(index_key, list);
+      unsigned int num = db.apply(batch);
+      db.commit();
+
+      // nothing appends to hours that have passed, so the chunk itself
+      // is only left if it has been removed in the meantime
+      if(num && !db.fetch(index_key, list))
+        num--;
+
+      tgrey::stats.add(tgrey::stat_removed, num);
+      removed += num;
+    }
+
+    std::ostringstream next;
+    next << hour + 1;
+    db.store(tgrey::expiry_next_key, next.str());
+    db.commit();
+
+    if(pause)
+      ::usleep(pause * 1000);
+  }
+
+  return removed;
+}
+
+/** One of the parts of the database cleaned up in parallel, with the
+ ** number of triplets removed from it.
+ ** ** **/
+struct cleanup_part {
+  cleanup_part(tgrey::database& d, unsigned int& l, unsigned int& t,
+               size_t p, size_t n)
+    : db(d), vi(l, t), part(p), parts(n), removed(0) {
+    /* empty */
+  }
+
+  tgrey::database& db;
+  cleanup_visitor vi;
+  const size_t part;
+  const size_t parts;
+  size_t removed;
+  pthread_t thread;
+  std::string error;
+};
+
+void* cleanup_part_main(void* arg) {
+  cleanup_part& cp = *static_cast<cleanup_part*>(arg);
+
+  try {
+    cp.removed = cp.db.traverse_part(cp.vi, cp.part, cp.parts);
+  }
+  catch(const std::exception& err) {
+    cp.error = err.what();
+  }
+
+  return 0;
+}
+
+/** Split the database into as many parts as there are threads and clean
+ ** up each part in a thread of its own, adding up the triplets removed.
+ ** The changes are committed once all threads are done; the first error
+ ** of any thread is rethrown after that.
+ ** ** **/
+inline unsigned int cleanup_parallel(tgrey::database& db,
+                                     unsigned int& lifetime,
+                                     unsigned int& timeout, size_t threads) {
+  std::vector<cleanup_part*> parts;
+  std::string error;
+  unsigned int removed = 0;
+
+  for(size_t i = 0; i < threads; ++i) {
+    parts.push_back(new cleanup_part(db, lifetime, timeout, i, threads));
+
+    if(int err = ::pthread_create(&parts.back()->thread, 0,
+                                  &cleanup_part_main, parts.back())) {
+      error = std::string("error starting cleanup thread: ") +
+              std::string(strerror(err));
+      delete parts.back();
+      parts.pop_back();
+      break;
+    }
+  }
+
+  for(size_t i = 0; i < parts.size(); ++i) {
+    ::pthread_join(parts[i]->thread, 0);
+    removed += parts[i]->removed;
+
+    if(error.empty())
+      error = parts[i]->error;
+
+    delete parts[i];
+  }
+
+  db.commit();
+  tgrey::stats.add(tgrey::stat_removed, removed);
+
+  if(!error.empty())
+    throw std::runtime_error(error);
+
+  return removed;
+}
+
+/** Go over the whole database or, if one is given, a single shard.
+ ** ** **/
+inline void traverse(tgrey::database& db, tgrey::db_visitor& vi, int shard) {
+  if(shard < 0)
+    db.traverse(vi);
+  else
+    db.traverse(vi, shard);
+}
+
+inline size_t traverse(tgrey::database& db, tgrey::db_view_visitor& vi,
+                       int shard) {
+  // split into as many parts as there are shards, each part is a shard
+  if(shard < 0)
+    return db.traverse(vi);
+  else
+    return db.traverse_part(vi, shard, db.shards());
+}
+
 int main(int argc, const char* argv[]) {
   // see if stderr is connected to a terminal; if this is not the case we
   // set the default log destination to syslog
@@ -77,6 +476,18 @@ int main(int argc, const char* argv[]) {
   // variables with default values for the commandline options
   std::string   database   = CONFIG_TGREY_DB;
   unsigned int  lifetime   = tgrey::convert_timespan("90d");
+  unsigned int  timeout    = 0;
+  std::string   durability = "none";
+  bool          convert    = false;
+  bool          upgrade    = false;
+  bool          index      = false;
+  int           shard      = -1;
+  size_t        threads    = 1;
+  size_t        batch_size = 0;
+  unsigned int  pause      = 10;
+  unsigned int  time_limit = 0;
+  std::string   cursor;
+  std::string   stats;
   bool          help       = false;
   bool          log2stderr = with_term;
 
@@ -85,11 +496,67 @@ int main(int argc, const char* argv[]) {
     .help("Path to use as the database for storing greylisting triplets. "
           "The user this process is run under needs read and write "
           "permissions and if it not already exists needs to be allowed "
-          "to create it.");
+          "to create it. Prefix with mmap: or ram: to use a memory mapped "
+          "hash file or a RAM database instead of TDB, and append "
+          ",shards=N if tgreylist spreads the triplets over N files.");
   spec.opt("lifetime", 'l', lifetime)
     .converter(&tgrey::convert_timespan)
     .help("For any delivery where no matching mail has been seen for "
           "this long, reject and reset the triplet in any case.");
+  spec.opt("timeout", 't', timeout)
+    .converter(&tgrey::convert_timespan)
+    .help("Also remove triplets not cleared for delivery yet once they "
+          "have not been seen for this long, as tgreylist --timeout "
+          "would reset them anyway. The default of 0 keeps them until "
+          "their lifetime has passed.");
+  spec.flag("expiry-index", index)
+    .help("Only look at the triplets listed as expiring by now in the "
+          "index kept by tgreylist --expiry-index. If there is no index "
+          "yet, go over all triplets once, building it.");
+  spec.opt("durability", durability)
+    .help("How the changes of each pass over the database are made "
+          "durable: every change on its own (none), or all in one "
+          "transaction synced to disk at the end (fsync) or not "
+          "explicitly synced (nosync). A transaction keeps tgreylist "
+          "from writing to a TDB database until the pass is done, so "
+          "combine those with --batch-size to have a short one for "
+          "every batch instead.");
+  spec.opt("shard", shard)
+    .help("Only go over the triplets in this shard of a sharded "
+          "database, numbered from 0. Shards may be cleaned by separate "
+          "processes in parallel, and each is locked only while it is "
+          "being cleaned.");
+  spec.opt("threads", threads)
+    .help("Split the database into this many parts and clean them up in "
+          "parallel threads. Only sharded and memory mapped databases "
+          "can be split; others are cleaned up by a single thread.");
+  spec.opt("batch-size", batch_size)
+    .help("Instead of going over the database in a single traversal "
+          "holding its locks throughout, read this many triplets at a "
+          "time without locking and remove the expired ones among them "
+          "in a short transaction each.");
+  spec.opt("pause", pause)
+    .help("Milliseconds to leave the database to tgreylist between two "
+          "batches of --batch-size.");
+  spec.opt("time-limit", time_limit)
+    .converter(&tgrey::convert_timespan)
+    .help("Stop cleaning up in batches after this long, even if not all "
+          "of the database has been gone over. The default of 0 means "
+          "no limit.");
+  spec.opt("cursor", cursor)
+    .help("File to keep the position of cleaning up in batches in; a "
+          "run stopped by --time-limit is continued from there by the "
+          "next one.");
+  spec.flag("convert-keys", 'H', convert)
+    .help("Before cleaning up, convert all triplets stored under plain "
+          "text keys to the hashed keys used by tgreylist --hash-keys.");
+  spec.flag("upgrade-records", 'U', upgrade)
+    .help("Before cleaning up, rewrite all records still stored in the "
+          "text format of earlier releases in the current binary "
+          "format. Both formats are read, so this is optional.");
+  spec.opt("stats", stats)
+    .help("Count the triplets removed in the shared memory segment of "
+          "this name, such as /tgrey, for tgreystat to show.");
   spec.flag("log-to-stderr", 'e', log2stderr)
     .help("Force log output to go to standard error even if that is not "
           "connected to a controlling terminal.");
@@ -120,14 +587,124 @@ int main(int argc, const char* argv[]) {
       (log2stderr ? slo::stderr : tgrey::syslog_stage));
 
   // create a database object; this will not try to open it
-  tgrey::database db(database);
-  cleanup_visitor vi(lifetime);
+  std::auto_ptr<tgrey::database> dbp;
+  cleanup_visitor vi(lifetime, timeout);
+
+  try {
+    if(!stats.empty())
+      tgrey::stats.open(stats);
+
+    dbp.reset(new tgrey::database(database));
+    dbp->group_commit(tgrey::convert_durability(durability), 0, 0);
+  }
+  catch(const std::exception& err) {
+    tgrey::log << slo::crit << err.what();
+    return 1;
+  }
+
+  tgrey::database& db = *dbp;
+
+  try {
+    db.open();
+  }
+  catch(const std::exception& err) {
+    tgrey::log << slo::crit << err.what();
+    return 1;
+  }
+
+  if(shard >= 0 && size_t(shard) >= db.shards()) {
+    tgrey::log << slo::crit << "database has no shard " << shard;
+    return 1;
+  }
 
-  db.open();
-  db.traverse(vi);
+  if(index && !db.can_append()) {
+    tgrey::log << slo::crit << "--expiry-index cannot be used with "
+               << "mmap: databases";
+    return 1;
+  }
+
+  if(shard >= 0 && batch_size) {
+    tgrey::log << slo::crit << "--shard cannot be used with --batch-size";
+    return 1;
+  }
+
+  if(index && (shard >= 0 || batch_size)) {
+    tgrey::log << slo::crit << "--expiry-index cannot be used with "
+               << "--shard or --batch-size";
+    return 1;
+  }
+
+  if(!threads) {
+    tgrey::log << slo::crit << "--threads needs to be at least 1";
+    return 1;
+  }
+
+  if(threads > 1 && (index || shard >= 0 || batch_size)) {
+    tgrey::log << slo::crit << "--threads cannot be used with "
+               << "--expiry-index, --shard or --batch-size";
+    return 1;
+  }
+
+  if(convert) {
+    try {
+      tgrey::key_hasher hasher;
+      hasher.open(db);
+
+      convert_visitor cv(hasher);
+      traverse(db, cv, shard);
+      cv.move_all(db);
+
+      tgrey::log << "converted "
+                 << cv.num_converted()
+                 << " database entries to hashed keys";
+    }
+    catch(const std::exception& err) {
+      tgrey::log << slo::crit << err.what();
+      return 1;
+    }
+  }
+
+  if(upgrade) {
+    try {
+      upgrade_visitor uv;
+      traverse(db, uv, shard);
+
+      tgrey::log << "upgraded "
+                 << uv.num_upgraded()
+                 << " database entries to binary records";
+    }
+    catch(const std::exception& err) {
+      tgrey::log << slo::crit << err.what();
+      return 1;
+    }
+  }
+
+  unsigned int removed;
+
+  try {
+    if(index)
+      removed = cleanup_index(db, lifetime, timeout, pause);
+
+    else if(batch_size) {
+      removed = cleanup_batches(db, lifetime, timeout, batch_size, pause,
+                                time_limit, cursor);
+    }
+    else if(threads > 1)
+      removed = cleanup_parallel(db, lifetime, timeout, threads);
+
+    else {
+      removed = traverse(db, vi, shard);
+      db.commit();
+      tgrey::stats.add(tgrey::stat_removed, removed);
+    }
+  }
+  catch(const std::exception& err) {
+    tgrey::log << slo::crit << err.what();
+    return 1;
+  }
 
   tgrey::log << "cleanup removed "
-             << vi.num_removed()
+             << removed
              << " database entries";
 
   return 0;
@@ -8,16 +8,24 @@
   included file COPYING.
  * * */
 
+#include <pthread.h>
+#include <signal.h>
 #include <unistd.h>
 #include <iostream>
+#include <memory>
 
 #include "ext/slo.hh"
 #include "ext/propa.hh"
 
 #include "misc.hh"
+#include "cache.hh"
 #include "database.hh"
+#include "greylist.hh"
 #include "logging.hh"
 #include "policy.hh"
+#include "server.hh"
+#include "session.hh"
+#include "stats.hh"
 
 slo::logger tgrey::log;
 
@@ -40,6 +48,58 @@ void usage(std::ostream& os, const propa::spec& spec, const char* argv[]) {
      << std::endl;
 }
 
+void log_cache_stats(const tgrey::record_cache& cache) {
+  tgrey::log << "cache: "
+             << cache.hits() << " hits, "
+             << cache.misses() << " misses, "
+             << cache.capacity() << " slots";
+}
+
+void log_latencies() {
+  for(size_t i = 0; i < tgrey::stat_stages; ++i)
+    tgrey::log << "latency of "
+               << tgrey::latency_summary(tgrey::stats, tgrey::stat_stage(i));
+}
+
+/** Thread logging the latencies of the stages of answering requests and
+ ** the cache statistics, if there is a cache, whenever SIGUSR1 arrives.
+ ** The signal is blocked in all other threads, so it is only ever
+ ** received here by sigwait and never interrupts request processing.
+ ** ** **/
+void* report_on_signal(void* arg) {
+  const tgrey::record_cache* cache =
+      static_cast<const tgrey::record_cache*>(arg);
+  sigset_t set;
+  int sig;
+
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+
+  while(!sigwait(&set, &sig)) {
+    log_latencies();
+
+    if(cache)
+      log_cache_stats(*cache);
+  }
+
+  return 0;
+}
+
+void start_reporter(const tgrey::record_cache* cache) {
+  sigset_t set;
+  pthread_t thread;
+
+  // block the signal before any other thread is started, so all of them
+  // inherit the mask
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &set, 0);
+
+  if(!pthread_create(&thread, 0, &report_on_signal,
+                     const_cast<tgrey::record_cache*>(cache)))
+    pthread_detach(thread);
+}
+
 int main(int argc, const char* argv[]) {
   // see if stderr is connected to a terminal; if this is not the case we
   // set the default log destination to syslog
@@ -50,17 +110,40 @@ int main(int argc, const char* argv[]) {
   unsigned int  delay      = tgrey::convert_timespan("5m");
   unsigned int  timeout    = tgrey::convert_timespan("7d");
   unsigned int  lifetime   = tgrey::convert_timespan("90d");
+  unsigned int  refresh    = 0;
   unsigned int  v4mask     = 32;
   unsigned int  v6mask     = 128;
+  std::string   listen;
+  unsigned int  threads    = 0;
+  unsigned int  cache_size = 0;
+  unsigned int  cache_ttl  = tgrey::convert_timespan("1m");
+  std::string   durability = "none";
+  unsigned int  commit_size  = 64;
+  unsigned int  commit_delay = 5;
+  bool          hash_keys  = false;
+  bool          index      = false;
+  unsigned int  sweep      = 0;
+  std::string   stats;
   bool          help       = false;
   bool          log2stderr = with_term;
+  std::string   log_overflow = "drop";
 
   propa::spec spec;
   spec.opt("database", 'D', database)
     .help("Path to use as the database for storing greylisting triplets. "
           "The user this process is run under needs read and write "
           "permissions and if it not already exists needs to be allowed "
-          "to create it.");
+          "to create it. Prefix with mmap: to use a memory mapped hash "
+          "file shared by any number of processes without locking, "
+          "optionally followed by ,slots=N to give the number of "
+          "triplets it is created for (default 262144). Keys of such "
+          "files are limited to 200 bytes; see --hash-keys. Prefix with "
+          "ram: to keep all triplets in memory, logging changes to "
+          "PATH.log and writing snapshots to PATH; only a single process "
+          "may use such a database at a time, so stop the server before "
+          "running tgreyclean on it. Append ,shards=N to any of them to "
+          "spread the triplets over the files PATH.0 to PATH.N-1, "
+          "dividing the contention for locks among them.");
   spec.opt("delay", 'd', delay)
     .converter(&tgrey::convert_timespan)
     .help("Delta between the time a triplet is first recorded and mail "
@@ -75,15 +158,98 @@ int main(int argc, const char* argv[]) {
     .converter(&tgrey::convert_timespan)
     .help("For any delivery where no matching mail has been seen for "
           "this long, reject and reset the triplet in any case.");
+  spec.opt("refresh", 'r', refresh)
+    .converter(&tgrey::convert_timespan)
+    .help("Granularity at which the last delivery time of triplets "
+          "already cleared is written back. Deliveries for such "
+          "triplets only cause a database write if the stored time is "
+          "older than this. Should be small compared to lifetime; the "
+          "default of 0 writes on every delivery.");
   spec.opt("v4mask", '4', v4mask)
     .help("Prefix size for masking any IPv4 addresses used for "
           "building the triplet. This will group together all delivery "
           "agents coming from the subnet.");
   spec.opt("v6mask", '6', v6mask)
     .help("Same as --v4mask but for IPv6 addresses.");
+  spec.flag("hash-keys", 'H', hash_keys)
+    .help("Store triplets under a fixed length salted hash of the "
+          "triplet instead of the triplet itself. Existing databases "
+          "should be converted with tgreyclean --convert-keys first.");
+  spec.flag("expiry-index", index)
+    .help("List new triplets in an index by the time they expire, so "
+          "that tgreyclean --expiry-index only needs to look at the "
+          "triplets due for removal instead of all. Not available with "
+          "mmap: databases.");
+  spec.opt("sweep", sweep)
+    .help("For every request, once its response has been written, and "
+          "in --listen mode also every 100 milliseconds no requests "
+          "come in, look at this many more triplets and remove those "
+          "expired by --lifetime or --timeout, going over the database "
+          "again and again and keeping the position in it for the next "
+          "process to continue. This spreads cleaning up over the day "
+          "and replaces running tgreyclean, "
+          "which is the only way to clean up ram: databases without "
+          "stopping the server. The default of 0 leaves cleaning up to "
+          "tgreyclean.");
+  spec.opt("listen", 'L', listen)
+    .help("Instead of answering a single client on standard input and "
+          "output, listen on this socket and serve any number of "
+          "concurrent clients. Either a path (or unix:PATH) for a UNIX "
+          "domain socket or HOST:PORT (or inet:HOST:PORT) for TCP. "
+          "SIGTERM or SIGINT stop the server, committing what has been "
+          "changed and saving the --sweep position.");
+  spec.opt("threads", 'T', threads)
+    .help("Number of worker threads evaluating requests in --listen "
+          "mode. With the default of 0 all requests are evaluated by "
+          "the thread handling the connections. The responses of every "
+          "connection keep the order of its requests. The workers take "
+          "turns in accessing a TDB file, as it is guarded by a single "
+          "lock; spread it with ,shards=N for them to work on different "
+          "shards at the same time.");
+  spec.opt("cache-size", cache_size)
+    .help("Keep up to this many recently used triplets in memory and "
+          "look them up there before asking the database. The default "
+          "of 0 disables the cache. Hits and misses are logged on "
+          "SIGUSR1 and at exit.");
+  spec.opt("cache-ttl", cache_ttl)
+    .converter(&tgrey::convert_timespan)
+    .help("Time after which a cached triplet is looked up in the "
+          "database again. Changes made by other processes using the "
+          "same database may go unnoticed for this long. That includes "
+          "triplets removed by tgreyclean, which stay cached and are not "
+          "created anew for up to this long after a cleanup; those "
+          "removed by --sweep have expired and are created anew "
+          "anyway.");
+  spec.opt("durability", durability)
+    .help("Either write every change to the database on its own (none) "
+          "or group the changes of concurrent requests into "
+          "transactions, committed before any of the requests is "
+          "answered. Committed transactions are either synced to disk "
+          "(fsync) or not (nosync), which survives a crash of this "
+          "process but not of the system.");
+  spec.opt("commit-size", commit_size)
+    .help("Commit a group of changes once it holds this many of them.");
+  spec.opt("commit-delay", commit_delay)
+    .help("Milliseconds a group of changes is kept open for changes "
+          "made on behalf of other clients in --listen mode, delaying "
+          "the answers to the requests in it by up to as much.");
+  spec.opt("stats", stats)
+    .help("Count the decisions taken, the errors and the triplets "
+          "removed by --sweep in the shared memory segment of this "
+          "name, such as /tgrey, for tgreystat to show. Any number of "
+          "processes may count in the same segment. The latencies of "
+          "parsing, building keys, database lookups and writes, the "
+          "whole decision and writing responses are kept there as well; "
+          "they are also logged on SIGUSR1, with or without this.");
   spec.flag("log-to-stderr", 'e', log2stderr)
     .help("Force log output to go to standard error even if that is not "
           "connected to a controlling terminal.");
+  spec.opt("log-overflow", log_overflow)
+    .help("Log messages are written by a thread of their own, so that a "
+          "slow syslog daemon does not delay the answers. If it falls "
+          "more than 1024 messages behind, either drop further messages "
+          "and log how many have been dropped (drop) or wait for it "
+          "(block).");
   spec.flag("help", 'h', help)
     .help("Display this text and exit.");
 
@@ -104,72 +270,87 @@ int main(int argc, const char* argv[]) {
     return 0;
   }
 
-  // set up logging
+  if(log_overflow != "drop" && log_overflow != "block") {
+    tgrey::log.add_pipe(log2stderr ? slo::stderr : tgrey::syslog_stage);
+    tgrey::log << slo::crit << "unknown log overflow policy: "
+               << log_overflow;
+    return 1;
+  }
+
+  // set up logging, leaving the writing to a thread of its own
   tgrey::log.msg_level(slo::info);
   tgrey::log.add_pipe(
       slo::min_level(slo::info) |
+      slo::async(1024, log_overflow == "drop" ? slo::drop : slo::block) |
       (log2stderr ? slo::stderr : tgrey::syslog_stage));
 
   // create a database object; this will not try to open it
-  tgrey::database db(database);
+  std::auto_ptr<tgrey::database> db;
 
-  // run in an infinite loop
-  while(true) {
+  try {
+    if(!stats.empty())
+      tgrey::stats.open(stats);
+
+    db.reset(new tgrey::database(database));
+    db->group_commit(tgrey::convert_durability(durability),
+                     commit_size, commit_delay);
+  }
+  catch(const std::exception& err) {
+    tgrey::log << slo::crit << err.what();
+    return 1;
+  }
+
+  // the index is kept by appending to records
+  if(index && !db->can_append()) {
+    tgrey::log << slo::crit << "--expiry-index cannot be used with "
+               << "mmap: databases";
+    return 1;
+  }
+
+  std::auto_ptr<tgrey::record_cache> cache;
+
+  if(cache_size)
+    cache.reset(new tgrey::record_cache(cache_size, cache_ttl));
+
+  start_reporter(cache.get());
+
+  tgrey::greylist greylist(*db, delay, timeout, lifetime, v4mask, v6mask,
+                           hash_keys, cache.get(), refresh, index, sweep);
+
+  // in daemon mode serve all clients connecting to the socket from this
+  // single process
+  if(!listen.empty()) {
     try {
-      // try to parse the request
-      const tgrey::policy_request req(std::cin);
-
-      // this is an noop if the database is already open, otherwise it
-      // tries to open it; might throw
-      db.open();
-
-      bool exists, cleared;
-      std::string key, val;
-      int64_t lastseen;
-
-      // try to get data associated with triplet from database
-      key = req.to_key(v4mask, v6mask);
-      exists = db.fetch(key, val);
-
-      // parse database entry
-      if(exists)
-        tgrey::fetch_fields(val, lastseen, cleared);
-
-      // create a fresh database entry if:
-      //  - either there is none yet
-      //  - or if the existing one is expired, meaning that it is:
-      //    + either older than lifetime
-      //    + or older than timeout and has not yet been cleared
-      if(   (!exists)
-         || (tgrey::older_than(lifetime, lastseen))
-         || (tgrey::older_than(timeout, lastseen) && !cleared)) {
-        db.store(key, tgrey::join_fields(::time(0), false));
-        tgrey::log << "new ( " << req.to_key(" / ", v4mask, v6mask) << " )";
-        std::cout << tgrey::policy_response::service_unavailable;
-      }
-
-      // set database entry to cleared and update lastseen if:
-      //  - either entry is cleared already
-      //  - or the last delivery attempt was longer than delay ago
-      else if(   cleared
-              || tgrey::older_than(delay, lastseen)) {
-        db.store(key, tgrey::join_fields(::time(0), true));
-        tgrey::log << "ok ( " << req.to_key(" / ", v4mask, v6mask) << " )";
-        std::cout << tgrey::policy_response::dunno;
-      }
-
-      // do not allow to pass and don't change database otherwise
-      else {
-        tgrey::log << "wait ( " << req.to_key(" / ", v4mask, v6mask) << " )";
-        std::cout << tgrey::policy_response::service_unavailable;
-      }
+      tgrey::server srv(listen, threads);
+      srv.open();
+      tgrey::log << "listening on " << listen;
+      srv.run(greylist);
+      tgrey::log << "stopped listening on " << listen;
     }
-    // if there was any kind of unexpected error, make sure this does
-    // not impact mail delivery by answering with dunno
     catch(const std::exception& err) {
-      tgrey::log << slo::error << err.what(); break;
+      tgrey::log << slo::crit << err.what();
+      return 1;
     }
+
+    if(cache.get())
+      log_cache_stats(*cache);
+
+    return 0;
   }
 
+  // otherwise answer requests on standard input until it is closed
+  try {
+    tgrey::session ses(STDIN_FILENO, STDOUT_FILENO);
+    ses.run(greylist);
+  }
+  // if there was any kind of unexpected error, make sure this does
+  // not impact mail delivery by answering with dunno
+  catch(const std::exception& err) {
+    tgrey::log << slo::error << err.what();
+  }
+
+  if(cache.get())
+    log_cache_stats(*cache);
+
   return 0;
 }
@@ -0,0 +1,149 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#include <unistd.h>
+
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+
+#include "ext/slo.hh"
+#include "ext/propa.hh"
+
+#include "misc.hh"
+#include "logging.hh"
+#include "stats.hh"
+
+slo::logger tgrey::log;
+
+void usage(std::ostream& os, const propa::spec& spec, const char* argv[]) {
+  spec.usage(os, argv);
+
+  os << std::endl
+     << "Show the statistics counted by tgreylist and tgreyclean in a "
+     << "shared memory" << std::endl << "segment, either once or as rates "
+     << "per second at a regular interval." << std::endl
+     << std::endl;
+
+  spec.options(os);
+
+  os << std::endl
+     << "This binary represents version " << PACKAGE_VERSION << " of the "
+     << "package. Copyright (c) 2014," << std::endl << "Florian Wagner. "
+     << "Feel free to contact me at florian@wagner-flo.net with" << std::endl
+     << "comments and bug reports." << std::endl
+     << std::endl;
+}
+
+/** Width of the columns when streaming rates.
+ ** ** **/
+const int column = 13;
+
+/** Print the counters one per line, as they are now.
+ ** ** **/
+void print_counters(const tgrey::statistics& stats) {
+  for(size_t i = 0; i < tgrey::stat_counters; ++i)
+    std::cout << std::left << std::setw(column) << tgrey::stat_names[i]
+              << stats.get(tgrey::stat_counter(i)) << std::endl;
+}
+
+/** Print the latency percentiles of the stages of answering requests.
+ ** ** **/
+void print_latencies(const tgrey::statistics& stats) {
+  for(size_t i = 0; i < tgrey::stat_stages; ++i)
+    std::cout << tgrey::latency_summary(stats, tgrey::stat_stage(i))
+              << std::endl;
+}
+
+/** Print how much each counter has changed per second, every interval
+ ** seconds, until interrupted.
+ ** ** **/
+void stream_rates(const tgrey::statistics& stats, unsigned int interval) {
+  uint64_t last[tgrey::stat_counters];
+  double then = tgrey::monotonic_ms() / 1e3;
+
+  for(size_t i = 0; i < tgrey::stat_counters; ++i) {
+    last[i] = stats.get(tgrey::stat_counter(i));
+    std::cout << std::right << std::setw(column) << tgrey::stat_names[i];
+  }
+
+  std::cout << std::endl << std::fixed << std::setprecision(1);
+
+  while(true) {
+    ::sleep(interval);
+
+    const double now = tgrey::monotonic_ms() / 1e3;
+
+    for(size_t i = 0; i < tgrey::stat_counters; ++i) {
+      uint64_t val = stats.get(tgrey::stat_counter(i));
+      std::cout << std::setw(column) << (val - last[i]) / (now - then);
+      last[i] = val;
+    }
+
+    std::cout << std::endl;
+    then = now;
+  }
+}
+
+int main(int argc, const char* argv[]) {
+  // variables with default values for the commandline options
+  std::string   stats    = "/tgrey";
+  unsigned int  interval = 0;
+  bool          latency  = false;
+  bool          help     = false;
+
+  propa::spec spec;
+  spec.opt("stats", stats)
+    .help("Name of the shared memory segment given to tgreylist and "
+          "tgreyclean as --stats.");
+  spec.opt("interval", 'i', interval)
+    .converter(&tgrey::convert_timespan)
+    .help("Instead of printing the counters once, print how much they "
+          "have changed per second every this long, until interrupted.");
+  spec.flag("latency", 'l', latency)
+    .help("Print the median, 99th and 99.9th percentile of the time "
+          "tgreylist took for each stage of answering requests since "
+          "the segment was created, instead of the counters.");
+  spec.flag("help", 'h', help)
+    .help("Display this text and exit.");
+
+  // errors are for whoever is running this, so they go to standard error
+  tgrey::log.add_pipe(slo::stderr);
+
+  try {
+    spec.parse(argc, argv);
+  }
+  catch(...) {
+    tgrey::log << slo::crit << "error parsing commandline";
+    return 1;
+  }
+
+  if(help) {
+    usage(std::cout, spec, argv);
+    return 0;
+  }
+
+  try {
+    tgrey::stats.open(stats, false);
+  }
+  catch(const std::exception& err) {
+    tgrey::log << slo::crit << err.what();
+    return 1;
+  }
+
+  if(latency)
+    print_latencies(tgrey::stats);
+  else if(interval)
+    stream_rates(tgrey::stats, interval);
+  else
+    print_counters(tgrey::stats);
+
+  return 0;
+}
@@ -0,0 +1,114 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#ifndef TGREY_THREAD_HH
+#define TGREY_THREAD_HH
+
+#include <pthread.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+#include "misc.hh"
+
+namespace tgrey
+{
+  class mutex {
+    public:
+      mutex(bool recursive = false) {
+        pthread_mutexattr_t attr;
+        ::pthread_mutexattr_init(&attr);
+
+        if(recursive)
+          ::pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+
+        ::pthread_mutex_init(&_mtx, &attr);
+        ::pthread_mutexattr_destroy(&attr);
+      }
+
+      ~mutex() { ::pthread_mutex_destroy(&_mtx); }
+
+      void lock()   { ::pthread_mutex_lock(&_mtx); }
+      void unlock() { ::pthread_mutex_unlock(&_mtx); }
+
+      bool try_lock() { return !::pthread_mutex_trylock(&_mtx); }
+
+      pthread_mutex_t* native() { return &_mtx; }
+
+    protected:
+      pthread_mutex_t _mtx;
+
+    private:
+      mutex(const mutex&);
+      mutex& operator= (const mutex&);
+  };
+
+  class scoped_lock {
+    public:
+      scoped_lock(mutex& m) : _mtx(m) { _mtx.lock(); }
+      ~scoped_lock() { _mtx.unlock(); }
+
+    protected:
+      mutex& _mtx;
+
+    private:
+      scoped_lock(const scoped_lock&);
+      scoped_lock& operator= (const scoped_lock&);
+  };
+
+  class condition {
+    public:
+      condition()  { ::pthread_cond_init(&_cond, 0); }
+      ~condition() { ::pthread_cond_destroy(&_cond); }
+
+      void wait(mutex& m) { ::pthread_cond_wait(&_cond, m.native()); }
+      void signal()       { ::pthread_cond_signal(&_cond); }
+      void broadcast()    { ::pthread_cond_broadcast(&_cond); }
+
+    protected:
+      pthread_cond_t _cond;
+
+    private:
+      condition(const condition&);
+      condition& operator= (const condition&);
+  };
+
+  /** A fixed set of mutexes selected by the hash of a key. Used to
+   ** serialize operations on the same key without a lock per key and
+   ** without serializing operations on unrelated keys.
+   ** ** **/
+  class lock_table {
+    public:
+      lock_table(size_t n = 64) : _stripes(n ? n : 1) {
+        for(std::vector<mutex*>::iterator it = _stripes.begin();
+            it != _stripes.end(); ++it)
+          *it = new mutex;
+      }
+
+      ~lock_table() {
+        for(std::vector<mutex*>::iterator it = _stripes.begin();
+            it != _stripes.end(); ++it)
+          delete *it;
+      }
+
+      mutex& stripe(const std::string& key) {
+        return *_stripes[stable_hash(key) % _stripes.size()];
+      }
+
+    protected:
+      std::vector<mutex*> _stripes;
+
+    private:
+      lock_table(const lock_table&);
+      lock_table& operator= (const lock_table&);
+  };
+}
+
+#endif /* TGREY_THREAD_HH */
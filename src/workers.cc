@@ -0,0 +1,84 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#include <string.h>
+#include <stdexcept>
+#include <string>
+
+#include "workers.hh"
+
+/** Start a fixed number of threads waiting for jobs to be submitted.
+ ** ** **/
+tgrey::worker_pool::worker_pool(unsigned int num) : _stopping(false) {
+  for(unsigned int i = 0; i < num; ++i) {
+    pthread_t thread;
+
+    if(int err = ::pthread_create(&thread, 0, &worker_pool::main, this)) {
+      stop();
+      throw std::runtime_error(std::string("error starting worker: ") +
+                               std::string(strerror(err)));
+    }
+
+    _threads.push_back(thread);
+  }
+}
+
+tgrey::worker_pool::~worker_pool() {
+  stop();
+}
+
+/** Let the threads finish the jobs already queued and wait for them to
+ ** exit.
+ ** ** **/
+void tgrey::worker_pool::stop() {
+  {
+    scoped_lock l(_mtx);
+    _stopping = true;
+    _cond.broadcast();
+  }
+
+  for(std::vector<pthread_t>::iterator it = _threads.begin();
+      it != _threads.end(); ++it)
+    ::pthread_join(*it, 0);
+
+  _threads.clear();
+}
+
+/** Queue a job to be run by the next idle thread. The job itself is
+ ** responsible for reporting back its result.
+ ** ** **/
+void tgrey::worker_pool::submit(job* j) {
+  scoped_lock l(_mtx);
+  _queue.push_back(j);
+  _cond.signal();
+}
+
+void* tgrey::worker_pool::main(void* arg) {
+  worker_pool* pool = static_cast<worker_pool*>(arg);
+
+  while(true) {
+    job* j;
+
+    {
+      scoped_lock l(pool->_mtx);
+
+      while(pool->_queue.empty() && !pool->_stopping)
+        pool->_cond.wait(pool->_mtx);
+
+      if(pool->_queue.empty())
+        return 0;
+
+      j = pool->_queue.front();
+      pool->_queue.pop_front();
+    }
+
+    j->run();
+  }
+}
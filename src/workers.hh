@@ -0,0 +1,47 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#ifndef TGREY_WORKERS_HH
+#define TGREY_WORKERS_HH
+
+#include <pthread.h>
+#include <deque>
+#include <vector>
+
+#include "thread.hh"
+
+namespace tgrey
+{
+  class job {
+    public:
+      virtual ~job() { /* empty */ }
+      virtual void run() = 0;
+  };
+
+  class worker_pool {
+    public:
+      worker_pool(unsigned int);
+      ~worker_pool();
+
+      void submit(job*);
+
+    protected:
+      mutex _mtx;
+      condition _cond;
+      bool _stopping;
+      std::deque<job*> _queue;
+      std::vector<pthread_t> _threads;
+
+      void stop();
+      static void* main(void*);
+  };
+}
+
+#endif /* TGREY_WORKERS_HH */
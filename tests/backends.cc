@@ -0,0 +1,545 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#include <dirent.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include "database.hh"
+
+/** Number of checks that have failed so far.
+ ** ** **/
+unsigned int failures = 0;
+
+void check(bool cond, const std::string& what) {
+  if(cond)
+    return;
+
+  std::cerr << "FAIL: " << what << std::endl;
+  failures++;
+}
+
+std::string key(size_t i) {
+  std::ostringstream out;
+  out << "key" << i;
+  return out.str();
+}
+
+/** Check that a record holds the given value, or is missing if the
+ ** value is empty.
+ ** ** **/
+void check_value(tgrey::database& db, const std::string& k,
+                 const std::string& val, const std::string& what) {
+  std::string got;
+
+  if(val.empty())
+    check(!db.fetch(k, got), what + ": " + k + " removed");
+  else
+    check(db.fetch(k, got) && got == val, what + ": " + k + " is " + val);
+}
+
+/** Changes the database from within a traversal, as tgreyclean does when
+ ** upgrading: removes every record whose number is divisible by three
+ ** and rewrites the others.
+ ** ** **/
+class rewrite_visitor : public tgrey::db_visitor {
+  public:
+    virtual int visit(tgrey::database& db, const std::string& key,
+                      const std::string& val) {
+      if(::atoi(key.c_str() + 3) % 3 == 0)
+        db.remove(key);
+      else
+        db.store(key, val + "+");
+
+      return 0;
+    }
+};
+
+/** Removes the records whose number is odd, from a view traversal.
+ ** ** **/
+class odd_visitor : public tgrey::db_view_visitor {
+  public:
+    virtual action visit(const tgrey::strview& key, const tgrey::strview&) {
+      return ::atoi(std::string(key.data + 3, key.size - 3).c_str()) % 2
+        ? remove : keep;
+    }
+};
+
+/** Leaves every record alone.
+ ** ** **/
+class keep_visitor : public tgrey::db_view_visitor {
+  public:
+    virtual action visit(const tgrey::strview&, const tgrey::strview&) {
+      return keep;
+    }
+};
+
+/** Fails on the first record it is given.
+ ** ** **/
+class failing_visitor : public tgrey::db_visitor,
+                        public tgrey::db_view_visitor {
+  public:
+    virtual int visit(tgrey::database&, const std::string&,
+                      const std::string&) {
+      throw std::runtime_error("visitor failed");
+    }
+
+    virtual action visit(const tgrey::strview&, const tgrey::strview&) {
+      throw std::runtime_error("visitor failed");
+    }
+};
+
+/** Errors of visitors end the traversal with an exception and leave the
+ ** database usable.
+ ** ** **/
+void check_failing_visitor(const std::string& spec, const std::string& what) {
+  tgrey::database db(spec);
+  db.group_commit(tgrey::durability_nosync, 0, 0);
+  db.open();
+  db.store(key(0), "v");
+
+  failing_visitor failing;
+  bool thrown = false;
+
+  try {
+    db.traverse(static_cast<tgrey::db_visitor&>(failing));
+  }
+  catch(const std::runtime_error& err) {
+    thrown = std::string(err.what()) == "visitor failed";
+  }
+
+  check(thrown, what + ": error of visitor is thrown");
+  thrown = false;
+
+  try {
+    db.traverse(static_cast<tgrey::db_view_visitor&>(failing));
+  }
+  catch(const std::runtime_error& err) {
+    thrown = std::string(err.what()) == "visitor failed";
+  }
+
+  check(thrown, what + ": error of view visitor is thrown");
+
+  rewrite_visitor rewrite;
+  db.traverse(rewrite);
+  db.commit();
+  check_value(db, key(0), "", what + " after errors");
+}
+
+/** Writes from within traversals, in each of the ways writes may be
+ ** grouped, and whether they have been made durable after reopening.
+ ** ** **/
+void check_traversal_writes(const std::string& spec,
+                            tgrey::durability mode, const std::string& what) {
+  const size_t records = 12;
+
+  {
+    tgrey::database db(spec);
+    db.group_commit(mode, 0, 0);
+    db.open();
+
+    for(size_t i = 0; i < records; ++i)
+      db.store(key(i), "v");
+
+    // a traversal writing nothing must not keep the database from
+    // being written afterwards
+    keep_visitor keep;
+    db.traverse(keep);
+    db.store(key(records), "v");
+    db.remove(key(records));
+
+    rewrite_visitor rewrite;
+    db.traverse(rewrite);
+
+    odd_visitor odd;
+    db.traverse(odd);
+
+    db.commit();
+  }
+
+  tgrey::database db(spec);
+  db.open();
+
+  for(size_t i = 0; i <= records; ++i)
+    check_value(db, key(i), i % 3 && i % 2 == 0 ? "v+" : "", what);
+}
+
+/** Applies a batch of stores, removes and removes of unchanged records,
+ ** some of which find the record changed or gone, and checks how many
+ ** records the batch and a traversal report as removed. Engines that
+ ** can append also get a batch of appends.
+ ** ** **/
+void check_write_batch(const std::string& spec, const std::string& what) {
+  tgrey::database db(spec);
+  db.group_commit(tgrey::durability_nosync, 0, 0);
+  db.open();
+
+  for(size_t i = 0; i < 4; ++i)
+    db.store(key(i), "v");
+
+  tgrey::write_batch batch;
+  batch.store(key(0), "w");
+  batch.store(key(4), "w");
+  batch.remove(key(1));
+  batch.remove_unchanged(key(2), "v");
+  batch.remove_unchanged(key(3), "changed");
+  batch.remove_unchanged(key(5), "v");
+
+  check(db.apply(batch) == 2, what + ": batch removes two records");
+  db.commit();
+
+  check_value(db, key(0), "w", what + " batch");
+  check_value(db, key(1), "", what + " batch");
+  check_value(db, key(2), "", what + " batch");
+  check_value(db, key(3), "v", what + " batch");
+  check_value(db, key(4), "w", what + " batch");
+  check_value(db, key(5), "", what + " batch");
+
+  if(db.can_append()) {
+    batch.clear();
+    batch.append(key(0), "x");
+    batch.append(key(6), "x");
+    batch.append(key(6), "y");
+
+    check(db.apply(batch) == 0, what + ": appends remove nothing");
+    db.commit();
+
+    check_value(db, key(0), "wx", what + " batch append");
+    check_value(db, key(6), "xy", what + " batch append");
+  }
+
+  odd_visitor odd;
+  check(db.traverse(odd) == 1, what + ": traversal removes one record");
+  db.commit();
+}
+
+/** The slots of a memory mapped database: inserting and replacing,
+ ** removing only unchanged records, reusing the slots of removed
+ ** records and running out of slots.
+ ** ** **/
+void check_mmap_slots(const std::string& path) {
+  const size_t slots = 8;
+  std::ostringstream spec;
+  spec << "mmap:" << path << ",slots=" << slots;
+
+  tgrey::database db(spec.str());
+  db.open();
+
+  check(db.insert(key(0), "a"), "mmap: insert of a new key");
+  check(!db.insert(key(0), "b"), "mmap: insert of an existing key");
+  check_value(db, key(0), "a", "mmap insert");
+  db.store(key(0), "b");
+  check_value(db, key(0), "b", "mmap replace");
+
+  tgrey::write_batch batch;
+  batch.remove_unchanged(key(0), "a");
+  check(!db.apply(batch), "mmap: changed record is kept");
+  batch.clear();
+  batch.remove_unchanged(key(0), "b");
+  check(db.apply(batch) == 1, "mmap: unchanged record is removed");
+  check_value(db, key(0), "", "mmap conditional remove");
+
+  // many more records than slots come and go, each reusing a slot
+  for(size_t i = 0; i < 10 * slots; ++i) {
+    db.store(key(i), "v");
+    db.remove(key(i));
+  }
+
+  for(size_t i = 0; i < slots; ++i)
+    db.store(key(i), "v");
+
+  for(size_t i = 0; i < slots; ++i)
+    check_value(db, key(i), "v", "mmap filled");
+
+  bool full = false;
+
+  try {
+    db.store(key(slots), "v");
+  }
+  catch(const std::runtime_error& err) {
+    full = std::string(err.what()) == "mmap database is full";
+  }
+
+  check(full, "mmap: store into a full database fails");
+
+  db.remove(key(0));
+  db.store(key(slots), "v");
+  check_value(db, key(slots), "v", "mmap after full");
+  check_value(db, key(0), "", "mmap after full");
+}
+
+/** Make changes in a process that exits without closing the database,
+ ** as if it had crashed, leaving them in the log of a RAM database.
+ ** ** **/
+void crash_after(const std::string& spec, void (*writes)(tgrey::database&)) {
+  pid_t pid = ::fork();
+
+  if(!pid) {
+    try {
+      tgrey::database db(spec);
+      db.open();
+      writes(db);
+      db.commit();
+      ::_exit(0);
+    }
+    catch(...) {
+      ::_exit(1);
+    }
+  }
+
+  int status = 0;
+  check(pid > 0 && ::waitpid(pid, &status, 0) == pid &&
+        WIFEXITED(status) && !WEXITSTATUS(status), spec + ": crash");
+}
+
+/** Cut the given number of bytes off the end of a file.
+ ** ** **/
+void cut(const std::string& path, off_t bytes) {
+  struct stat st;
+  check(!::stat(path.c_str(), &st) && !::truncate(path.c_str(),
+                                                   st.st_size - bytes),
+        path + ": cut");
+}
+
+void copy(const std::string& from, const std::string& to) {
+  std::ifstream in(from.c_str(), std::ios::binary);
+  std::ofstream out(to.c_str(), std::ios::binary);
+  out << in.rdbuf();
+  check(in && out, from + ": copy");
+}
+
+void store_two(tgrey::database& db) {
+  db.store(key(0), "a");
+  db.store(key(1), "b");
+}
+
+void store_third(tgrey::database& db) {
+  db.store(key(2), "c");
+}
+
+void store_batch(tgrey::database& db) {
+  db.store(key(0), "a");
+
+  tgrey::write_batch batch;
+  batch.store(key(1), "b");
+  batch.store(key(2), "c");
+  batch.remove(key(0));
+  db.apply(batch);
+}
+
+void store_append(tgrey::database& db) {
+  db.store(key(0), "a");
+  db.append(key(1), "x");
+}
+
+/** Replaying the log of a RAM database: a crash in the middle of an
+ ** entry loses that entry only and later ones still count, a crash in
+ ** the middle of a batch loses all of it, and a log that a snapshot
+ ** already holds is not replayed on top of it again.
+ ** ** **/
+void check_ram_replay(const std::string& dir) {
+  const std::string torn = "ram:" + dir + "/torn.ram";
+  crash_after(torn, &store_two);
+  cut(dir + "/torn.ram.log", 3);
+  crash_after(torn, &store_third);
+
+  {
+    tgrey::database db(torn);
+    db.open();
+    check_value(db, key(0), "a", "ram torn tail");
+    check_value(db, key(1), "", "ram torn tail");
+    check_value(db, key(2), "c", "ram torn tail");
+  }
+
+  const std::string half = "ram:" + dir + "/half.ram";
+  crash_after(half, &store_batch);
+  cut(dir + "/half.ram.log", 3);
+
+  {
+    tgrey::database db(half);
+    db.open();
+    check_value(db, key(0), "a", "ram half batch");
+    check_value(db, key(1), "", "ram half batch");
+    check_value(db, key(2), "", "ram half batch");
+  }
+
+  // keep a copy of the log to put it back once the snapshot holds it
+  const std::string reload = "ram:" + dir + "/reload.ram";
+  const std::string log = dir + "/reload.ram.log";
+  crash_after(reload, &store_append);
+  copy(log, dir + "/reload.log");
+
+  {
+    tgrey::database db(reload);
+    db.open();
+    db.append(key(1), "y");
+  }
+
+  check(!::rename((dir + "/reload.log").c_str(), log.c_str()),
+        "ram reload: restore log");
+
+  tgrey::database db(reload);
+  db.open();
+  check_value(db, key(0), "a", "ram reload");
+  check_value(db, key(1), "xy", "ram reload");
+}
+
+/** Checks failing to write the log of a RAM database, by limiting the
+ ** size of the files of a process to that of the log: none of the
+ ** changes are made, not even to the records in memory, and writing
+ ** works once the log may grow again.
+ ** ** **/
+void check_log_failure(const std::string& spec, const std::string& log) {
+  tgrey::database db(spec);
+  db.open();
+  db.store(key(0), "a");
+  db.commit();
+
+  struct stat st;
+  struct rlimit lim;
+  check(!::stat(log.c_str(), &st) && !::getrlimit(RLIMIT_FSIZE, &lim),
+        "ram log failure: log size");
+
+  struct rlimit full = lim;
+  lim.rlim_cur = st.st_size;
+  ::signal(SIGXFSZ, SIG_IGN);
+  check(!::setrlimit(RLIMIT_FSIZE, &lim), "ram log failure: limit");
+
+  tgrey::write_batch batch;
+  batch.store(key(2), "c");
+  batch.remove(key(0));
+
+  const char* const writes[] = { "store", "remove", "append", "batch" };
+
+  for(int i = 0; i < 4; ++i) {
+    try {
+      switch(i) {
+        case 0: db.store(key(1), "b"); break;
+        case 1: db.remove(key(0)); break;
+        case 2: db.append(key(0), "x"); break;
+        case 3: db.apply(batch); break;
+      }
+
+      check(false, std::string("ram log failure: ") + writes[i] + " fails");
+    }
+    catch(const std::exception&) {
+      /* expected */
+    }
+
+    check_value(db, key(0), "a", std::string("ram failed ") + writes[i]);
+    check_value(db, key(1), "", std::string("ram failed ") + writes[i]);
+    check_value(db, key(2), "", std::string("ram failed ") + writes[i]);
+  }
+
+  check(!::setrlimit(RLIMIT_FSIZE, &full), "ram log failure: unlimit");
+  db.store(key(3), "d");
+  db.commit();
+}
+
+void check_ram_log_failure(const std::string& dir) {
+  const std::string spec = "ram:" + dir + "/failed.ram";
+  pid_t pid = ::fork();
+
+  // the limit is only set in a process of its own
+  if(!pid) {
+    try {
+      check_log_failure(spec, dir + "/failed.ram.log");
+      ::_exit(failures ? 1 : 0);
+    }
+    catch(const std::exception& err) {
+      std::cerr << "FAIL: " << err.what() << std::endl;
+      ::_exit(1);
+    }
+  }
+
+  int status = 0;
+  check(pid > 0 && ::waitpid(pid, &status, 0) == pid &&
+        WIFEXITED(status) && !WEXITSTATUS(status), spec + ": log failure");
+
+  tgrey::database db(spec);
+  db.open();
+  check_value(db, key(0), "a", "ram log failure reopened");
+  check_value(db, key(1), "", "ram log failure reopened");
+  check_value(db, key(2), "", "ram log failure reopened");
+  check_value(db, key(3), "d", "ram log failure reopened");
+}
+
+/** Remove the databases created in dir, then dir itself.
+ ** ** **/
+void remove_dir(const std::string& dir) {
+  if(DIR* d = ::opendir(dir.c_str())) {
+    while(struct dirent* ent = ::readdir(d))
+      if(ent->d_name[0] != '.')
+        ::unlink((dir + "/" + ent->d_name).c_str());
+
+    ::closedir(d);
+  }
+
+  ::rmdir(dir.c_str());
+}
+
+int main() {
+  char tmpl[] = "/tmp/tgrey-test.XXXXXX";
+
+  if(!::mkdtemp(tmpl)) {
+    std::cerr << "error creating temporary directory" << std::endl;
+    return 1;
+  }
+
+  const std::string dir(tmpl);
+
+  try {
+    check_traversal_writes("tdb:" + dir + "/none.tdb",
+                           tgrey::durability_none, "tdb none");
+    check_traversal_writes("tdb:" + dir + "/nosync.tdb",
+                           tgrey::durability_nosync, "tdb nosync");
+    check_traversal_writes("tdb:" + dir + "/fsync.tdb",
+                           tgrey::durability_fsync, "tdb fsync");
+    check_failing_visitor("tdb:" + dir + "/failing.tdb", "tdb");
+    check_write_batch("tdb:" + dir + "/batch.tdb", "tdb");
+
+    check_traversal_writes("mmap:" + dir + "/none.map",
+                           tgrey::durability_none, "mmap none");
+    check_traversal_writes("mmap:" + dir + "/fsync.map",
+                           tgrey::durability_fsync, "mmap fsync");
+    check_failing_visitor("mmap:" + dir + "/failing.map", "mmap");
+    check_write_batch("mmap:" + dir + "/batch.map", "mmap");
+    check_mmap_slots(dir + "/slots.map");
+
+    check_traversal_writes("ram:" + dir + "/none.ram",
+                           tgrey::durability_none, "ram none");
+    check_traversal_writes("ram:" + dir + "/fsync.ram",
+                           tgrey::durability_fsync, "ram fsync");
+    check_failing_visitor("ram:" + dir + "/failing.ram", "ram");
+    check_write_batch("ram:" + dir + "/batch.ram", "ram");
+    check_ram_replay(dir);
+    check_ram_log_failure(dir);
+
+    check_write_batch("tdb:" + dir + "/sharded.tdb,shards=2", "shards");
+  }
+  catch(const std::exception& err) {
+    std::cerr << "FAIL: " << err.what() << std::endl;
+    failures++;
+  }
+
+  remove_dir(dir);
+  return failures ? 1 : 0;
+}
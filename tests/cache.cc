@@ -0,0 +1,180 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include "cache.hh"
+#include "database.hh"
+#include "greylist.hh"
+#include "logging.hh"
+#include "policy.hh"
+#include "record.hh"
+
+slo::logger tgrey::log;
+
+/** Number of checks that have failed so far.
+ ** ** **/
+unsigned int failures = 0;
+
+void check(bool cond, const std::string& what) {
+  if(cond)
+    return;
+
+  std::cerr << "FAIL: " << what << std::endl;
+  failures++;
+}
+
+std::string key(size_t i) {
+  std::ostringstream out;
+  out << "key" << i;
+  return out.str();
+}
+
+tgrey::record with_passes(uint32_t passes) {
+  tgrey::record rec;
+  rec.passes = passes;
+  return rec;
+}
+
+/** Entries are found until their time to live has passed, and a ttl of
+ ** 0 caches nothing at all.
+ ** ** **/
+void check_ttl() {
+  tgrey::record rec;
+
+  tgrey::record_cache kept(64, 60);
+  kept.update(key(0), with_passes(1));
+  check(kept.lookup(key(0), rec) && rec.passes == 1, "ttl: cached");
+  check(!kept.lookup(key(1), rec), "ttl: not cached");
+
+  kept.update(key(0), with_passes(2));
+  check(kept.lookup(key(0), rec) && rec.passes == 2, "ttl: updated");
+  check(kept.hits() == 2 && kept.misses() == 1, "ttl: hits and misses");
+
+  tgrey::record_cache none(64, 0);
+  none.update(key(0), with_passes(1));
+  check(!none.lookup(key(0), rec), "ttl 0: not cached");
+
+  tgrey::record_cache brief(64, 1);
+  brief.update(key(0), with_passes(1));
+  ::sleep(2);
+  check(!brief.lookup(key(0), rec), "ttl: expired");
+}
+
+/** A full cache replaces one entry per new key and keeps the others.
+ ** ** **/
+void check_eviction() {
+  tgrey::record_cache cache(16, 60);
+  const size_t capacity = cache.capacity();
+  tgrey::record rec;
+
+  check(capacity >= 16, "eviction: capacity");
+
+  for(size_t i = 0; i < capacity; ++i)
+    cache.update(key(i), with_passes(i));
+
+  size_t found = 0;
+
+  for(size_t i = 0; i < capacity; ++i)
+    found += cache.lookup(key(i), rec) && rec.passes == i;
+
+  check(found == capacity, "eviction: all cached while there is room");
+
+  cache.update(key(capacity), with_passes(capacity));
+  check(cache.lookup(key(capacity), rec) && rec.passes == capacity,
+        "eviction: new entry cached");
+
+  found = 0;
+
+  for(size_t i = 0; i < capacity; ++i)
+    found += cache.lookup(key(i), rec) && rec.passes == i;
+
+  check(found == capacity - 1, "eviction: a single entry replaced");
+}
+
+tgrey::policy_request request(const std::string& sender) {
+  const std::string req = "request=smtpd_access_policy\n"
+                          "sender=" + sender + "\n"
+                          "recipient=f@g.hi\n"
+                          "client_name=unknown\n"
+                          "client_address=10.0.0.1\n\n";
+  return tgrey::policy_request(req.data(), req.data() + req.length());
+}
+
+/** A triplet removed from the database by another process, such as
+ ** tgreyclean, stays in the cache until its entry expires: asking for
+ ** it again does not create it anew. Triplets removed by sweeping have
+ ** expired by their lifetime and so are created anew all the same.
+ ** ** **/
+void check_stale(const std::string& dir) {
+  tgrey::database db(dir + "/stale.tdb");
+  tgrey::record_cache cache(64, 60);
+  tgrey::record_cache uncached(64, 0);
+  const tgrey::policy_request req = request("a@b.de");
+  const std::string k = req.to_key(32, 128);
+  std::string val;
+
+  {
+    tgrey::greylist gl(db, 300, 0, 86400, 32, 128, false, &cache);
+    gl.handle(req);
+    db.remove(k);
+    gl.handle(req);
+    check(!db.fetch(k, val), "stale: removed triplet still cached");
+  }
+
+  {
+    tgrey::greylist gl(db, 300, 0, 86400, 32, 128, false, &uncached);
+    gl.handle(req);
+    db.remove(k);
+    gl.handle(req);
+    check(db.fetch(k, val), "stale: removed triplet created anew");
+  }
+
+  const tgrey::policy_request swept = request("c@d.de");
+  const std::string sk = swept.to_key(32, 128);
+  tgrey::greylist gl(db, 300, 0, 1, 32, 128, false, &cache, 0, false, 64);
+  gl.handle(swept);
+  ::sleep(2);
+  gl.idle();
+  check(!db.fetch(sk, val), "stale: expired triplet swept");
+  gl.handle(swept);
+  check(db.fetch(sk, val), "stale: swept triplet created anew");
+}
+
+int main() {
+  char tmpl[] = "/tmp/tgrey-test.XXXXXX";
+
+  if(!::mkdtemp(tmpl)) {
+    std::cerr << "FAIL: cannot create temporary directory" << std::endl;
+    return 1;
+  }
+
+  const std::string dir = tmpl;
+
+  try {
+    check_ttl();
+    check_eviction();
+    check_stale(dir);
+  }
+  catch(const std::exception& err) {
+    std::cerr << "FAIL: " << err.what() << std::endl;
+    failures++;
+  }
+
+  ::unlink((dir + "/stale.tdb").c_str());
+  ::rmdir(dir.c_str());
+  return failures ? 1 : 0;
+}
@@ -8,12 +8,19 @@
   included file COPYING.
  * * */
 
+#include <cstdlib>
 #include <iostream>
 #include "policy.hh"
 
-int main() {
+/** Print the key of the request on standard input, masking addresses
+ ** with the masks given as arguments, if any.
+ ** ** **/
+int main(int argc, const char* argv[]) {
+  const unsigned int v4mask = argc > 2 ? std::atoi(argv[1]) : 24;
+  const unsigned int v6mask = argc > 2 ? std::atoi(argv[2]) : 66;
+
   std::cout
-    << tgrey::policy_request(std::cin).to_key(24, 66)
+    << tgrey::policy_request(std::cin).to_key(v4mask, v6mask)
     << std::endl;
   return 0;
 }
@@ -0,0 +1,443 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "database.hh"
+#include "policy.hh"
+#include "record.hh"
+
+/** Number of checks that have failed so far.
+ ** ** **/
+unsigned int failures = 0;
+
+void check(bool cond, const std::string& what) {
+  if(cond)
+    return;
+
+  std::cerr << "FAIL: " << what << std::endl;
+  failures++;
+}
+
+/** The request for the triplet of sender number i. The triplets of even
+ ** numbers are cleared by seed() and let through, the others deferred.
+ ** ** **/
+std::string request(size_t i) {
+  std::ostringstream out;
+  out << "request=smtpd_access_policy\n"
+      << "sender=s" << i << "@b.de\n"
+      << "recipient=f@g.hi\n"
+      << "client_name=unknown\n"
+      << "client_address=10.0.0.1\n\n";
+  return out.str();
+}
+
+const std::string& response(size_t i) {
+  return i % 2 ? tgrey::policy_response::service_unavailable.wire
+               : tgrey::policy_response::dunno.wire;
+}
+
+/** Store cleared triplets for the even ones among the first count
+ ** senders, keyed as tgreylist does with its default masks.
+ ** ** **/
+void seed(const std::string& path, size_t count) {
+  tgrey::database db(path);
+  db.open();
+
+  tgrey::record rec;
+  rec.lastseen = rec.firstseen = ::time(0);
+  rec.cleared = true;
+
+  for(size_t i = 0; i < count; i += 2) {
+    const std::string req = request(i);
+    tgrey::policy_request pr(req.data(), req.data() + req.length());
+    db.store(pr.to_key(32, 128), tgrey::encode_record(rec));
+  }
+
+  db.commit();
+}
+
+/** Connect to a path for a UNIX domain socket or to 127.0.0.1:PORT.
+ ** Returns -1 if that fails.
+ ** ** **/
+int connect_to(const std::string& addr) {
+  int fd;
+
+  if(addr[0] == '/') {
+    struct sockaddr_un sun;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strncpy(sun.sun_path, addr.c_str(), sizeof(sun.sun_path) - 1);
+
+    fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if(fd >= 0 && ::connect(fd, (struct sockaddr*) &sun, sizeof(sun))) {
+      ::close(fd);
+      return -1;
+    }
+  }
+  else {
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(::atoi(addr.c_str() + addr.rfind(':') + 1));
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    fd = ::socket(AF_INET, SOCK_STREAM, 0);
+
+    if(fd >= 0 && ::connect(fd, (struct sockaddr*) &sin, sizeof(sin))) {
+      ::close(fd);
+      return -1;
+    }
+  }
+
+  return fd;
+}
+
+/** A TCP address on the loopback interface that nothing listens on.
+ ** ** **/
+std::string free_port() {
+  struct sockaddr_in sin;
+  socklen_t len = sizeof(sin);
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+
+  if(fd < 0 || ::bind(fd, (struct sockaddr*) &sin, sizeof(sin)) ||
+     ::getsockname(fd, (struct sockaddr*) &sin, &len))
+    throw std::runtime_error("cannot find a free TCP port");
+
+  ::close(fd);
+
+  std::ostringstream out;
+  out << "127.0.0.1:" << ntohs(sin.sin_port);
+  return out.str();
+}
+
+/** Run tgreylist --listen on the database in dir, logging to dir/log,
+ ** and wait until it accepts connections.
+ ** ** **/
+pid_t start(const std::string& dir, const std::string& addr,
+            const char* extra = 0) {
+  pid_t pid = ::fork();
+
+  if(!pid) {
+    int fd = ::open((dir + "/log").c_str(),
+                    O_WRONLY | O_CREAT | O_APPEND, 0600);
+    ::dup2(fd, STDERR_FILENO);
+
+    const std::string db = dir + "/greylist.tdb";
+    ::execl("./tgreylist", "tgreylist", "-e", "-D", db.c_str(),
+            "-L", addr.c_str(), extra, (char*) 0);
+    ::_exit(127);
+  }
+
+  for(int i = 0; pid > 0 && i < 250; ++i) {
+    int fd = connect_to(addr);
+
+    if(fd >= 0) {
+      ::close(fd);
+      return pid;
+    }
+
+    ::usleep(20000);
+  }
+
+  throw std::runtime_error("tgreylist does not listen on " + addr);
+}
+
+/** Stop the server and check that it exits cleanly.
+ ** ** **/
+void stop(pid_t pid, const std::string& what) {
+  int status = 0;
+  ::kill(pid, SIGTERM);
+  check(::waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+        !WEXITSTATUS(status), what + ": clean exit");
+}
+
+void send_all(int fd, const std::string& data) {
+  size_t done = 0;
+
+  while(done < data.length()) {
+    ssize_t num = ::write(fd, data.data() + done, data.length() - done);
+
+    if(num <= 0)
+      throw std::runtime_error("error writing request");
+
+    done += num;
+  }
+}
+
+/** Read count responses, giving up after five seconds without any data.
+ ** ** **/
+std::vector<std::string> receive(int fd, size_t count) {
+  std::vector<std::string> res;
+  std::string buf;
+  char chunk[4096];
+
+  while(res.size() < count) {
+    size_t end = buf.find("\n\n");
+
+    if(end != std::string::npos) {
+      res.push_back(buf.substr(0, end + 2));
+      buf.erase(0, end + 2);
+      continue;
+    }
+
+    struct pollfd pfd = { fd, POLLIN, 0 };
+
+    if(::poll(&pfd, 1, 5000) <= 0)
+      break;
+
+    ssize_t num = ::read(fd, chunk, sizeof(chunk));
+
+    if(num <= 0)
+      break;
+
+    buf.append(chunk, num);
+  }
+
+  return res;
+}
+
+/** Check the responses to the requests of the given senders.
+ ** ** **/
+void check_responses(const std::vector<std::string>& res,
+                     const std::vector<size_t>& senders,
+                     const std::string& what) {
+  check(res.size() == senders.size(), what + ": all answered");
+
+  for(size_t i = 0; i < res.size() && i < senders.size(); ++i) {
+    std::ostringstream out;
+    out << what << ": response " << i << " for sender " << senders[i];
+    check(res[i] == response(senders[i]), out.str());
+  }
+}
+
+/** Several clients connected at the same time, each sending a few
+ ** requests in a single write.
+ ** ** **/
+void check_clients(const std::string& addr, const std::string& what) {
+  const size_t clients = 8, requests = 3;
+  std::vector<int> fds;
+
+  for(size_t c = 0; c < clients; ++c)
+    fds.push_back(connect_to(addr));
+
+  for(size_t c = 0; c < clients; ++c) {
+    std::string batch;
+
+    for(size_t r = 0; r < requests; ++r)
+      batch += request(c + r);
+
+    if(fds[c] >= 0)
+      send_all(fds[c], batch);
+  }
+
+  for(size_t c = 0; c < clients; ++c) {
+    std::ostringstream client;
+    client << what << " client " << c;
+    check(fds[c] >= 0, client.str() + ": connect");
+
+    if(fds[c] < 0)
+      continue;
+
+    std::vector<size_t> senders;
+
+    for(size_t r = 0; r < requests; ++r)
+      senders.push_back(c + r);
+
+    check_responses(receive(fds[c], requests), senders, client.str());
+    ::close(fds[c]);
+  }
+}
+
+/** Requests arriving in pieces: one a few bytes at a time, then two
+ ** split in the middle of the second one.
+ ** ** **/
+void check_partial(const std::string& addr, const std::string& what) {
+  int fd = connect_to(addr);
+  check(fd >= 0, what + " partial: connect");
+
+  if(fd < 0)
+    return;
+
+  const std::string first = request(0);
+
+  for(size_t pos = 0; pos < first.length(); pos += 5) {
+    send_all(fd, first.substr(pos, 5));
+    ::usleep(1000);
+  }
+
+  std::vector<size_t> senders(1, 0);
+  check_responses(receive(fd, 1), senders, what + " partial bytes");
+
+  const std::string two = request(1) + request(2);
+  const size_t cut = request(1).length() + 20;
+  send_all(fd, two.substr(0, cut));
+  ::usleep(20000);
+  send_all(fd, two.substr(cut));
+
+  senders.clear();
+  senders.push_back(1);
+  senders.push_back(2);
+  check_responses(receive(fd, 2), senders, what + " partial split");
+  ::close(fd);
+}
+
+/** With worker threads, the responses of every connection still come
+ ** in the order of its requests, sent all at once.
+ ** ** **/
+void check_order(const std::string& addr, const std::string& what) {
+  const size_t clients = 4, requests = 16;
+  std::vector<int> fds;
+  std::vector<size_t> senders;
+
+  for(size_t r = 0; r < requests; ++r)
+    senders.push_back(r);
+
+  for(size_t c = 0; c < clients; ++c) {
+    fds.push_back(connect_to(addr));
+    std::string batch;
+
+    for(size_t r = 0; r < requests; ++r)
+      batch += request(r);
+
+    if(fds[c] >= 0)
+      send_all(fds[c], batch);
+  }
+
+  for(size_t c = 0; c < clients; ++c) {
+    std::ostringstream client;
+    client << what << " order " << c;
+    check(fds[c] >= 0, client.str() + ": connect");
+
+    if(fds[c] < 0)
+      continue;
+
+    check_responses(receive(fds[c], requests), senders, client.str());
+    ::close(fds[c]);
+  }
+}
+
+/** Clients asking for the same new triplet at the same time: all are
+ ** deferred and the triplet is only created once.
+ ** ** **/
+void check_same_triplet(const std::string& addr, const std::string& what) {
+  const size_t clients = 8, sender = 101;
+  std::vector<int> fds;
+
+  for(size_t c = 0; c < clients; ++c)
+    fds.push_back(connect_to(addr));
+
+  for(size_t c = 0; c < clients; ++c)
+    if(fds[c] >= 0)
+      send_all(fds[c], request(sender));
+
+  for(size_t c = 0; c < clients; ++c) {
+    std::ostringstream client;
+    client << what << " same triplet " << c;
+    check(fds[c] >= 0, client.str() + ": connect");
+
+    if(fds[c] < 0)
+      continue;
+
+    check_responses(receive(fds[c], 1), std::vector<size_t>(1, sender),
+                    client.str());
+    ::close(fds[c]);
+  }
+}
+
+/** Number of lines in the log of the servers containing the text.
+ ** ** **/
+size_t count_log(const std::string& dir, const std::string& text) {
+  std::ifstream in((dir + "/log").c_str());
+  std::string line;
+  size_t count = 0;
+
+  while(std::getline(in, line))
+    if(line.find(text) != std::string::npos)
+      count++;
+
+  return count;
+}
+
+/** Remove the files created in dir, then dir itself.
+ ** ** **/
+void remove_dir(const std::string& dir) {
+  ::unlink((dir + "/greylist.tdb").c_str());
+  ::unlink((dir + "/log").c_str());
+  ::unlink((dir + "/sock").c_str());
+  ::rmdir(dir.c_str());
+}
+
+int main() {
+  char tmpl[] = "/tmp/tgrey-test.XXXXXX";
+
+  if(!::mkdtemp(tmpl)) {
+    std::cerr << "FAIL: cannot create temporary directory" << std::endl;
+    return 1;
+  }
+
+  const std::string dir = tmpl;
+  ::signal(SIGPIPE, SIG_IGN);
+
+  try {
+    seed(dir + "/greylist.tdb", 16);
+
+    const std::string sock = dir + "/sock";
+    pid_t pid = start(dir, sock);
+    check_clients(sock, "unix");
+    check_partial(sock, "unix");
+    stop(pid, "unix");
+    check(::access(sock.c_str(), F_OK), "unix: socket removed");
+
+    const std::string tcp = free_port();
+    pid = start(dir, tcp);
+    check_clients(tcp, "tcp");
+    check_partial(tcp, "tcp");
+    stop(pid, "tcp");
+
+    pid = start(dir, sock, "--threads=4");
+    check_clients(sock, "workers");
+    check_partial(sock, "workers");
+    check_order(sock, "workers");
+    check_same_triplet(sock, "workers");
+    stop(pid, "workers");
+    check(count_log(dir, "new ( s101@b.de") == 1,
+          "workers: same triplet created once");
+  }
+  catch(const std::exception& err) {
+    std::cerr << "FAIL: " << err.what() << std::endl;
+    failures++;
+  }
+
+  remove_dir(dir);
+  return failures ? 1 : 0;
+}
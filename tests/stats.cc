@@ -0,0 +1,230 @@
+/* * *
+  This file is part of the tgrey software package.
+
+  Copyright (c) 2014, Florian Wagner <florian@wagner-flo.net>.
+  All rights reserved.
+
+  The simplified (2-clause) BSD license applies. See also the
+  included file COPYING.
+ * * */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include "stats.hh"
+
+/** Number of checks that have failed so far.
+ ** ** **/
+unsigned int failures = 0;
+
+void check(bool cond, const std::string& what) {
+  if(cond)
+    return;
+
+  std::cerr << "FAIL: " << what << std::endl;
+  failures++;
+}
+
+/** Name of a segment private to this run of the test.
+ ** ** **/
+std::string segment(const std::string& what) {
+  std::ostringstream out;
+  out << "/tgrey-test-" << ::getpid() << "-" << what;
+  return out.str();
+}
+
+/** Run tgreystat on a segment, returning its output and exit status.
+ ** ** **/
+int tgreystat(const std::string& name, std::string& out) {
+  const std::string cmd = "./tgreystat --stats=" + name + " 2>/dev/null";
+  FILE* pipe = ::popen(cmd.c_str(), "r");
+  char buf[256];
+
+  if(!pipe)
+    throw std::runtime_error("cannot run tgreystat");
+
+  out.clear();
+
+  while(size_t num = ::fread(buf, 1, sizeof(buf), pipe))
+    out.append(buf, num);
+
+  int status = ::pclose(pipe);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/** The latency a single sample is reported as: the highest one of its
+ ** bucket, which has to be in the same bucket, not below the sample,
+ ** and right before the next bucket.
+ ** ** **/
+void check_bucket(uint64_t ns) {
+  tgrey::statistics stats;
+  stats.record(tgrey::stage_parse, ns);
+
+  const size_t idx = tgrey::latency_bucket(ns);
+  const uint64_t high = stats.percentile(tgrey::stage_parse, 0.5);
+
+  std::ostringstream what;
+  what << "bucket of " << ns << " (" << idx << ", up to " << high << ")";
+
+  check(stats.samples(tgrey::stage_parse) == 1, what.str() + ": counted");
+  check(stats.percentile(tgrey::stage_parse, 0.999) == high,
+        what.str() + ": same for every percentile");
+
+  if(idx == tgrey::latency_buckets - 1) {
+    check(ns >= high - high / tgrey::latency_sub,
+          what.str() + ": last bucket");
+    return;
+  }
+
+  check(high >= ns, what.str() + ": bound not below");
+  check(tgrey::latency_bucket(high) == idx, what.str() + ": bound inside");
+  check(tgrey::latency_bucket(high + 1) == idx + 1,
+        what.str() + ": next bucket after bound");
+  check(high - ns <= ns / tgrey::latency_sub, what.str() + ": error");
+}
+
+/** Buckets and the percentiles read back from them for the values with
+ ** a bucket each, the powers of two and around them, and values too
+ ** large for all but the last bucket.
+ ** ** **/
+void check_buckets() {
+  for(uint64_t ns = 0; ns < 2 * tgrey::latency_sub; ++ns) {
+    check(tgrey::latency_bucket(ns) == ns, "bucket of small value");
+    check_bucket(ns);
+  }
+
+  for(unsigned int exp = 4; exp < 64; ++exp) {
+    const uint64_t pow = uint64_t(1) << exp;
+    const size_t idx = tgrey::latency_bucket(pow);
+    const size_t below = tgrey::latency_bucket(pow - 1);
+
+    check(idx == std::min(below + 1, tgrey::latency_buckets - 1) &&
+          (idx % tgrey::latency_sub == 0 ||
+           idx == tgrey::latency_buckets - 1),
+          "bucket starts at power of two");
+
+    check_bucket(pow - 1);
+    check_bucket(pow);
+    check_bucket(pow + pow / 2);
+  }
+
+  check(tgrey::latency_bucket(~uint64_t(0)) == tgrey::latency_buckets - 1,
+        "largest value in last bucket");
+  check_bucket(~uint64_t(0));
+
+  tgrey::statistics empty;
+  check(!empty.percentile(tgrey::stage_parse, 0.5), "no samples");
+}
+
+/** Creating a segment, counting in it through two mappings of it and
+ ** showing the counts with tgreystat.
+ ** ** **/
+void check_counting() {
+  const std::string name = segment("counting");
+  tgrey::statistics first;
+  first.add(tgrey::stat_new, 5);
+  first.open(name);
+
+  struct stat st;
+  int fd = ::shm_open(name.c_str(), O_RDONLY, 0);
+  check(fd >= 0 && !::fstat(fd, &st) &&
+        size_t(st.st_size) == sizeof(tgrey::stats_block),
+        "stats: segment created");
+
+  if(fd >= 0)
+    ::close(fd);
+
+  check(first.get(tgrey::stat_new) == 0, "stats: earlier counts dropped");
+
+  tgrey::statistics second;
+  second.open(name);
+  first.add(tgrey::stat_new, 3);
+  second.add(tgrey::stat_ok);
+  second.add(tgrey::stat_removed, 7);
+
+  check(second.get(tgrey::stat_new) == 3, "stats: counts shared");
+  check(first.get(tgrey::stat_ok) == 1, "stats: counts shared back");
+
+  tgrey::statistics reader;
+  reader.open(name, false);
+  check(reader.get(tgrey::stat_removed) == 7, "stats: read only");
+
+  std::ostringstream expected;
+
+  for(size_t i = 0; i < tgrey::stat_counters; ++i)
+    expected << std::left << std::setw(13) << tgrey::stat_names[i]
+             << first.get(tgrey::stat_counter(i)) << std::endl;
+
+  std::string out;
+  check(tgreystat(name, out) == 0, "tgreystat: exit status");
+  check(out == expected.str(), "tgreystat: counters printed");
+
+  ::shm_unlink(name.c_str());
+}
+
+/** Segments of another size or without the header of this version are
+ ** rejected, both by the programs counting and by tgreystat.
+ ** ** **/
+void check_mismatch() {
+  const std::string sizes = segment("size");
+  const std::string header = segment("header");
+  std::string out;
+
+  int fd = ::shm_open(sizes.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+  check(fd >= 0 && !::ftruncate(fd, 4096), "mismatch: create size");
+  ::close(fd);
+
+  fd = ::shm_open(header.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+  check(fd >= 0 && !::ftruncate(fd, sizeof(tgrey::stats_block)),
+        "mismatch: create header");
+  ::close(fd);
+
+  const std::string names[] = { sizes, header };
+
+  for(int i = 0; i < 2; ++i) {
+    bool rejected = false;
+
+    try {
+      tgrey::statistics stats;
+      stats.open(names[i]);
+    }
+    catch(const std::runtime_error&) {
+      rejected = true;
+    }
+
+    check(rejected, "mismatch: rejected " + names[i]);
+    check(tgreystat(names[i], out) != 0,
+          "tgreystat: mismatch rejected " + names[i]);
+  }
+
+  check(tgreystat(segment("missing"), out) != 0,
+        "tgreystat: missing segment");
+
+  ::shm_unlink(sizes.c_str());
+  ::shm_unlink(header.c_str());
+}
+
+int main() {
+  try {
+    check_buckets();
+    check_counting();
+    check_mismatch();
+  }
+  catch(const std::exception& err) {
+    std::cerr << "FAIL: " << err.what() << std::endl;
+    failures++;
+  }
+
+  return failures ? 1 : 0;
+}